@@ -86,6 +86,35 @@ void fileio_write_to_file(char *filename, uint8_t *data, uint32_t len)
     fil.close();
 }
 
+/*
+ * Function: Adds data to the end of a file. The file is created if it does not exist.
+ * Not speed critical
+ * ----------------------------
+ *   Returns: Void
+ *
+ *   filename: The filename to append to
+ *   data: Pointer to the array of data to be appended
+ *   len: Number of bytes to append.
+ */
+void fileio_append_to_file(const char *filename, uint8_t *data, uint32_t len)
+{
+    FsFile fil = SD.sdfs.open(filename, O_WRITE | O_CREAT | O_AT_END);
+    if (fil == false)
+    {
+        debug_print_error("[FILEIO] ERROR: Could not open %s for APPEND\n", filename);
+        return;
+    }
+    if (fil.write(data, len) != len)
+    {
+        debug_print_error("[FILEIO] ERROR: Could not append to %s\n", filename);
+    }
+    else
+    {
+        debug_print_fatfs("[FILEIO] Appended %u bytes to %s ok!\n", len, filename);
+    }
+    fil.close();
+}
+
 /*
  * Function: Restore a file from non-volatile storage into RAM. This will return 0x00's if the file does not exist.
  * Not speed critical
@@ -9,6 +9,7 @@
 
 void fileio_init(void);
 void fileio_write_to_file(char *filename, uint8_t *data, uint32_t len);
+void fileio_append_to_file(const char *filename, uint8_t *data, uint32_t len);
 void fileio_read_from_file(char *filename, uint32_t file_offset, uint8_t *data, uint32_t len);
 uint32_t fileio_list_directory(char **list, uint32_t max);
 
@@ -2,9 +2,11 @@
 // SPDX-License-Identifier: MIT
 
 #include <Arduino.h>
+#include <utility>
 #include "USBHost_t36.h"
 #include "usb64_conf.h"
 #include "n64_controller.h"
+#include "n64_wrapper.h"
 #include "input.h"
 #include "printf.h"
 #include "tft.h"
@@ -50,14 +52,49 @@ uint32_t hardwired1;
 
 #define MAX_USB_CONTROLLERS (8)
 static input input_devices[MAX_CONTROLLERS];
-static uint8_t kb_keys_pressed[RANDNET_MAX_BUTTONS];
 
+#if (MAX_KB >= 1)
+//Keys held on each keyboard in kbcontroller, and whether it has changed since input_get_state last read it.
+//Written by that keyboard's own USB callbacks.
+typedef struct
+{
+    uint8_t keys_pressed[RANDNET_MAX_BUTTONS];
+    volatile bool report_pending;
+    volatile uint32_t report_clks; //When report_pending was set, in timer ticks
+} input_kb_state;
+static input_kb_state kb_state[MAX_KB];
+#endif
+
+//Report arrival times, in timer ticks. A report is stamped when input_has_new_report first sees it.
+static bool report_seen[MAX_CONTROLLERS];
+static uint32_t report_seen_clks[MAX_CONTROLLERS];
+static uint32_t report_clks[MAX_CONTROLLERS]; //Arrival time of the report last read by input_get_state
+
+//Called by input_get_state as it reads a device. If there was a new report its arrival time is kept for
+//input_get_report_time. Reports that input_has_new_report never saw are stamped now.
+static void _consume_report(uint8_t id, bool new_report)
+{
+    if (new_report)
+        report_clks[id] = report_seen[id] ? report_seen_clks[id] : n64hal_hs_tick_get();
+    report_seen[id] = false;
+}
+
+#if (MAX_KB >= 1)
+static void kb_report(input_kb_state *kb)
+{
+    (kb->report_pending) ? (0) : kb->report_clks = n64hal_hs_tick_get();
+    kb->report_pending = true;
+}
+
+//The keyboard callbacks aren't told which keyboard they are for, so there is an instance for each.
+template <uint32_t k>
 static void kb_pressed_cb(uint8_t keycode)
 {
+    input_kb_state *kb = &kb_state[k];
     //Check if its already pressed
     for (int i = 0; i < RANDNET_MAX_BUTTONS; i++)
     {
-        if (kb_keys_pressed[i] == keycode)
+        if (kb->keys_pressed[i] == keycode)
         {
             return;
         }
@@ -65,25 +102,233 @@ static void kb_pressed_cb(uint8_t keycode)
     //Register the keypress
     for (int i = 0; i < RANDNET_MAX_BUTTONS; i++)
     {
-        if (kb_keys_pressed[i] == 0)
+        if (kb->keys_pressed[i] == 0)
         {
-            kb_keys_pressed[i] = keycode;
+            kb->keys_pressed[i] = keycode;
+            kb_report(kb);
             break;
         }
     }
 }
 
+template <uint32_t k>
 static void kb_released_cb(uint8_t keycode)
 {
+    input_kb_state *kb = &kb_state[k];
     for (int i = 0; i < RANDNET_MAX_BUTTONS; i++)
     {
-        if (kb_keys_pressed[i] == keycode)
+        if (kb->keys_pressed[i] == keycode)
+        {
+            kb->keys_pressed[i] = 0;
+            kb_report(kb);
+        }
+    }
+}
+
+//Starts keyboard k with no keys held and attaches its callbacks.
+template <size_t... k>
+static void kb_attach(uint32_t i, std::index_sequence<k...>)
+{
+    static void (*const pressed[])(uint8_t) = {kb_pressed_cb<k>...};
+    static void (*const released[])(uint8_t) = {kb_released_cb<k>...};
+    memset(&kb_state[i], 0, sizeof(input_kb_state));
+    kbcontroller[i]->attachRawPress(pressed[i]);
+    kbcontroller[i]->attachRawRelease(released[i]);
+}
+
+//Returns the state of the keyboard registered to input device id.
+static input_kb_state *kb_get_state(int id)
+{
+    for (uint32_t i = 0; i < MAX_KB; i++)
+    {
+        if (kbcontroller[i] == input_devices[id].driver)
+            return &kb_state[i];
+    }
+    return NULL;
+}
+#endif
+
+//Declarative game controller mappings. Each is compiled by input_init into byte indexed lookup tables, so adding a
+//controller is a matter of adding a mapping here and its USB device to input_devices_mapped.
+#define INPUT_MAX_BUTTON_RULES 32
+#define INPUT_MAX_AXIS_RULES 12
+#define N64_C_ALL (N64_CU | N64_CD | N64_CL | N64_CR)
+
+//A USB button bit and the N64 buttons it presses. Unused entries are left zero.
+typedef struct
+{
+    uint8_t bit;
+    uint16_t n64_buttons;
+} input_button_rule;
+
+//N64 buttons pressed while an axis is above (direction 1) or below (direction -1) a threshold. Unused entries are left zero.
+typedef struct
+{
+    uint8_t axis;
+    int8_t direction;
+    int32_t threshold;
+    uint16_t n64_buttons;
+} input_axis_rule;
+
+//An analog axis scaled to +/-100 as (axis - centre) * 100 / range, negated if invert is set. range 0 for no axis.
+typedef struct
+{
+    uint8_t axis;
+    int32_t centre;
+    int32_t range;
+    bool invert;
+} input_stick_axis;
+
+typedef struct
+{
+    input_button_rule buttons[INPUT_MAX_BUTTON_RULES];
+    input_axis_rule axis_buttons[INPUT_MAX_AXIS_RULES];
+    input_stick_axis stick[2];       //x, y
+    input_stick_axis right_stick[2]; //x, y for dual stick mode
+    int8_t hat_axis;                 //Axis with the D pad as a hat switch. -1 for none
+    int8_t combo_button;             //USB button bit to hold for combos. -1 for none
+} input_mapping;
+
+enum
+{
+    INPUT_MAP_XBOX360,
+    INPUT_MAP_XBOXONE,
+    INPUT_MAP_XBOXDUKE,
+    INPUT_MAP_PS3,
+    INPUT_MAP_PS4,
+    INPUT_MAP_NEXT_SNES,
+    INPUT_NUM_MAPS
+};
+
+static const input_mapping input_mappings[INPUT_NUM_MAPS] = {
+    //XBOX360
+    //FIXME Modifier to make A,B,X,Y be C buttons
+    {{{0, N64_DU}, {1, N64_DD}, {2, N64_DL}, {3, N64_DR}, {4, N64_ST}, {8, N64_LB}, {9, N64_RB},
+      {12, N64_A}, {13, N64_B}, {14, N64_B} /*X*/, {7, N64_C_ALL} /*RS*/},
+     {{4, 1, 10, N64_Z} /*LT*/, {5, 1, 10, N64_Z} /*RT*/,
+      {2, 1, 16000, N64_CR}, {2, -1, -16000, N64_CL}, {3, 1, 16000, N64_CU}, {3, -1, -16000, N64_CD}},
+     {{0, 0, 32768, false}, {1, 0, 32768, false}},
+     {{2, 0, 32768, false}, {3, 0, 32768, false}},
+     -1, 5 /*BACK*/},
+
+    //XBOXONE
+    {{{8, N64_DU}, {9, N64_DD}, {10, N64_DL}, {11, N64_DR}, {2, N64_ST}, {12, N64_LB}, {13, N64_RB},
+      {4, N64_A}, {5, N64_B}, {6, N64_B} /*X*/, {15, N64_C_ALL} /*RS*/},
+     {{3, 1, 10, N64_Z} /*LT*/, {4, 1, 10, N64_Z} /*RT*/,
+      {2, 1, 16000, N64_CR}, {2, -1, -16000, N64_CL}, {5, 1, 16000, N64_CU}, {5, -1, -16000, N64_CD}},
+     {{0, 0, 32768, false}, {1, 0, 32768, false}},
+     {{2, 0, 32768, false}, {5, 0, 32768, false}},
+     -1, 3 /*BACK*/},
+
+    //XBOXDUKE. The face buttons are analog
+    //FIXME Modifier to make A,B,X,Y be C buttons
+    {{{0, N64_DU}, {1, N64_DD}, {2, N64_DL}, {3, N64_DR}, {4, N64_ST}},
+     {{0, 1, 0x20, N64_A}, {1, 1, 0x20, N64_B}, {2, 1, 0x20, N64_B} /*X*/,
+      {4, 1, 0x20, N64_RB} /*Black*/, {5, 1, 0x20, N64_LB} /*White*/,
+      {6, 1, 10, N64_Z} /*LT*/, {7, 1, 10, N64_Z} /*RT*/,
+      {10, 1, 16000, N64_CR}, {10, -1, -16000, N64_CL}, {11, 1, 16000, N64_CU}, {11, -1, -16000, N64_CD}},
+     {{8, 0, 32768, false}, {9, 0, 32768, false}},
+     {{10, 0, 32768, false}, {11, 0, 32768, false}},
+     -1, 5 /*BACK*/},
+
+    //PS3. Buttons and axes as the DS3 HID report describes them. The D pad is four buttons, not a hat switch.
+    {{{3, N64_ST}, {10, N64_LB} /*L1*/, {11, N64_RB} /*R1*/, {8, N64_Z} /*L2*/, {9, N64_Z} /*R2*/,
+      {14, N64_A} /*X*/, {15, N64_B} /*SQUARE*/, {13, N64_B} /*CIRCLE*/, {2, N64_C_ALL} /*RS*/,
+      {4, N64_DU}, {6, N64_DD}, {7, N64_DL}, {5, N64_DR}},
+     {{2, 1, 256 / 2 + 64, N64_CR}, {2, -1, 256 / 2 - 64, N64_CL},
+      {5, 1, 256 / 2 + 64, N64_CD}, {5, -1, 256 / 2 - 64, N64_CU}},
+     {{0, 127, 127, false}, {1, 127, 127, true}},
+     {{2, 127, 127, false}, {5, 127, 127, true}},
+     -1, 0 /*SELECT*/},
+
+    //PS4
+    {{{9, N64_ST}, {4, N64_LB} /*L1*/, {5, N64_RB} /*R1*/, {6, N64_Z} /*L2*/, {7, N64_Z} /*R2*/,
+      {1, N64_A} /*X*/, {0, N64_B} /*SQUARE*/, {2, N64_B} /*CIRCLE*/, {11, N64_C_ALL} /*RS*/},
+     {{2, 1, 256 / 2 + 64, N64_CR}, {2, -1, 256 / 2 - 64, N64_CL},
+      {5, 1, 256 / 2 + 64, N64_CD}, {5, -1, 256 / 2 - 64, N64_CU}},
+     {{0, 127, 127, false}, {1, 127, 127, true}},
+     {{2, 127, 127, false}, {5, 127, 127, true}},
+     9, 8 /*SHARE*/},
+
+    //NEXT SNES Controller. Generic HID, so the button numbers are from a bit of trial and error.
+    //You can use the mapper helper in input_get_state to assist.
+    //The controller doesnt have enough buttons, so we're missing alot here.
+    {{{9, N64_ST}, {4, N64_Z}, {6, N64_RB}, {2, N64_A}, {1, N64_B}, {3, N64_B}},
+     {},
+     {{0, 127, 127, false}, {1, 127, 127, true}},
+     {},
+     -1, 8},
+};
+
+//Which mapping each USB game controller uses. vid and pid 0 match any device of that type.
+typedef struct
+{
+    JoystickController::joytype_t type;
+    uint16_t vid;
+    uint16_t pid;
+    uint8_t map;
+} input_device_mapping;
+
+static const input_device_mapping input_devices_mapped[] = {
+    {JoystickController::XBOX360, 0, 0, INPUT_MAP_XBOX360},
+    {JoystickController::XBOX360_WIRED, 0, 0, INPUT_MAP_XBOX360},
+    {JoystickController::XBOXONE, 0, 0, INPUT_MAP_XBOXONE},
+    {JoystickController::XBOXDUKE, 0, 0, INPUT_MAP_XBOXDUKE},
+    {JoystickController::PS3, 0, 0, INPUT_MAP_PS3},
+    {JoystickController::PS4, 0, 0, INPUT_MAP_PS4},
+    {JoystickController::UNKNOWN, 0x0810, 0xE501, INPUT_MAP_NEXT_SNES},
+};
+
+//D pad directions for hat switch values 0 to 7
+static const uint16_t input_hat_buttons[8] = {N64_DU, N64_DU | N64_DR, N64_DR, N64_DR | N64_DD,
+                                              N64_DD, N64_DD | N64_DL, N64_DL, N64_DL | N64_DU};
+
+//N64 buttons for each value of each byte of the USB button bits, built from input_mappings
+static uint16_t input_button_lut[INPUT_NUM_MAPS][4][256];
+
+static void _compile_mappings()
+{
+    for (uint32_t map = 0; map < INPUT_NUM_MAPS; map++)
+    {
+        for (uint32_t byte = 0; byte < 4; byte++)
         {
-            kb_keys_pressed[i] = 0;
+            for (uint32_t value = 0; value < 256; value++)
+            {
+                uint16_t n64_buttons = 0;
+                for (uint32_t i = 0; i < INPUT_MAX_BUTTON_RULES; i++)
+                {
+                    const input_button_rule *r = &input_mappings[map].buttons[i];
+                    if ((r->bit / 8) == byte && (value & (1 << (r->bit % 8))))
+                        n64_buttons |= r->n64_buttons;
+                }
+                input_button_lut[map][byte][value] = n64_buttons;
+            }
         }
     }
 }
 
+static int _find_mapping(JoystickController *joy)
+{
+    for (uint32_t i = 0; i < sizeof(input_devices_mapped) / sizeof(input_device_mapping); i++)
+    {
+        const input_device_mapping *d = &input_devices_mapped[i];
+        if (d->type != joy->joystickType())
+            continue;
+        if (d->vid != 0 && (d->vid != joy->idVendor() || d->pid != joy->idProduct()))
+            continue;
+        return d->map;
+    }
+    return -1;
+}
+
+static int32_t _scale_axis(const input_stick_axis *a, const int32_t *axis)
+{
+    if (a->range == 0)
+        return 0;
+    int32_t value = (axis[a->axis] - a->centre) * 100 / a->range;
+    return (a->invert) ? -value : value;
+}
+
 static int _check_id(uint8_t id)
 {
     if (id > MAX_CONTROLLERS)
@@ -96,6 +341,7 @@ static int _check_id(uint8_t id)
 
 void input_init()
 {
+    _compile_mappings();
     usbh.begin();
     for (int i = 0; i < MAX_CONTROLLERS; i++)
     {
@@ -234,8 +480,7 @@ void input_update_input_devices()
                         input_devices[j].type = USB_KB;
                         debug_print_status("[INPUT] Register keyboard to slot %u\n", j);
                         tft_flag_update();
-                        kbcontroller[i]->attachRawPress(kb_pressed_cb);
-                        kbcontroller[i]->attachRawRelease(kb_released_cb);
+                        kb_attach(i, std::make_index_sequence<MAX_KB>());
                         break;
                     }
                 }
@@ -273,227 +518,60 @@ uint16_t input_get_state(uint8_t id, void *response, bool *combo_pressed)
         {
             _axis[i] = joy->getAxis(i);
         }
+        _consume_report(id, joy->available());
         joy->joystickDataClear();
 
-        switch (joy->joystickType())
+#if (0)
+        //Mapper helper
+        static uint32_t print_slower = 0;
+        if (joy->joystickType() == JoystickController::UNKNOWN && millis() - print_slower > 100)
         {
-        case JoystickController::XBOX360:
-        case JoystickController::XBOX360_WIRED:
-            //Digital usb_buttons
-            //FIXME Modifier to make A,B,X,Y be C buttons
-            if (_buttons & (1 << 0))  state->dButtons |= N64_DU;  //DUP
-            if (_buttons & (1 << 1))  state->dButtons |= N64_DD;  //DDOWN
-            if (_buttons & (1 << 2))  state->dButtons |= N64_DL;  //DLEFT
-            if (_buttons & (1 << 3))  state->dButtons |= N64_DR;  //DRIGHT
-            if (_buttons & (1 << 4))  state->dButtons |= N64_ST;  //START
-            if (_buttons & (1 << 5))  state->dButtons |= 0;       //BACK
-            if (_buttons & (1 << 6))  state->dButtons |= 0;       //LS
-            if (_buttons & (1 << 7))  state->dButtons |= 0;       //RS
-            if (_buttons & (1 << 8))  state->dButtons |= N64_LB;  //LB
-            if (_buttons & (1 << 9))  state->dButtons |= N64_RB;  //RB
-            if (_buttons & (1 << 10)) state->dButtons |= 0;       //XBOX BUTTON
-            if (_buttons & (1 << 11)) state->dButtons |= 0;       //XBOX SYNC
-            if (_buttons & (1 << 12)) state->dButtons |= N64_A;   //A
-            if (_buttons & (1 << 13)) state->dButtons |= N64_B;   //B
-            if (_buttons & (1 << 14)) state->dButtons |= N64_B;   //X
-            if (_buttons & (1 << 15)) state->dButtons |= 0;       //Y
-            if (_buttons & (1 << 7))  state->dButtons |= N64_CU | //RS triggers
-                                                      N64_CD | //all C usb_buttons
-                                                      N64_CL |
-                                                      N64_CR;
-            //Analog stick (Normalise 0 to +/-100)
-            state->x_axis = _axis[0] * 100 / 32768;
-            state->y_axis = _axis[1] * 100 / 32768;
-
-            //Z button
-            if (_axis[4] > 10) state->dButtons |= N64_Z; //LT
-            if (_axis[5] > 10) state->dButtons |= N64_Z; //RT
-
-            //C usb_buttons
-            if (_axis[2] > 16000)  state->dButtons |= N64_CR;
-            if (_axis[2] < -16000) state->dButtons |= N64_CL;
-            if (_axis[3] > 16000)  state->dButtons |= N64_CU;
-            if (_axis[3] < -16000) state->dButtons |= N64_CD;
-
-            //Button to hold for 'combos'
-            if (combo_pressed)
-                *combo_pressed = (_buttons & (1 << 5)); //back
-
-            //Map right axis for dual stick mode
-            right_axis[0] = _axis[2] * 100 / 32768;
-            right_axis[1] = _axis[3] * 100 / 32768;
-
-            break;
-        case JoystickController::XBOXONE:
-            if (_buttons & (1 << 8))   state->dButtons |= N64_DU;   //DUP
-            if (_buttons & (1 << 9))   state->dButtons |= N64_DD;   //DDOWN
-            if (_buttons & (1 << 10))  state->dButtons |= N64_DL;   //DLEFT
-            if (_buttons & (1 << 11))  state->dButtons |= N64_DR;   //DRIGHT
-            if (_buttons & (1 << 2))   state->dButtons |= N64_ST;   //START
-            if (_buttons & (1 << 3))   state->dButtons |= 0;        //BACK
-            if (_buttons & (1 << 14))  state->dButtons |= 0;        //LS
-            if (_buttons & (1 << 15))  state->dButtons |= 0;        //RS
-            if (_buttons & (1 << 12))  state->dButtons |= N64_LB;   //LB
-            if (_buttons & (1 << 13))  state->dButtons |= N64_RB;   //RB
-            if (_buttons & (1 << 4))   state->dButtons |= N64_A;    //A
-            if (_buttons & (1 << 5))   state->dButtons |= N64_B;    //B
-            if (_buttons & (1 << 6))   state->dButtons |= N64_B;    //X
-            if (_buttons & (1 << 7))   state->dButtons |= 0;        //Y
-            if (_buttons & (1 << 15))   state->dButtons |= N64_CU | //RS triggers
-                                                        N64_CD | //all C usb_buttons
-                                                        N64_CL |
-                                                        N64_CR;
-            //Analog stick (Normalise 0 to +/-100)
-            state->x_axis = _axis[0] * 100 / 32768;
-            state->y_axis = _axis[1] * 100 / 32768;
-
-            //Z button
-            if (_axis[3] > 10) state->dButtons |= N64_Z; //LT
-            if (_axis[4] > 10) state->dButtons |= N64_Z; //RT
-
-            //C usb_buttons
-            if (_axis[2] > 16000)  state->dButtons |= N64_CR;
-            if (_axis[2] < -16000) state->dButtons |= N64_CL;
-            if (_axis[5] > 16000)  state->dButtons |= N64_CU;
-            if (_axis[5] < -16000) state->dButtons |= N64_CD;
-
-            //Button to hold for 'combos'
-            if (combo_pressed)
-                *combo_pressed = (_buttons & (1 << 3)); //back
-
-            right_axis[0] = _axis[2] * 100 / 32768;
-            right_axis[1] = _axis[5] * 100 / 32768;
-            break;
-        case JoystickController::XBOXDUKE:
-            //Digital usb_buttons
-            //FIXME Modifier to make A,B,X,Y be C buttons
-            if (_buttons & (1 << 0))  state->dButtons |= N64_DU;  //DUP
-            if (_buttons & (1 << 1))  state->dButtons |= N64_DD;  //DDOWN
-            if (_buttons & (1 << 2))  state->dButtons |= N64_DL;  //DLEFT
-            if (_buttons & (1 << 3))  state->dButtons |= N64_DR;  //DRIGHT
-            if (_buttons & (1 << 4))  state->dButtons |= N64_ST;  //START
-            if (_buttons & (1 << 5))  state->dButtons |= 0;       //BACK
-            if (_buttons & (1 << 6))  state->dButtons |= 0;       //LS
-            if (_buttons & (1 << 7))  state->dButtons |= 0;       //RS
-
-            if (_axis[0] > 0x20) state->dButtons |= N64_A;
-            if (_axis[1] > 0x20) state->dButtons |= N64_B;
-            if (_axis[2] > 0x20) state->dButtons |= N64_B;        //X
-            if (_axis[3] > 0x20) state->dButtons |= 0;            //Y
-            if (_axis[4] > 0x20) state->dButtons |= N64_RB;       //Black
-            if (_axis[5] > 0x20) state->dButtons |= N64_LB; //White
-
-            //Analog stick (Normalise 0 to +/-100)
-            state->x_axis = _axis[8] * 100 / 32768;
-            state->y_axis = _axis[9] * 100 / 32768;
-
-            //Z button
-            if (_axis[6] > 10) state->dButtons |= N64_Z; //LT
-            if (_axis[7] > 10) state->dButtons |= N64_Z; //RT
-
-            //C usb_buttons
-            if (_axis[10] > 16000)  state->dButtons |= N64_CR;
-            if (_axis[10] < -16000) state->dButtons |= N64_CL;
-            if (_axis[11] > 16000)  state->dButtons |= N64_CU;
-            if (_axis[11] < -16000) state->dButtons |= N64_CD;
-
-            //Button to hold for 'combos'
-            if (combo_pressed)
-                *combo_pressed = (_buttons & (1 << 5)); //back
-
-            //Map right axis for dual stick mode
-            right_axis[0] = _axis[10] * 100 / 32768;
-            right_axis[1] = _axis[11] * 100 / 32768;
+            debug_print_status("%04x %04i %04i %04i %04i\n", _buttons, _axis[0], _axis[1], _axis[2], _axis[3]);
+            if (_buttons)
+            {
+                int bit = 0;
+                while ((_buttons & (1 << bit++)) == 0);
+                debug_print_status("button bit: %i\n", bit-1);
+            }
+            print_slower = millis();
+        }
+#endif
+        //TODO: OTHER USB CONTROLLERS. Add them to input_mappings and input_devices_mapped.
+        int map = _find_mapping(joy);
+        if (map >= 0)
+        {
+            const input_mapping *m = &input_mappings[map];
 
-            break;
-        case JoystickController::PS4:
-            if (_buttons & (1 << 9))  state->dButtons |= N64_ST;  //START
-            if (_buttons & (1 << 4))  state->dButtons |= N64_LB;  //L1
-            if (_buttons & (1 << 5))  state->dButtons |= N64_RB;  //R1
-            if (_buttons & (1 << 6))  state->dButtons |= N64_Z;   //L2
-            if (_buttons & (1 << 7))  state->dButtons |= N64_Z;   //R2
-            if (_buttons & (1 << 1))  state->dButtons |= N64_A;   //X
-            if (_buttons & (1 << 0))  state->dButtons |= N64_B;   //SQUARE
-            if (_buttons & (1 << 2))  state->dButtons |= N64_B;   //CIRCLE
-            if (_buttons & (1 << 11)) state->dButtons |= N64_CU | //RS triggers
-                                                      N64_CD | //all C usb_buttons
-                                                      N64_CL |
-                                                      N64_CR;
-            //Analog stick (Normalise 0 to +/-100)
-            state->x_axis =  (_axis[0] - 127) * 100 / 127;
-            state->y_axis = -(_axis[1] - 127) * 100 / 127;
+            //Digital buttons are a lookup per byte of the USB button bits
+            state->dButtons = input_button_lut[map][0][(_buttons >> 0) & 0xFF] |
+                              input_button_lut[map][1][(_buttons >> 8) & 0xFF] |
+                              input_button_lut[map][2][(_buttons >> 16) & 0xFF] |
+                              input_button_lut[map][3][(_buttons >> 24) & 0xFF];
 
-            //D Pad button
-            switch(_axis[9])
+            //Triggers, analog face buttons and the right stick to buttons
+            for (uint32_t i = 0; i < INPUT_MAX_AXIS_RULES; i++)
             {
-                case 0: state->dButtons |= N64_DU; break;
-                case 1: state->dButtons |= N64_DU | N64_DR; break;
-                case 2: state->dButtons |= N64_DR; break;
-                case 3: state->dButtons |= N64_DR | N64_DD; break;
-                case 4: state->dButtons |= N64_DD; break;
-                case 5: state->dButtons |= N64_DD | N64_DL; break;
-                case 6: state->dButtons |= N64_DL; break;
-                case 7: state->dButtons |= N64_DL | N64_DU; break;
+                const input_axis_rule *r = &m->axis_buttons[i];
+                if ((r->direction > 0 && _axis[r->axis] > r->threshold) ||
+                    (r->direction < 0 && _axis[r->axis] < r->threshold))
+                    state->dButtons |= r->n64_buttons;
             }
 
-            //C usb_buttons
-            if (_axis[2] > 256/2 + 64)  state->dButtons |= N64_CR;
-            if (_axis[2] < 256/2 - 64)  state->dButtons |= N64_CL;
-            if (_axis[5] > 256/2 + 64)  state->dButtons |= N64_CD;
-            if (_axis[5] < 256/2 - 64)  state->dButtons |= N64_CU;
+            //D pad reported as a hat switch
+            if (m->hat_axis >= 0 && _axis[m->hat_axis] >= 0 && _axis[m->hat_axis] < 8)
+                state->dButtons |= input_hat_buttons[_axis[m->hat_axis]];
+
+            //Analog stick (Normalise 0 to +/-100)
+            state->x_axis = _scale_axis(&m->stick[0], _axis);
+            state->y_axis = _scale_axis(&m->stick[1], _axis);
 
             //Button to hold for 'combos'
-            if (combo_pressed)
-                *combo_pressed = (_buttons & (1 << 8)); //back
+            if (combo_pressed && m->combo_button >= 0)
+                *combo_pressed = (_buttons & (1UL << m->combo_button));
 
             //Map right axis for dual stick mode
-            right_axis[0] =  (_axis[2] - 127) * 100 / 127;
-            right_axis[1] = -(_axis[5] - 127) * 100 / 127;
-            break;
-        case JoystickController::UNKNOWN:
-            #if (0)
-            //Mapper helper
-            static uint32_t print_slower = 0;
-            if (millis() - print_slower > 100)
-            {
-                debug_print_status("%04x %04i %04i %04i %04i\n", _buttons, _axis[0], _axis[1], _axis[2], _axis[3]);
-                if (_buttons)
-                {
-                    int bit = 0;
-                    while ((_buttons & (1 << bit++)) == 0);
-                    debug_print_status("button bit: %i\n", bit-1);
-                }
-                print_slower = millis();
-            }
-            #endif
-            //Generic HID controllers //FIXME: Load from file?
-            //Example of a basic Chinese NES HID Controller. The button mapping nubmers are from a bit of trial and error.
-            //You can use the mapper helper above to assist.
-            //The controller doesnt have enough buttons, so we're missing alot here.
-            //NEXT SNES Controller
-            if (joy->idVendor() == 0x0810 && joy->idProduct() == 0xE501)
-            {
-                if (_buttons & (1 << 9))  state->dButtons |= N64_ST;
-                if (_buttons & (1 << 4))  state->dButtons |= N64_Z;
-                if (_buttons & (1 << 6))  state->dButtons |= N64_RB;
-                if (_buttons & (1 << 2)) state->dButtons |= N64_A;
-                if (_buttons & (1 << 1)) state->dButtons |= N64_B;
-                if (_buttons & (1 << 3)) state->dButtons |= N64_B;
-
-                //Button to hold for 'combos'
-                if (combo_pressed)
-                    *combo_pressed = (_buttons & (1 << 8)); //back
-
-                //Analog stick (Normalise 0 to +/-100)
-                state->x_axis = (_axis[0] - 127) * 100 / 127;
-                state->y_axis = - (_axis[1] - 127) * 100 / 127;
-            }
-            break;
-        //TODO: OTHER USB CONTROLLERS
-        case JoystickController::PS3:
-        case JoystickController::PS3_MOTION:
-        default:
-            break;
+            right_axis[0] = _scale_axis(&m->right_stick[0], _axis);
+            right_axis[1] = _scale_axis(&m->right_stick[1], _axis);
         }
 
         //Use 2.4 GOODHEAD layout, axis not inverted
@@ -539,6 +617,7 @@ uint16_t input_get_state(uint8_t id, void *response, bool *combo_pressed)
 
         static uint32_t idle_timer[4] = {0};
         if (mouse->available()) idle_timer[id] = millis();
+        _consume_report(id, mouse->available());
         mouse->mouseDataClear();
         if (millis() - idle_timer[id] > 100)
         {
@@ -567,19 +646,27 @@ uint16_t input_get_state(uint8_t id, void *response, bool *combo_pressed)
 
         //Get latest info from USB devices
         KeyboardController *kb = (KeyboardController *)input_devices[id].driver;
+        input_kb_state *keys = kb_get_state(id);
 
         kb->capsLock((state->led_state & RANDNET_LED_CAPSLOCK) != 0);
         kb->numLock((state->led_state & RANDNET_LED_NUMLOCK)  != 0);
         kb->scrollLock((state->led_state & RANDNET_LED_POWER) != 0);
+        if (keys->report_pending)
+        {
+            report_seen[id] = true;
+            report_seen_clks[id] = keys->report_clks;
+        }
+        _consume_report(id, keys->report_pending);
+        keys->report_pending = false;
         uint8_t home_key_flag = 0;
         //Map up to 3 keys to the randnet response packet
         for (int i = 0; i < RANDNET_MAX_BUTTONS; i++)
         {
             state->buttons[i] = 0;
-            if (kb_keys_pressed[i] == 0)
+            if (keys->keys_pressed[i] == 0)
                 continue;
 
-            if (kb_keys_pressed[i] == (uint8_t)(KEY_HOME & 0xFF))
+            if (keys->keys_pressed[i] == (uint8_t)(KEY_HOME & 0xFF))
             {
                 home_key_flag = 1;
                 continue;
@@ -589,7 +676,7 @@ uint16_t input_get_state(uint8_t id, void *response, bool *combo_pressed)
             uint16_t randnet_code = 0;
             for (uint32_t j = 0; j < (sizeof(randnet_map) / sizeof(randnet_map_t)); j++)
             {
-                if (kb_keys_pressed[i] == (uint8_t)(randnet_map[j].keypad & 0xFF))
+                if (keys->keys_pressed[i] == (uint8_t)(randnet_map[j].keypad & 0xFF))
                 {
                     randnet_code = randnet_map[j].randnet_matrix;
                 }
@@ -639,6 +726,50 @@ uint16_t input_get_state(uint8_t id, void *response, bool *combo_pressed)
     return 1;
 }
 
+//Returns true if the device has sent a report since input_get_state last read it.
+bool input_has_new_report(int id)
+{
+    if (_check_id(id) == 0)
+        return false;
+
+    //The hardwired controller has no reports. It's read once per main loop.
+    bool available = false;
+    if (input_is_gamecontroller(id))
+        available = ((JoystickController *)input_devices[id].driver)->available();
+#if (MAX_MICE >= 1)
+    else if (input_is_mouse(id))
+        available = ((MouseController *)input_devices[id].driver)->available();
+#endif
+#if (MAX_KB >= 1)
+    else if (input_is_kb(id))
+        return kb_get_state(id)->report_pending; //Stamped by the key callbacks
+#endif
+
+    if (available && !report_seen[id])
+    {
+        report_seen[id] = true;
+        report_seen_clks[id] = n64hal_hs_tick_get();
+    }
+    return available;
+}
+
+//Returns true if input_has_new_report sees every change to the device's state. The hardwired controller has no
+//reports, and a mouse's movement is zeroed once it stops reporting, so those have to be read every main loop.
+bool input_is_report_driven(int id)
+{
+    if (_check_id(id) == 0)
+        return false;
+    return !input_is_hw_gamecontroller(id) && !input_is_mouse(id);
+}
+
+//Returns the arrival time of the report last read by input_get_state, in timer ticks.
+uint32_t input_get_report_time(int id)
+{
+    if (_check_id(id) == 0)
+        return 0;
+    return report_clks[id];
+}
+
 void input_apply_rumble(int id, uint8_t strength)
 {
     JoystickController *joy;
@@ -2,6 +2,7 @@
 // SPDX-License-Identifier: MIT
 
 #include <Arduino.h>
+#include <utility>
 #include "input.h"
 #include "printf.h"
 #include "n64_wrapper.h"
@@ -14,39 +15,66 @@
 #include "memory.h"
 #include "fileio.h"
 #include "tft.h"
+#include "n64_trace.h"
+#include "n64_profile.h"
+#include "n64_latency.h"
 
 
 static void ring_buffer_init(void);
 static void ring_buffer_flush();
+static void n64_trace_flush();
+static void serial_poll_commands();
 
 n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+
+//Capture timestamps both edges, so the edge ISR runs twice per bit. See n64_profile_budget_ns.
+#if (N64_RX_CAPTURE >= 1)
+#define N64_RX_EDGE CHANGE
+#else
+#define N64_RX_EDGE FALLING
+#endif
+
+#define N64_INPUT_WAIT_BUCKETS 16 //Report wait histogram. Bucket n is 2^n to 2^(n+1)-1 us
+
 n64_settings *settings;
 int n64_is_on = 0;
 
-#if (MAX_CONTROLLERS >= 1)
-void n64_controller1_clock_edge()
+static constexpr uint8_t n64_controller_pins[4] = {N64_CONTROLLER_1_PIN, N64_CONTROLLER_2_PIN,
+                                                     N64_CONTROLLER_3_PIN, N64_CONTROLLER_4_PIN};
+
+//Data line edge ISR. There is one instance per port, so the device address and the pin's GPIO register and mask
+//are all immediates rather than being loaded on every edge.
+template <uint32_t port, uint8_t pin>
+static void n64_controller_clock_edge()
 {
-    n64_controller_hande_new_edge(&n64_in_dev[0]);
-}
+#if (N64_RX_CAPTURE >= 1)
+    n64_controller_hande_new_edge(&n64_in_dev[port]);
+#else
+    //Same as n64_controller_hande_new_edge. Wait for ~1.05us to pass since falling edge before reading bit
+    uint32_t start_clock = ARM_DWT_CYCCNT;
+#if (N64_LATENCY_PROFILE >= 1)
+    n64_latency_edge(port, start_clock);
 #endif
-#if (MAX_CONTROLLERS >= 2)
-void n64_controller2_clock_edge()
-{
-    n64_controller_hande_new_edge(&n64_in_dev[1]);
-}
+    uint32_t sample_clks = n64_in_dev[port].timing.sample_clks;
+    while ((ARM_DWT_CYCCNT - start_clock) < sample_clks);
+
+    n64_controller_rx_bit(&n64_in_dev[port], digitalReadFast(pin), start_clock);
 #endif
-#if (MAX_CONTROLLERS >= 3)
-void n64_controller3_clock_edge()
+}
+
+//Attaches the edge ISR for port c. The ISR table has an instance for each port up to MAX_CONTROLLERS.
+template <size_t... ports>
+static void n64_controller_attach(uint32_t c, std::index_sequence<ports...>)
 {
-    n64_controller_hande_new_edge(&n64_in_dev[2]);
+    static void (*const isr[])() = {n64_controller_clock_edge<ports, n64_controller_pins[ports]>...};
+    attachInterrupt(digitalPinToInterrupt(n64_in_dev[c].gpio_pin), isr[c], N64_RX_EDGE);
 }
-#endif
-#if (MAX_CONTROLLERS >= 4)
-void n64_controller4_clock_edge()
+
+//DTCM is zero wait state and uncached, so nothing placed there can stall the controller ISR.
+static bool in_dtcm(const void *start, size_t len)
 {
-    n64_controller_hande_new_edge(&n64_in_dev[3]);
+    return (uint32_t)start >= 0x20000000 && (uint32_t)start + len <= 0x20080000;
 }
-#endif
 
 void setup()
 {
@@ -67,6 +95,17 @@ void setup()
     tft_init();
     n64_subsystem_init(n64_in_dev);
 
+    //The controller ISR relies on its state being in DTCM, which is where Teensy places ordinary globals. That covers
+    //the port structs and the pak state it reaches through them while it builds a reply.
+    if (!in_dtcm(n64_in_dev, sizeof(n64_in_dev)))
+        debug_print_error("[MAIN] ERROR: Controller state is not in DTCM\n");
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        if (!in_dtcm(n64_in_dev[c].rpak, sizeof(n64_rumblepak)) || !in_dtcm(n64_in_dev[c].mempack, sizeof(n64_mempack)) ||
+            !in_dtcm(n64_in_dev[c].tpak, sizeof(n64_transferpak)) || !in_dtcm(n64_in_dev[c].tpak->gbcart, sizeof(gameboycart)))
+            debug_print_error("[MAIN] ERROR: Peripheral state for controller %u is not in DTCM\n", c);
+    }
+
     //Read in settings from flash
     settings = (n64_settings *)memory_alloc_ram(SETTINGS_FILENAME, sizeof(n64_settings), MEMORY_READ_WRITE);
     n64_settings_init(settings);
@@ -98,126 +137,205 @@ void setup()
     pinMode(HW_RUMBLE, OUTPUT);
 #endif
 
-#if (MAX_CONTROLLERS >= 1)
-    n64_in_dev[0].gpio_pin = N64_CONTROLLER_1_PIN;
-    pinMode(N64_CONTROLLER_1_PIN, INPUT_PULLUP);
-#endif
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        n64_in_dev[c].gpio_pin = n64_controller_pins[c];
+        n64hal_gpio_init(&n64_in_dev[c]);
+    }
+    NVIC_SET_PRIORITY(IRQ_GPIO6789, 1);
+    digitalWrite(USER_LED_PIN, HIGH);
+}
 
-#if (MAX_CONTROLLERS >= 2)
-    n64_in_dev[1].gpio_pin = N64_CONTROLLER_2_PIN;
-    pinMode(N64_CONTROLLER_2_PIN, INPUT_PULLUP);
+static bool n64_combo[MAX_CONTROLLERS] = {false};
+static uint8_t n64_response[MAX_CONTROLLERS][32] = {0};
+static uint32_t input_checked_us[MAX_CONTROLLERS] = {0};
+static uint32_t input_wait[MAX_CONTROLLERS][N64_INPUT_WAIT_BUCKETS] = {0};
+static bool n64_publish_pending[MAX_CONTROLLERS] = {false};
+
+//Returns true if the input device on port c has sent a report that hasn't been serviced yet. Also records how long
+//that report could have been waiting, which is the time since the port was last checked.
+static bool n64_check_new_report(uint32_t c)
+{
+    uint32_t now = micros();
+    bool new_report = input_has_new_report(c);
+    if (new_report)
+    {
+        uint32_t bucket = 31 - __builtin_clz((now - input_checked_us[c]) | 1);
+        input_wait[c][(bucket < N64_INPUT_WAIT_BUCKETS) ? bucket : N64_INPUT_WAIT_BUCKETS - 1]++;
+    }
+    input_checked_us[c] = now;
+    return new_report;
+}
+
+//Reads the latest state from the input device on port c, runs it through the button mapping and analog stick
+//processing, and publishes it for the next console poll.
+static void n64_service_input(uint32_t c)
+{
+    if (input_is_gamecontroller(c))
+    {
+        n64_buttonmap *new_state = (n64_buttonmap *)n64_response[c];
+        input_get_state(c, new_state,  &n64_combo[c]);
+
+        if(n64_in_dev[c].type != N64_CONTROLLER)
+        {
+            n64_in_dev[c].type = N64_CONTROLLER;
+            tft_flag_update();
+        }
+        n64_settings *settings = n64_settings_get();
+        float x, y, range;
+        astick_apply_deadzone(&x, &y, new_state->x_axis / 100.0f,
+                                      new_state->y_axis / 100.0f,
+                                      settings->deadzone[c] / 10.0f, 0.05f);
+        
+        if(input_is_dualstick_mode(c) && (c % 2) == 0 /*Controller 0 or 2 only*/)
+        {
+            //If in dual analog stick mode, force lowest sensitivity. Seems too sensitive otherwise.
+            range = astick_apply_sensitivity(0, &x, &y);
+        }
+        else
+        {
+            range = astick_apply_sensitivity(settings->sensitivity[c], &x, &y);
+            if (settings->snap_axis[c]) astick_apply_snap(range, &x, &y);
+            if (settings->octa_correct[c]) astick_apply_octa_correction(&x, &y);
+        }
+
+        new_state->x_axis = x * 100.0f;
+        new_state->y_axis = y * 100.0f;
+
+        //Apply digital buttons and axis to n64 controller if combo button isnt pressed.
+        //While it is, the buttons are released and the stick stays where it was.
+        n64_in_dev[c].latch_buttons = settings->latch_buttons[c];
+        if (n64_combo[c] == 0)
+        {
+            n64_controller_set_buttons(&n64_in_dev[c], new_state, input_get_report_time(c));
+        }
+        else if (N64_DOUBLE_BUFFER_READ(n64_in_dev[c].b_state)->dButtons != 0)
+        {
+            n64_buttonmap released = *N64_DOUBLE_BUFFER_READ(n64_in_dev[c].b_state);
+            released.dButtons = 0;
+            n64_controller_set_buttons(&n64_in_dev[c], &released, input_get_report_time(c));
+        }
+    }
+#if (MAX_MICE >= 1)
+    else if (input_is_mouse(c))
+    {
+        n64_buttonmap *new_state = (n64_buttonmap *)n64_response[c];
+        input_get_state(c, new_state,  &n64_combo[c]);
+
+        if(n64_in_dev[c].type != N64_MOUSE)
+        {
+            n64_in_dev[c].type = N64_MOUSE;
+            tft_flag_update();
+        }
+        n64_in_dev[c].latch_buttons = settings->latch_buttons[c];
+        n64_controller_set_buttons(&n64_in_dev[c], new_state, input_get_report_time(c));
+    }
 #endif
+#if (MAX_KB >= 1)
+    else if (input_is_kb(c))
+    {
+        n64_randnet_kb *new_state = (n64_randnet_kb *)n64_response[c];
+        //Maintain the old led state
+        new_state->led_state = n64_in_dev[c].kb_led_state;
 
-#if (MAX_CONTROLLERS >= 3)
-    n64_in_dev[2].gpio_pin = N64_CONTROLLER_3_PIN;
-    pinMode(N64_CONTROLLER_3_PIN, INPUT_PULLUP);
+        input_get_state(c, new_state,  &n64_combo[c]);
+
+        if(n64_in_dev[c].type != N64_RANDNET)
+        {
+            n64_in_dev[c].type = N64_RANDNET;
+            tft_flag_update();
+        }
+        n64_controller_set_kb(&n64_in_dev[c], new_state);
+    }
 #endif
+    //Have the next controller status reply encoded and ready before the console asks for it. If the transmitter is
+    //still sending the buffer it needs, n64_service_inputs tries again.
+    n64_publish_pending[c] = !n64_controller_publish_status(&n64_in_dev[c]);
+}
 
-#if (MAX_CONTROLLERS >= 4)
-    n64_in_dev[3].gpio_pin = N64_CONTROLLER_4_PIN;
-    pinMode(N64_CONTROLLER_4_PIN, INPUT_PULLUP);
+//Services any port whose input device has sent a new report, or whose next console poll is due within
+//N64_INPUT_POLL_MARGIN_US. This is called between the slower main loop steps, so a report is published as soon as
+//it arrives and the input is sampled fresh just before the console reads it.
+static void n64_service_inputs()
+{
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        if (!input_is_connected(c))
+            continue;
+
+        //A publish that lost to the transmitter is retried, so the console isn't sent a stale reply
+        if (n64_publish_pending[c])
+            n64_publish_pending[c] = !n64_controller_publish_status(&n64_in_dev[c]);
+
+        bool service = false;
+        n64_controller_latency_update(&n64_in_dev[c]);
+#if (N64_INPUT_POLL_MARGIN_US > 0)
+        n64_controller_poll_update(&n64_in_dev[c]);
+        service = n64_controller_poll_due(&n64_in_dev[c],
+                                          N64_INPUT_POLL_MARGIN_US * (n64hal_hs_tick_get_speed() / 1000000));
 #endif
-    NVIC_SET_PRIORITY(IRQ_GPIO6789, 1);
-    digitalWrite(USER_LED_PIN, HIGH);
+#if (N64_INPUT_FAST_PATH >= 1)
+        if (n64_check_new_report(c))
+            service = true;
+#endif
+        //A poll has carried a latched button, so the port can move on to the last report without waiting for another
+        if (n64_controller_latch_pending(&n64_in_dev[c]))
+            service = true;
+        if (service)
+            n64_service_input(c);
+    }
 }
 
-static bool n64_combo = false;
 void loop()
 {
-    static uint8_t n64_response[MAX_CONTROLLERS][32] = {0};
-
     ring_buffer_flush();
+    n64_service_inputs();
+    n64_trace_flush();
+    n64_service_inputs();
+    serial_poll_commands();
 
     input_update_input_devices();
+    n64_service_inputs();
 
     tft_try_update();
+    n64_service_inputs();
 
     for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
     {
+        //Report any commands from the console that this port didn't answer
+        static uint32_t missed_polls[MAX_CONTROLLERS] = {0};
+        if (n64_in_dev[c].missed_polls != missed_polls[c])
+        {
+            missed_polls[c] = n64_in_dev[c].missed_polls;
+            debug_print_n64("[MAIN] Controller %u has missed %u polls\n", c, missed_polls[c]);
+        }
+
+        //Stage the next peripheral read, and report how well that's working every few seconds
+        n64_controller_read_ahead(&n64_in_dev[c]);
+        static uint32_t read_ahead_reads[MAX_CONTROLLERS] = {0};
+        static uint32_t read_ahead_timer[MAX_CONTROLLERS] = {0};
+        n64_read_ahead *ra = &n64_in_dev[c].read_ahead;
+        if ((millis() - read_ahead_timer[c]) > 5000 && (ra->hits + ra->misses) != read_ahead_reads[c])
+        {
+            read_ahead_reads[c] = ra->hits + ra->misses;
+            read_ahead_timer[c] = millis();
+            debug_print_n64("[MAIN] Controller %u read-ahead hits %u misses %u\n", c, ra->hits, ra->misses);
+        }
+
         if (input_is_connected(c))
         {
             if (n64_is_on && !n64_in_dev[c].interrupt_attached)
             {
-                switch (c)
-                {
-                    case 0: attachInterrupt(digitalPinToInterrupt(n64_in_dev[c].gpio_pin), n64_controller1_clock_edge, FALLING); break;
-                    case 1: attachInterrupt(digitalPinToInterrupt(n64_in_dev[c].gpio_pin), n64_controller2_clock_edge, FALLING); break;
-                    case 2: attachInterrupt(digitalPinToInterrupt(n64_in_dev[c].gpio_pin), n64_controller3_clock_edge, FALLING); break;
-                    case 3: attachInterrupt(digitalPinToInterrupt(n64_in_dev[c].gpio_pin), n64_controller4_clock_edge, FALLING); break;
-                }
+                n64_controller_attach(c, std::make_index_sequence<MAX_CONTROLLERS>());
                 n64_in_dev[c].interrupt_attached = true;
             }
-            if (input_is_gamecontroller(c))
-            {
-                n64_buttonmap *new_state = (n64_buttonmap *)n64_response[c];
-                input_get_state(c, new_state,  &n64_combo);
-
-                if(n64_in_dev[c].type != N64_CONTROLLER)
-                {
-                    n64_in_dev[c].type = N64_CONTROLLER;
-                    tft_flag_update();
-                }
-                n64_settings *settings = n64_settings_get();
-                float x, y, range;
-                astick_apply_deadzone(&x, &y, new_state->x_axis / 100.0f,
-                                              new_state->y_axis / 100.0f,
-                                              settings->deadzone[c] / 10.0f, 0.05f);
-                
-                if(input_is_dualstick_mode(c) && (c % 2) == 0 /*Controller 0 or 2 only*/)
-                {
-                    //If in dual analog stick mode, force lowest sensitivity. Seems too sensitive otherwise.
-                    range = astick_apply_sensitivity(0, &x, &y);
-                }
-                else
-                {
-                    range = astick_apply_sensitivity(settings->sensitivity[c], &x, &y);
-                    if (settings->snap_axis[c]) astick_apply_snap(range, &x, &y);
-                    if (settings->octa_correct[c]) astick_apply_octa_correction(&x, &y);
-                }
-
-                new_state->x_axis = x * 100.0f;
-                new_state->y_axis = y * 100.0f;
-
-                //Apply digital buttons and axis to n64 controller if combo button isnt pressed
-                if (n64_combo == 0)
-                {
-                    n64_in_dev[c].b_state.dButtons = new_state->dButtons;
-                    n64_in_dev[c].b_state.x_axis = new_state->x_axis;
-                    n64_in_dev[c].b_state.y_axis = new_state->y_axis;
-                }
-            }
-#if (MAX_MICE >= 1)
-            else if (input_is_mouse(c))
-            {
-                n64_buttonmap *new_state = (n64_buttonmap *)n64_response[c];
-                input_get_state(c, new_state,  &n64_combo);
-
-                if(n64_in_dev[c].type != N64_MOUSE)
-                {
-                    n64_in_dev[c].type = N64_MOUSE;
-                    tft_flag_update();
-                }
-                n64_in_dev[c].b_state.dButtons = new_state->dButtons;
-                n64_in_dev[c].b_state.x_axis = new_state->x_axis;
-                n64_in_dev[c].b_state.y_axis = new_state->y_axis;
-            }
-#endif
-#if (MAX_KB >= 1)
-            else if (input_is_kb(c))
-            {
-                n64_randnet_kb *new_state = (n64_randnet_kb *)n64_response[c];
-                //Maintain the old led state
-                new_state->led_state = n64_in_dev[c].kb_state.led_state;
-
-                input_get_state(c, new_state,  &n64_combo);
-
-                if(n64_in_dev[c].type != N64_RANDNET)
-                {
-                    n64_in_dev[c].type = N64_RANDNET;
-                    tft_flag_update();
-                }
-                memcpy(&n64_in_dev[c].kb_state, new_state, sizeof(n64_randnet_kb));
-            }
+#if (N64_INPUT_FAST_PATH >= 1)
+            //n64_service_inputs picks up new reports. Only devices it can't see changes from are read here.
+            if (!input_is_report_driven(c))
+                n64_service_input(c);
+#else
+            n64_check_new_report(c);
+            n64_service_input(c);
 #endif
         }
 
@@ -247,7 +365,7 @@ void loop()
 
         //Handle dual stick mode toggling
         static uint32_t dual_stick_toggle[MAX_CONTROLLERS] = {0};
-        if (n64_combo && (n64_buttons & N64_B))
+        if (n64_combo[c] && (n64_buttons & N64_B))
         {
             if (dual_stick_toggle[c] == 0)
             {
@@ -264,7 +382,7 @@ void loop()
         //Handle ram flushing. Auto flushes when the N64 is turned off :)
         static uint32_t flushing_toggle[MAX_CONTROLLERS] = {0};
         n64_is_on = digitalRead(N64_CONSOLE_SENSE);
-        if ((n64_combo && (n64_buttons & N64_A)) || (n64_is_on == 0))
+        if ((n64_combo[c] && (n64_buttons & N64_A)) || (n64_is_on == 0))
         {
             if (flushing_toggle[c] == 0)
             {
@@ -309,7 +427,7 @@ void loop()
 
         //Handle peripheral change combinations
         static uint32_t timer_peri_change[MAX_CONTROLLERS] = {0};
-        if (n64_combo && (n64_buttons & N64_DU ||
+        if (n64_combo[c] && (n64_buttons & N64_DU ||
                           n64_buttons & N64_DD ||
                           n64_buttons & N64_DL ||
                           n64_buttons & N64_DR ||
@@ -353,7 +471,7 @@ void loop()
             }
 
             /* HANDLE NEXT PERIPHERAL */
-            n64_in_dev[c].current_peripheral = PERI_NONE; //Go to none whilst changing
+            n64_controller_set_peripheral(&n64_in_dev[c], PERI_NONE); //Go to none whilst changing
             tft_force_update();
 
             //Changing peripheral to RUMBLEPAK
@@ -475,7 +593,7 @@ void loop()
         //for a short period. Some games need this.
         if (n64_in_dev[c].current_peripheral == PERI_NONE && (millis() - timer_peri_change[c]) > PERI_CHANGE_TIME)
         {
-            n64_in_dev[c].current_peripheral = n64_in_dev[c].next_peripheral;
+            n64_controller_set_peripheral(&n64_in_dev[c], n64_in_dev[c].next_peripheral);
             tft_flag_update();
         }
 
@@ -498,6 +616,7 @@ void loop()
             n64_virtualpak_update(n64_in_dev[c].mempack);
         }
 
+        n64_service_inputs();
     } //END FOR LOOP
 } // MAIN LOOP
 
@@ -526,3 +645,155 @@ static void ring_buffer_flush()
         _print_cursor = (_print_cursor + 1) % sizeof(ring_buffer);
     }
 }
+
+/* JOYBUS TRACE HANDLING */
+static void n64_trace_flush()
+{
+#if (N64_TRACE >= 1)
+    static n64_trace_record records[1 + MAX_CONTROLLERS * (N64_TRACE_DEPTH + 1)];
+    static uint32_t dropped[MAX_CONTROLLERS] = {0};
+    static uint32_t session_started = 0;
+    static uint32_t flush_timer = 0;
+    uint32_t count = 0;
+
+    //Writing to the SD card is slow, so let the records build up a bit.
+    if ((millis() - flush_timer) < 250)
+        return;
+    flush_timer = millis();
+
+    if (!session_started)
+    {
+        memset(&records[count], 0, sizeof(n64_trace_record));
+        records[count].port = N64_TRACE_PORT_SESSION;
+        records[count].timestamp = n64hal_hs_tick_get_speed();
+        count++;
+        session_started = 1;
+    }
+
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        uint32_t d = n64_trace_dropped(c);
+        if (d != dropped[c])
+        {
+            memset(&records[count], 0, sizeof(n64_trace_record));
+            records[count].port = N64_TRACE_PORT_DROPPED;
+            records[count].command = c;
+            records[count].timestamp = d - dropped[c];
+            dropped[c] = d;
+            count++;
+        }
+        count += n64_trace_pop(c, &records[count], N64_TRACE_DEPTH);
+    }
+
+    if (count > 0)
+        fileio_append_to_file(N64_TRACE_FILENAME, (uint8_t *)records, count * sizeof(n64_trace_record));
+#endif
+}
+
+/* SERIAL COMMANDS */
+static void n64_print_stats()
+{
+    static const char *command_names[N64_STAT_NUM_COMMANDS] = {"identify", "status", "read", "write",
+                                                               "randnet", "reset", "other"};
+    uint32_t ticks_per_us = n64hal_hs_tick_get_speed() / 1000000;
+
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        n64_port_stats *stats = &n64_in_dev[c].stats;
+        serial_port.printf("[N64] C%u commands:", c);
+        for (uint32_t i = 0; i < N64_STAT_NUM_COMMANDS; i++)
+        {
+            serial_port.printf(" %s=%lu", command_names[i], stats->commands[i]);
+        }
+        serial_port.printf("\n[N64] C%u addr_crc_errors=%lu unknown=%lu idle_resets=%lu overflows=%lu missed_polls=%lu\n",
+                           c, stats->addr_crc_errors, stats->unknown_commands, stats->idle_resets,
+                           stats->overflows, n64_in_dev[c].missed_polls);
+        serial_port.printf("[N64] C%u read-ahead hits=%lu misses=%lu\n",
+                           c, n64_in_dev[c].read_ahead.hits, n64_in_dev[c].read_ahead.misses);
+        serial_port.printf("[N64] C%u bit period %lu ticks, sample point %lu ticks, slot %lu ticks\n",
+                           c, n64_in_dev[c].timing.bit_clks, n64_in_dev[c].timing.sample_clks,
+                           n64_in_dev[c].timing.slot_clks);
+        serial_port.printf("[N64] C%u status poll period %lu us\n", c, n64_in_dev[c].poll_period_clks / ticks_per_us);
+        for (uint32_t i = 0; i < N64_STAT_TURNAROUND_BUCKETS; i++)
+        {
+            if (stats->turnaround[i] == 0)
+                continue;
+            serial_port.printf("[N64] C%u turnaround %lu-%lu ticks (%lu.%02lu us): %lu\n", c,
+                               1UL << i, (2UL << i) - 1,
+                               (1UL << i) / ticks_per_us, ((1UL << i) % ticks_per_us) * 100 / ticks_per_us,
+                               stats->turnaround[i]);
+        }
+        for (uint32_t i = 0; i < N64_STAT_TURNAROUND_BUCKETS; i++)
+        {
+            if (stats->input_latency[i] == 0)
+                continue;
+            serial_port.printf("[N64] C%u input latency %lu-%lu ticks (%lu.%02lu ms): %lu\n", c,
+                               1UL << i, (2UL << i) - 1,
+                               (1UL << i) / (ticks_per_us * 1000), ((1UL << i) % (ticks_per_us * 1000)) * 100 / (ticks_per_us * 1000),
+                               stats->input_latency[i]);
+        }
+        for (uint32_t i = 0; i < N64_INPUT_WAIT_BUCKETS; i++)
+        {
+            if (input_wait[c][i] == 0)
+                continue;
+            serial_port.printf("[N64] C%u input report waited %lu-%lu us: %lu\n", c,
+                               1UL << i, (2UL << i) - 1, input_wait[c][i]);
+        }
+    }
+}
+
+static void n64_print_profile()
+{
+#if (N64_PROFILE >= 1)
+    uint32_t ticks_per_us = n64hal_hs_tick_get_speed() / 1000000;
+    for (uint32_t i = 0; i < N64_PROFILE_NUM_PATHS; i++)
+    {
+        n64_profile_path path;
+        n64_profile_get(i, &path);
+        if (path.count == 0)
+            continue;
+        uint32_t max_ns = path.max * 1000 / ticks_per_us;
+        uint32_t budget_ns = n64_profile_budget_ns(i);
+        serial_port.printf("[N64] %-15s n=%lu min=%lu avg=%lu max=%lu ticks, ",
+                           n64_profile_name(i), path.count, path.min, (uint32_t)(path.total / path.count), path.max);
+        (budget_ns == 0) ? serial_port.printf("max %lu ns, no budget", max_ns) :
+                           serial_port.printf("max %lu ns of %lu ns budget", max_ns, budget_ns);
+        serial_port.printf(", preempted %lu%s\n", path.preempted, (budget_ns != 0 && max_ns > budget_ns) ? " OVER BUDGET" : "");
+    }
+#else
+    serial_port.printf("[N64] Profiling is off. Set N64_PROFILE to 1 in usb64_conf.h\n");
+#endif
+}
+
+//Single character commands from the serial port.
+//'s' prints the N64 protocol health counters, 'p' the ISR profile (N64_PROFILE), 'c' clears them.
+//'l' measures the edge ISR latency for a couple of seconds (N64_LATENCY_PROFILE).
+static void serial_poll_commands()
+{
+    while (serial_port.available())
+    {
+        switch (serial_port.read())
+        {
+        case 's':
+            n64_print_stats();
+            break;
+        case 'p':
+            n64_print_profile();
+            break;
+        case 'l':
+            n64_latency_capture(n64_in_dev, 2000);
+            break;
+        case 'c':
+            for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+            {
+                memset(&n64_in_dev[c].stats, 0, sizeof(n64_port_stats));
+                memset(input_wait[c], 0, sizeof(input_wait[c]));
+            }
+#if (N64_PROFILE >= 1)
+            n64_profile_clear();
+#endif
+            serial_port.printf("[N64] Counters cleared\n");
+            break;
+        }
+    }
+}
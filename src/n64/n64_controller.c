@@ -1,7 +1,9 @@
 // Copyright 2020, Ryan Wendland, usb64
 // SPDX-License-Identifier: MIT
 
-#include <Arduino.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
 #include "printf.h"
 #include "usb64_conf.h"
 #include "n64_mempak.h"
@@ -10,18 +12,53 @@
 #include "n64_settings.h"
 #include "n64_transferpak_gbcarts.h"
 #include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_trace.h"
+#include "n64_profile.h"
 #include "n64_wrapper.h"
 
-//Uncomment to enable mempak READ address CRC checks.
-//May cause timing issues.
+//Enables mempak READ address CRC checks. The read reply is then sent after the full address is received.
+//Comment out to fall back to replying part way through the address (with a long guard delay) if timing issues occur.
 //Address CRC check for WRITES are hardcoded on already.
-//#define USE_N64_ADDRESS_CRC
+#define USE_N64_ADDRESS_CRC
+
+//Time from the falling edge of the console stop bit to the start of our read reply.
+#define N64_READ_TURNAROUND_US 4
+
+//Time from the falling edge of the console stop bit to the start of all other replies.
+#define N64_REPLY_TURNAROUND_US 3
+
+//Without address CRC checks, the read reply starts part way through the address. Time from that bit to the reply.
+#define N64_READ_GUARD_US 32
+
+//Nominal console bit period. The reply timings above are in slots of a quarter of this, so they scale with
+//the calibrated bit period on each port.
+#define N64_BIT_US (N64_JOYBUS_SLOT_US * N64_JOYBUS_SLOTS_PER_BIT)
+
+//Bit periods averaged for each calibration update. Must be a power of 2.
+#define N64_CAL_PERIODS 8
+
+//Consecutive out of range status poll periods before the poll period estimate starts again.
+#define N64_POLL_REJECTS 8
 
 n64_rumblepak n64_rpak[MAX_CONTROLLERS];
 n64_mempack n64_mpack[MAX_CONTROLLERS];
 n64_transferpak n64_tpak[MAX_CONTROLLERS];
 gameboycart gb_cart[MAX_CONTROLLERS];
 
+//Transmit schedules. These must stay valid until the hardware transmitter has finished with them.
+static uint32_t n64_tx_slots[MAX_CONTROLLERS][N64_JOYBUS_MAX_TX_SLOTS];
+
+//Double buffered controller status replies, pre-encoded by the main loop.
+#define N64_STATUS_IDLE_SLOTS (N64_REPLY_TURNAROUND_US / N64_JOYBUS_SLOT_US)
+#define N64_STATUS_SLOTS (N64_STATUS_IDLE_SLOTS + sizeof(n64_buttonmap) * 8 * N64_JOYBUS_SLOTS_PER_BIT + N64_JOYBUS_STOP_SLOTS)
+static uint32_t n64_status_slots[MAX_CONTROLLERS][2][N64_STATUS_SLOTS];
+
+#if (N64_RX_CAPTURE >= 1)
+//Edge timestamps of the command currently being received
+static uint32_t n64_rx_edges[MAX_CONTROLLERS][N64_JOYBUS_MAX_RX_EDGES];
+#endif
+
 //Hardcoded controller responses for identify requests
 static uint8_t n64_mouse[]          = {0x02, 0x00, 0x00};
 static uint8_t n64_randnet[]        = {0x00, 0x02, 0x00};
@@ -29,6 +66,47 @@ static uint8_t n64_cont_with_peri[] = {0x05, 0x00, 0x01};
 static uint8_t n64_cont_no_peri[]   = {0x05, 0x00, 0x02};
 static uint8_t n64_cont_crc_error[] = {0x05, 0x00, 0x04};
 
+#if (N64_PROFILE >= 1)
+//ISR path taken by the bit currently being handled
+static uint32_t n64_profile_path_taken;
+#define N64_PROFILE_PATH(path) (n64_profile_path_taken = (path))
+#else
+#define N64_PROFILE_PATH(path)
+#endif
+
+//Derives all of a port's bit timing from the console bit period.
+static void n64_set_bit_timing(n64_input_dev_t *cont, uint32_t bit_clks)
+{
+    n64_bit_timing *t = &cont->timing;
+    t->bit_clks = bit_clks;
+    t->sample_clks = bit_clks * 21 / 80;                 //1.05us of a 4us bit
+    t->threshold_clks = bit_clks / 2;                    //1us low is a '1', 3us low is a '0'
+    t->slot_clks = bit_clks / N64_JOYBUS_SLOTS_PER_BIT;  //1us
+    t->idle_clks = bit_clks * 75;                        //300us
+}
+
+//Folds one measured bit period into the port's timing. Periods are averaged in groups then filtered, so a single
+//late interrupt doesn't move the sample point. The period is kept within 25% of nominal.
+static inline void n64_calibrate_bit(n64_input_dev_t *cont, uint32_t period)
+{
+    n64_bit_timing *t = &cont->timing;
+    if (period < t->bit_clks - t->bit_clks / 4 || period > t->bit_clks + t->bit_clks / 4)
+        return;
+
+    t->period_sum += period;
+    if (++t->period_count < N64_CAL_PERIODS)
+        return;
+
+    uint32_t nominal = N64_BIT_US * (n64hal_hs_tick_get_speed() / 1000000);
+    int32_t error = (int32_t)(t->period_sum / N64_CAL_PERIODS - t->bit_clks);
+    uint32_t bit_clks = t->bit_clks + error / 4;
+    (bit_clks < nominal - nominal / 4) ? bit_clks = nominal - nominal / 4 : (0);
+    (bit_clks > nominal + nominal / 4) ? bit_clks = nominal + nominal / 4 : (0);
+    t->period_sum = 0;
+    t->period_count = 0;
+    n64_set_bit_timing(cont, bit_clks);
+}
+
 void n64_subsystem_init(n64_input_dev_t *in_dev)
 {
     // INITIALISE THE N64 STRUCTS //
@@ -37,112 +115,565 @@ void n64_subsystem_init(n64_input_dev_t *in_dev)
         in_dev[i].id = i;
         in_dev[i].current_bit = 7;
         in_dev[i].current_byte = 0;
-        in_dev[i].current_peripheral = PERI_RUMBLE;
-        in_dev[i].next_peripheral = in_dev[i].current_peripheral;
         in_dev[i].rpak = &n64_rpak[i];
         in_dev[i].mempack = &n64_mpack[i];
         in_dev[i].mempack->id = VIRTUAL_PAK;
         in_dev[i].mempack->data = NULL;
         in_dev[i].tpak = &n64_tpak[i];
         in_dev[i].tpak->gbcart = &gb_cart[i];
+        n64_controller_set_peripheral(&in_dev[i], PERI_RUMBLE);
+        in_dev[i].next_peripheral = in_dev[i].current_peripheral;
         in_dev[i].interrupt_attached = false;
         in_dev[i].peri_access = 0;
         in_dev[i].type = N64_CONTROLLER;
+        in_dev[i].port_state = N64_PORT_IDLE;
+        in_dev[i].missed_polls = 0;
+        in_dev[i].status_ready = -1;
+        in_dev[i].status_sending = -1;
+        n64_set_bit_timing(&in_dev[i], N64_BIT_US * (n64hal_hs_tick_get_speed() / 1000000));
     }
 
     //Setup the Controller pin IO mapping and interrupts
     n64hal_hs_tick_init();
+    n64hal_tx_init();
+}
+
+//N64 data CRC. Poly was brute forced as x^7 + x^2 + x^0 (0x85), initial value = 0.
+//The lookup table is generated by the preprocessor so there is no runtime init and it can't drift from the poly.
+#define N64_CRC_POLY 0x85
+#define N64_CRC_STEP(c) ((((c) << 1) & 0xFF) ^ ((((c) >> 7) & 1) * N64_CRC_POLY))
+#define N64_CRC_BYTE(b) N64_CRC_STEP(N64_CRC_STEP(N64_CRC_STEP(N64_CRC_STEP( \
+                        N64_CRC_STEP(N64_CRC_STEP(N64_CRC_STEP(N64_CRC_STEP(b))))))))
+#define N64_CRC_ROW4(b) N64_CRC_BYTE((b) + 0), N64_CRC_BYTE((b) + 1), N64_CRC_BYTE((b) + 2), N64_CRC_BYTE((b) + 3)
+#define N64_CRC_ROW16(b) N64_CRC_ROW4((b) + 0), N64_CRC_ROW4((b) + 4), N64_CRC_ROW4((b) + 8), N64_CRC_ROW4((b) + 12)
+#define N64_CRC_ROW64(b) N64_CRC_ROW16((b) + 0), N64_CRC_ROW16((b) + 16), N64_CRC_ROW16((b) + 32), N64_CRC_ROW16((b) + 48)
+
+static const uint8_t n64_crc_table[256] = {
+    N64_CRC_ROW64(0), N64_CRC_ROW64(64), N64_CRC_ROW64(128), N64_CRC_ROW64(192)};
+
+//Fold one more data byte into a running CRC.
+static inline uint8_t n64_crc_update(uint8_t crc, uint8_t data)
+{
+    return n64_crc_table[(uint8_t)(data ^ crc)];
 }
 
 static uint8_t n64_get_crc(uint8_t *data)
 {
-    //Generated from http://www.sunshine2k.de/coding/javascript/crc/crc_js.html
-    //N64 CRC poly was brute forced as x^7 + x^2 + x^0 (0x85), initial value = 0
-    static uint8_t crctable[256] = {
-        0x00, 0x85, 0x8F, 0x0A, 0x9B, 0x1E, 0x14, 0x91, 0xB3, 0x36, 0x3C,
-        0xB9, 0x28, 0xAD, 0xA7, 0x22, 0xE3, 0x66, 0x6C, 0xE9, 0x78, 0xFD,
-        0xF7, 0x72, 0x50, 0xD5, 0xDF, 0x5A, 0xCB, 0x4E, 0x44, 0xC1, 0x43,
-        0xC6, 0xCC, 0x49, 0xD8, 0x5D, 0x57, 0xD2, 0xF0, 0x75, 0x7F, 0xFA,
-        0x6B, 0xEE, 0xE4, 0x61, 0xA0, 0x25, 0x2F, 0xAA, 0x3B, 0xBE, 0xB4,
-        0x31, 0x13, 0x96, 0x9C, 0x19, 0x88, 0x0D, 0x07, 0x82, 0x86, 0x03,
-        0x09, 0x8C, 0x1D, 0x98, 0x92, 0x17, 0x35, 0xB0, 0xBA, 0x3F, 0xAE,
-        0x2B, 0x21, 0xA4, 0x65, 0xE0, 0xEA, 0x6F, 0xFE, 0x7B, 0x71, 0xF4,
-        0xD6, 0x53, 0x59, 0xDC, 0x4D, 0xC8, 0xC2, 0x47, 0xC5, 0x40, 0x4A,
-        0xCF, 0x5E, 0xDB, 0xD1, 0x54, 0x76, 0xF3, 0xF9, 0x7C, 0xED, 0x68,
-        0x62, 0xE7, 0x26, 0xA3, 0xA9, 0x2C, 0xBD, 0x38, 0x32, 0xB7, 0x95,
-        0x10, 0x1A, 0x9F, 0x0E, 0x8B, 0x81, 0x04, 0x89, 0x0C, 0x06, 0x83,
-        0x12, 0x97, 0x9D, 0x18, 0x3A, 0xBF, 0xB5, 0x30, 0xA1, 0x24, 0x2E,
-        0xAB, 0x6A, 0xEF, 0xE5, 0x60, 0xF1, 0x74, 0x7E, 0xFB, 0xD9, 0x5C,
-        0x56, 0xD3, 0x42, 0xC7, 0xCD, 0x48, 0xCA, 0x4F, 0x45, 0xC0, 0x51,
-        0xD4, 0xDE, 0x5B, 0x79, 0xFC, 0xF6, 0x73, 0xE2, 0x67, 0x6D, 0xE8,
-        0x29, 0xAC, 0xA6, 0x23, 0xB2, 0x37, 0x3D, 0xB8, 0x9A, 0x1F, 0x15,
-        0x90, 0x01, 0x84, 0x8E, 0x0B, 0x0F, 0x8A, 0x80, 0x05, 0x94, 0x11,
-        0x1B, 0x9E, 0xBC, 0x39, 0x33, 0xB6, 0x27, 0xA2, 0xA8, 0x2D, 0xEC,
-        0x69, 0x63, 0xE6, 0x77, 0xF2, 0xF8, 0x7D, 0x5F, 0xDA, 0xD0, 0x55,
-        0xC4, 0x41, 0x4B, 0xCE, 0x4C, 0xC9, 0xC3, 0x46, 0xD7, 0x52, 0x58,
-        0xDD, 0xFF, 0x7A, 0x70, 0xF5, 0x64, 0xE1, 0xEB, 0x6E, 0xAF, 0x2A,
-        0x20, 0xA5, 0x34, 0xB1, 0xBB, 0x3E, 0x1C, 0x99, 0x93, 0x16, 0x87,
-        0x02, 0x08, 0x8D};
     uint8_t crc = 0;
     for (uint32_t byte = 0; byte < 32; byte++)
     {
-        crc = (uint8_t)(crctable[(uint8_t)(data[byte] ^ crc)]);
+        crc = n64_crc_update(crc, data[byte]);
     }
     return crc; //Returns the non-inverted CRC of a 32-byte data stream
 }
 
+//N64 address CRC. Each of the 11 address bits contributes a fixed 5 bit pattern that are XOR'd together.
+//See http://svn.navi.cx/misc/trunk/wasabi/devices/cube64/notes/addr_encoder.py
+//The full 2048 entry table is generated by the preprocessor so a check is a single lookup.
+#define N64_ADDR_CRC_BIT(a, n, v) ((((a) >> (n)) & 1) * (v))
+#define N64_ADDR_CRC(a) (N64_ADDR_CRC_BIT(a, 0, 0x15) ^ N64_ADDR_CRC_BIT(a, 1, 0x1F) ^ N64_ADDR_CRC_BIT(a, 2, 0x0B) ^ \
+                         N64_ADDR_CRC_BIT(a, 3, 0x16) ^ N64_ADDR_CRC_BIT(a, 4, 0x19) ^ N64_ADDR_CRC_BIT(a, 5, 0x07) ^ \
+                         N64_ADDR_CRC_BIT(a, 6, 0x0E) ^ N64_ADDR_CRC_BIT(a, 7, 0x1C) ^ N64_ADDR_CRC_BIT(a, 8, 0x0D) ^ \
+                         N64_ADDR_CRC_BIT(a, 9, 0x1A) ^ N64_ADDR_CRC_BIT(a, 10, 0x01))
+#define N64_ADDR_CRC_ROW4(a) N64_ADDR_CRC((a) + 0), N64_ADDR_CRC((a) + 1), N64_ADDR_CRC((a) + 2), N64_ADDR_CRC((a) + 3)
+#define N64_ADDR_CRC_ROW16(a) N64_ADDR_CRC_ROW4((a) + 0), N64_ADDR_CRC_ROW4((a) + 4), \
+                              N64_ADDR_CRC_ROW4((a) + 8), N64_ADDR_CRC_ROW4((a) + 12)
+#define N64_ADDR_CRC_ROW64(a) N64_ADDR_CRC_ROW16((a) + 0), N64_ADDR_CRC_ROW16((a) + 16), \
+                              N64_ADDR_CRC_ROW16((a) + 32), N64_ADDR_CRC_ROW16((a) + 48)
+#define N64_ADDR_CRC_ROW256(a) N64_ADDR_CRC_ROW64((a) + 0), N64_ADDR_CRC_ROW64((a) + 64), \
+                               N64_ADDR_CRC_ROW64((a) + 128), N64_ADDR_CRC_ROW64((a) + 192)
+
+static const uint8_t n64_addr_crc_table[2048] = {
+    N64_ADDR_CRC_ROW256(0), N64_ADDR_CRC_ROW256(256), N64_ADDR_CRC_ROW256(512), N64_ADDR_CRC_ROW256(768),
+    N64_ADDR_CRC_ROW256(1024), N64_ADDR_CRC_ROW256(1280), N64_ADDR_CRC_ROW256(1536), N64_ADDR_CRC_ROW256(1792)};
+
 //Need to pass the 16bit address WITH the address CRC bits populated.
 //Return 1 if the address CRC from the console matches the internal calculation.
-static uint8_t n64_compare_addr_crc(uint16_t encoded_add_console)
+static inline uint8_t n64_compare_addr_crc(uint16_t encoded_add_console)
+{
+    return n64_addr_crc_table[encoded_add_console >> 5] == (encoded_add_console & 0x1F);
+}
+
+/* PERIPHERAL BUS HANDLERS
+ * Each peripheral has a table of read and write handlers, one per 4kB region of the peripheral address space.
+ * The table is selected when the peripheral changes so the ISR only needs a single call per access.
+ */
+static void n64_peri_nop(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+}
+
+//Rumblepak
+static void n64_rpak_read_state(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //If rumblepak is initialised, respond with 32bytes of 0x80.
+    if (cont->rpak->initialised == 1)
+    {
+        memset(data, 0x80, 32);
+        debug_print_n64("[N64] Request rumblepak state. Sending 0x80s (its initialised)\n");
+    }
+}
+
+static void n64_rpak_write_init(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //N64 writes 32 bytes of 0x80 to initialise the rumblepak, 0xFE to reset it
+    (data[0] == 0x80) ? cont->rpak->initialised = 1 : (0);
+    (data[0] == 0xFE) ? cont->rpak->initialised = 0 : (0);
+    debug_print_n64("[N64] Rumblepak Status %u\n", cont->rpak->initialised);
+}
+
+static void n64_rpak_write_motor(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    (data[0] == 0x01) ? (cont->rpak->state = RUMBLE_START) : (cont->rpak->state = RUMBLE_STOP);
+}
+
+//Mempak
+static void n64_mpak_read(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //The mempak can be selected before its backing memory has been allocated
+    if (cont->mempack->data == NULL)
+        return;
+    n64hal_read_extram(data, cont->mempack->data, address, 32);
+}
+
+static void n64_mpak_write(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    if (!cont->crc_error && cont->mempack->data != NULL)
+        n64hal_write_extram(data, cont->mempack->data, address, 32);
+}
+
+//Virtual mempak
+static void n64_vpak_read(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    n64_virtualpak_read32(address, data);
+}
+
+static void n64_vpak_write(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    if (!cont->crc_error)
+        n64_virtualpak_write32(address, data);
+}
+
+static void n64_vpak_write_note_table(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //VIRTUAL MEMPAK NOTE TABLE HOOK
+    if (address >= 0x300 && address < 0x500)
+    {
+        /*
+         * When you 'delete' a note from the mempak manager, I can hook the
+         * address being deleted and determine what row you selected.
+         * The note table is located between 0x300 and 0x500 in the mempak
+         * and has 32bytes (0x20) per note.
+         * I use this as a hacky menu for the N64
+         */
+        uint32_t row = (address - 0x300) / 0x20; //What row you have 'selected' 0-15
+        cont->mempack->virtual_update_req = 1;
+        N64_PROFILE_PATH(N64_PROFILE_VPAK_HOOK);
+        cont->mempack->virtual_selected_row = row;
+        debug_print_n64("[N64] Virtualpak write at row %u\n", row);
+        return;
+    }
+    n64_vpak_write(cont, address, data);
+}
+
+//Transferpak
+static void n64_tpak_read_power(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
 {
-    //See http://svn.navi.cx/misc/trunk/wasabi/devices/cube64/notes/addr_encoder.py
-    static uint8_t crctable[11] = {
-        0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01};
+    //If tpak is powered up, respond with 32bytes of 0x84.
+    if (cont->tpak->power_state == 1)
+    {
+        memset(data, 0x84, 32);
+        debug_print_tpak("[TPAK] Request tpak power state. Sending 0x84s (its powered up)\n");
+    }
+}
+
+static void n64_tpak_read_access(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    if (cont->tpak->power_state != 1)
+        return;
 
-    uint16_t encoded_add_cont = encoded_add_console & 0xFFE0;
-    for (uint32_t i = 0; i < sizeof(crctable); i++)
+    if (cont->tpak->gbcart == NULL)
     {
-        if (encoded_add_cont & (1 << (i + 5)))
-            encoded_add_cont ^= crctable[i];
+        memset(data, 0x44, 32); //Return 0x44's if no cart is installed.
+        return;
     }
-    return encoded_add_cont == encoded_add_console;
+
+    memset(data, (cont->tpak->access_state) ? 0x89 : 0x80, 32);
+    debug_print_tpak("[TPAK] Request access_state. Sending 0x%02x\n", (cont->tpak->access_state) ? 0x89 : 0x80);
+    //Set bit 2 of the first return value if the access mode was changed since last check.
+    data[0] |= (cont->tpak->access_state_changed << 2);
+    cont->tpak->access_state_changed = 0;
 }
 
-static void n64_send_stream(uint8_t *txbuff, uint32_t len, n64_input_dev_t *c)
+static void n64_tpak_read_cart(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
 {
-    uint32_t cycle_cnt = 0;
-    uint32_t cycle_start = 0;
-    uint32_t current_byte = 0;
-    uint32_t current_bit = 8;
-    uint32_t U_SEC = n64hal_hs_tick_get_speed() / 1000000; //clocks per microsecond
+    if (cont->tpak->power_state == 1 && cont->tpak->gbcart)
+        tpak_read(cont->tpak, address, data);
+}
 
-    cycle_start = n64hal_hs_tick_get();
-    while (len > 0)
+static void n64_tpak_write_power(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //N64 writes 32 bytes of 0x84 to turn on the TPAK
+    (data[0] == 0x84) ? cont->tpak->power_state = 1 : (0);
+    (data[0] == 0xFE) ? tpak_reset(cont->tpak)      : (0);
+    debug_print_tpak("[TPAK] Powerstate set to %u\n", cont->tpak->power_state);
+}
+
+static void n64_tpak_write_bank(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    //0x00, 0x01, or 0x02 and switches over the MBC memory space.
+    cont->tpak->selected_mbc_bank = data[0];
+    debug_print_tpak("[TPAK] MBC bank changed to %u\n",  cont->tpak->selected_mbc_bank);
+}
+
+static void n64_tpak_write_access(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    cont->tpak->access_state_changed = cont->tpak->access_state != data[0];
+    cont->tpak->access_state = data[0];
+    debug_print_tpak("[TPAK] Access state set to %u\n",  cont->tpak->access_state);
+}
+
+static void n64_tpak_write_cart(n64_input_dev_t *cont, uint16_t address, uint8_t *data)
+{
+    if (cont->tpak->power_state == 1 && cont->tpak->gbcart)
+        tpak_write(cont->tpak, address, data);
+}
+
+#define N64_PERI_NOP4 n64_peri_nop, n64_peri_nop, n64_peri_nop, n64_peri_nop
+
+//read_ahead has bit n set if reads from region n have no side effects, so can be staged by the main loop early.
+static const n64_peri_handlers n64_peri_none_handlers = {
+    .read32  = {N64_PERI_NOP4, N64_PERI_NOP4, N64_PERI_NOP4, N64_PERI_NOP4},
+    .write32 = {N64_PERI_NOP4, N64_PERI_NOP4, N64_PERI_NOP4, N64_PERI_NOP4},
+    .read_ahead = 0x0000,
+};
+
+static const n64_peri_handlers n64_rpak_handlers = {
+    .read32  = {N64_PERI_NOP4, N64_PERI_NOP4,
+                n64_rpak_read_state, n64_rpak_read_state, n64_peri_nop, n64_peri_nop, //0x8000 - 0xBFFF
+                N64_PERI_NOP4},
+    .write32 = {N64_PERI_NOP4, N64_PERI_NOP4,
+                n64_rpak_write_init, n64_peri_nop, n64_peri_nop, n64_peri_nop,        //0x8000 - 0xBFFF
+                n64_rpak_write_motor, n64_peri_nop, n64_peri_nop, n64_peri_nop},      //0xC000 - 0xFFFF
+    .read_ahead = 0x0000,
+};
+
+static const n64_peri_handlers n64_mpak_handlers = {
+    .read32  = {n64_mpak_read, n64_mpak_read, n64_mpak_read, n64_mpak_read,
+                n64_mpak_read, n64_mpak_read, n64_mpak_read, n64_mpak_read,
+                N64_PERI_NOP4, N64_PERI_NOP4},
+    .write32 = {n64_mpak_write, n64_mpak_write, n64_mpak_write, n64_mpak_write,
+                n64_mpak_write, n64_mpak_write, n64_mpak_write, n64_mpak_write,
+                N64_PERI_NOP4, N64_PERI_NOP4},
+    .read_ahead = 0x00FF, //0x0000 - 0x7FFF
+};
+
+static const n64_peri_handlers n64_vpak_handlers = {
+    .read32  = {n64_vpak_read, n64_vpak_read, n64_vpak_read, n64_vpak_read,
+                n64_vpak_read, n64_vpak_read, n64_vpak_read, n64_vpak_read,
+                N64_PERI_NOP4, N64_PERI_NOP4},
+    .write32 = {n64_vpak_write_note_table, n64_vpak_write, n64_vpak_write, n64_vpak_write,
+                n64_vpak_write, n64_vpak_write, n64_vpak_write, n64_vpak_write,
+                N64_PERI_NOP4, N64_PERI_NOP4},
+    .read_ahead = 0x0000, //Virtual pak contents are regenerated by the main loop
+};
+
+static const n64_peri_handlers n64_tpak_handlers = {
+    .read32  = {n64_tpak_read_power, n64_tpak_read_power, n64_peri_nop, n64_tpak_read_access, //0x0000 - 0x3FFF
+                N64_PERI_NOP4,
+                n64_tpak_read_power, n64_tpak_read_power, n64_peri_nop, n64_tpak_read_access, //0x8000 - 0xBFFF
+                n64_tpak_read_cart, n64_tpak_read_cart, n64_tpak_read_cart, n64_tpak_read_cart},
+    .write32 = {N64_PERI_NOP4, N64_PERI_NOP4,
+                n64_tpak_write_power, n64_peri_nop, n64_tpak_write_bank, n64_tpak_write_access, //0x8000 - 0xBFFF
+                n64_tpak_write_cart, n64_tpak_write_cart, n64_tpak_write_cart, n64_tpak_write_cart},
+    .read_ahead = 0xF000, //0xC000 - 0xFFFF
+};
+
+//Changes the peripheral installed in the controller. This should be called from the main loop only.
+void n64_controller_set_peripheral(n64_input_dev_t *cont, n64_peri_type peripheral)
+{
+    switch (peripheral)
     {
-        while ((n64hal_hs_tick_get() - cycle_start) < cycle_cnt);
-        n64hal_input_swap(c, N64_OUTPUT); //OUTPUT_PP will pull low
-        (txbuff[current_byte] & 0x80) ? (cycle_cnt += 1 * U_SEC) : (cycle_cnt += 3 * U_SEC);
-        while ((n64hal_hs_tick_get() - cycle_start) < cycle_cnt);
-        n64hal_input_swap(c, N64_INPUT);
-        (txbuff[current_byte] & 0x80) ? (cycle_cnt += 3 * U_SEC) : (cycle_cnt += 1 * U_SEC);
-        txbuff[current_byte] = txbuff[current_byte] << 1;
-        current_bit--;
-
-        //next byte if current byte complete
-        if (current_bit == 0)
+    case PERI_RUMBLE:
+        cont->peri_handlers = &n64_rpak_handlers;
+        break;
+    case PERI_MEMPAK:
+        cont->peri_handlers = (cont->mempack->virtual_is_active) ? &n64_vpak_handlers : &n64_mpak_handlers;
+        break;
+    case PERI_TPAK:
+        cont->peri_handlers = &n64_tpak_handlers;
+        break;
+    default:
+        cont->peri_handlers = &n64_peri_none_handlers;
+        break;
+    }
+    cont->current_peripheral = peripheral;
+    __atomic_add_fetch(&cont->peri_generation, 1, __ATOMIC_RELEASE); //The ISR may bump it in the middle
+    N64_SHARED_STORE(cont->read_ahead.state, N64_RA_EMPTY);
+}
+
+//Stages the block the console is expected to read next, so that read can be answered without fetching
+//anything in the reply window. Call from the main loop.
+void n64_controller_read_ahead(n64_input_dev_t *cont)
+{
+    n64_read_ahead *ra = &cont->read_ahead;
+    if (N64_SHARED_LOAD(ra->state) != N64_RA_REQUESTED)
+        return;
+
+    uint16_t address = N64_SHARED_LOAD(ra->address);
+    uint32_t generation = N64_SHARED_LOAD(cont->peri_generation);
+    const n64_peri_handlers *handlers = cont->peri_handlers;
+    if (!(handlers->read_ahead & (1 << (address >> 12))))
+        return;
+
+    //The ISR only replies from here once the state is N64_RA_STAGED, which only this function sets.
+    memset(ra->data, 0x00, 32);
+    handlers->read32[address >> 12](cont, address, ra->data);
+    ra->data[32] = n64_get_crc(ra->data);
+    ra->staged_address = address;
+    ra->staged_generation = generation;
+
+    //If the ISR has moved on to another address while staging, leave it for the next pass.
+    if (N64_SHARED_LOAD(ra->address) == address)
+        N64_SHARED_STORE(ra->state, N64_RA_STAGED);
+}
+
+//Replies are timed from start_clock, the falling edge of the last bit received. Schedules start with idle_slots
+//of turnaround and whatever part of that hasn't already passed is played out, so the CPU doesn't wait for it.
+static void n64_send_slots(n64_input_dev_t *c, const uint32_t *slots, uint32_t num_slots,
+                           uint32_t idle_slots, uint32_t start_clock)
+{
+    uint32_t slot_clks = c->timing.slot_clks;
+    uint32_t elapsed_slots = (n64hal_hs_tick_get() - start_clock) / slot_clks;
+    uint32_t skip = (elapsed_slots < idle_slots) ? elapsed_slots : idle_slots;
+    slots += skip;
+    num_slots -= skip;
+    c->tx_turnaround_clks = (n64hal_hs_tick_get() - start_clock) + (idle_slots - skip) * slot_clks;
+    c->stats.turnaround[31 - __builtin_clz(c->tx_turnaround_clks | 1)]++;
+
+    //Hand the schedule to the hardware transmitter. It plays out in the background and
+    //n64_controller_tx_complete is called when it's done.
+    N64_SHARED_STORE(c->port_state, N64_PORT_TX);
+    if (n64hal_tx_start(c, slots, num_slots))
+        return;
+
+    //Hardware transmitter is unavailable for this port, so play it out here.
+    uint32_t cycle_start = n64hal_hs_tick_get();
+    uint32_t level = 0;
+    for (uint32_t i = 0; i < num_slots; i++)
+    {
+        while ((n64hal_hs_tick_get() - cycle_start) < i * slot_clks);
+        if (slots[i] != 0)
+        {
+            level ^= 1;
+            n64hal_input_swap(c, (level) ? N64_OUTPUT : N64_INPUT); //OUTPUT_PP will pull low
+        }
+    }
+
+    //Our own edges were latched by the edge interrupt while we sent, they aren't the start of a command.
+    n64hal_input_clear_edges(c);
+    N64_SHARED_STORE(c->port_state, N64_PORT_IDLE);
+}
+
+//Encodes a reply into a turnaround_us of idle time followed by the data, and sends it.
+static void n64_send_stream(const uint8_t *txbuff, uint32_t len, n64_input_dev_t *c,
+                            uint32_t start_clock, uint32_t turnaround_us)
+{
+    uint32_t *slots = n64_tx_slots[c->id];
+    uint32_t idle_slots = turnaround_us / N64_JOYBUS_SLOT_US;
+    (idle_slots > N64_JOYBUS_MAX_IDLE_SLOTS) ? idle_slots = N64_JOYBUS_MAX_IDLE_SLOTS : (0);
+    for (uint32_t i = 0; i < idle_slots; i++)
+    {
+        slots[i] = 0;
+    }
+    uint32_t num_slots = idle_slots + n64_joybus_encode(txbuff, len, n64hal_tx_edge_value(c), &slots[idle_slots]);
+    n64_send_slots(c, slots, num_slots, idle_slots, start_clock);
+}
+
+//Hands a new button and analog stick state to the ISR. Call from the main loop only.
+//report_clks is when the USB report it came from arrived, in timer ticks.
+//With latch_buttons set, a button change is held until a status reply has carried it to the console. A tap that
+//starts and ends between two polls is then still seen as pressed for one poll, then released on the next.
+void n64_controller_set_buttons(n64_input_dev_t *cont, const n64_buttonmap *state, uint32_t report_clks)
+{
+    n64_buttonmap next = *state;
+    if (cont->latch_buttons)
+    {
+        //status_sending is always a reply that has gone out, so it's safe if another poll lands in between these
+        uint32_t sent = N64_SHARED_LOAD(cont->status_sent);
+        int32_t sending = N64_SHARED_LOAD(cont->status_sending);
+        if (sent != cont->latch_polls && sending >= 0)
         {
-            current_bit = 8;
-            current_byte++;
-            len--;
+            cont->latch_polls = sent;
+            cont->latch_delivered = cont->status_buttons[sending];
         }
+
+        //Buttons that differ from what the console last saw keep their value until a poll sends them.
+        //The rest follow the new report.
+        uint16_t shown = N64_DOUBLE_BUFFER_READ(cont->b_state)->dButtons;
+        uint16_t pending = shown ^ cont->latch_delivered;
+        next.dButtons = (shown & pending) | (state->dButtons & ~pending);
     }
+    N64_DOUBLE_BUFFER_WRITE(cont->b_state, &next);
+    cont->report_clks = report_clks;
+    cont->latch_report = state->dButtons;
+}
+
+//Returns 1 if latch_buttons is holding a button away from the last report and a poll has been sent since the
+//buttons were last set, so servicing the port again now would move it on. Most devices only report changes, so
+//without this a latched tap would stay pressed until the next report. Call from the main loop only.
+uint8_t n64_controller_latch_pending(n64_input_dev_t *cont)
+{
+    if (!cont->latch_buttons || N64_SHARED_LOAD(cont->status_sent) == cont->latch_polls)
+        return 0;
+    return N64_DOUBLE_BUFFER_READ(cont->b_state)->dButtons != cont->latch_report;
+}
 
-    //Send stop bit. Pull low for 2us, then release.
-    while ((n64hal_hs_tick_get() - cycle_start) < cycle_cnt);
-    n64hal_input_swap(c, N64_OUTPUT);
-    cycle_cnt += 2 * U_SEC;
-    while ((n64hal_hs_tick_get() - cycle_start) < cycle_cnt);
-    n64hal_input_swap(c, N64_INPUT); //Release bus. We're done
+//Hands a new Randnet keyboard state to the ISR. Call from the main loop only.
+void n64_controller_set_kb(n64_input_dev_t *cont, const n64_randnet_kb *state)
+{
+    N64_DOUBLE_BUFFER_WRITE(cont->kb_state, state);
+}
+
+//Pre-encodes the controller status reply from cont->b_state, so a status poll can be answered without
+//encoding anything in the ISR. Call from the main loop whenever b_state is updated.
+//The ISR always sends the latest complete reply. Returns 0 if both buffers are busy and nothing was published.
+uint8_t n64_controller_publish_status(n64_input_dev_t *cont)
+{
+    uint32_t next = (cont->status_ready == 0) ? 1 : 0;
+
+    //The transmitter may still be playing out the buffer we want to write to. The ISR sets N64_PORT_TX before it
+    //claims a buffer, and checks status_ready again after, so either it sees the last publish or we see its claim.
+    if (N64_SHARED_LOAD_SC(cont->status_sending) == (int32_t)next && N64_SHARED_LOAD(cont->port_state) == N64_PORT_TX)
+        return 0;
+
+    uint32_t *slots = n64_status_slots[cont->id][next];
+    for (uint32_t i = 0; i < N64_STATUS_IDLE_SLOTS; i++)
+    {
+        slots[i] = 0;
+    }
+    n64_joybus_encode((uint8_t *)N64_DOUBLE_BUFFER_READ(cont->b_state), sizeof(n64_buttonmap), n64hal_tx_edge_value(cont),
+                      &slots[N64_STATUS_IDLE_SLOTS]);
+    cont->status_buttons[next] = N64_DOUBLE_BUFFER_READ(cont->b_state)->dButtons;
+    cont->status_report_clks[next] = cont->report_clks;
+    N64_SHARED_STORE_SC(cont->status_ready, next); //The ISR may send it from here on
+    return 1;
+}
+
+//Updates the estimate of how often the console polls this port for its status, from the time of each status
+//reply. Call from the main loop. Periods more than 50% off the estimate are skipped frames or a game changing
+//its poll rate. The estimate restarts if that carries on for N64_POLL_REJECTS polls in a row.
+void n64_controller_poll_update(n64_input_dev_t *cont)
+{
+    uint32_t sent, clks;
+    do
+    {
+        sent = N64_SHARED_LOAD(cont->status_sent);
+        clks = N64_SHARED_LOAD(cont->status_clks);
+    } while (sent != N64_SHARED_LOAD(cont->status_sent));
+
+    if (sent == cont->poll_seen)
+        return;
+
+    //Only a single poll since the last update gives a period
+    uint32_t period = clks - cont->poll_last_clks;
+    uint32_t estimate = cont->poll_period_clks;
+    if (sent - cont->poll_seen == 1)
+    {
+        if (estimate == 0 || cont->poll_rejects >= N64_POLL_REJECTS)
+        {
+            estimate = period;
+            cont->poll_rejects = 0;
+        }
+        else if (period > estimate / 2 && period < estimate + estimate / 2)
+        {
+            estimate = estimate + ((int32_t)(period - estimate) / 8);
+            cont->poll_rejects = 0;
+        }
+        else
+        {
+            cont->poll_rejects++;
+        }
+    }
+    cont->poll_period_clks = estimate;
+    cont->poll_last_clks = clks;
+    cont->poll_seen = sent;
+}
+
+//Records the time from a USB report arriving to the first status reply that carried it in stats.input_latency.
+//Call from the main loop. If more than one poll went out since the last call it isn't known which one first carried
+//the report, so nothing is recorded.
+void n64_controller_latency_update(n64_input_dev_t *cont)
+{
+    uint32_t sent, clks;
+    int32_t sending;
+    do
+    {
+        sent = N64_SHARED_LOAD(cont->status_sent);
+        clks = N64_SHARED_LOAD(cont->status_clks);
+        sending = N64_SHARED_LOAD(cont->status_sending);
+    } while (sent != N64_SHARED_LOAD(cont->status_sent));
+
+    if (sent == cont->latency_seen || sending < 0)
+        return;
+
+    uint32_t report_clks = cont->status_report_clks[sending];
+    if (sent - cont->latency_seen == 1 && report_clks != cont->latency_report_clks)
+    {
+        cont->stats.input_latency[31 - __builtin_clz((clks - report_clks) | 1)]++;
+    }
+    cont->latency_report_clks = report_clks;
+    cont->latency_seen = sent;
+}
+
+//Returns 1 once per poll when the console's next status poll is predicted to be within margin_clks, so the
+//input can be sampled just before it's read. Returns 0 until the poll period has been estimated.
+uint8_t n64_controller_poll_due(n64_input_dev_t *cont, uint32_t margin_clks)
+{
+    if (cont->poll_period_clks == 0 || cont->poll_sampled == cont->poll_seen)
+        return 0;
+
+    uint32_t next_poll = cont->poll_last_clks + cont->poll_period_clks;
+    if ((int32_t)(next_poll - n64hal_hs_tick_get()) > (int32_t)margin_clks)
+        return 0;
+
+    cont->poll_sampled = cont->poll_seen;
+    return 1;
+}
+
+//Called by the hardware transmitter once a reply has finished and the port is listening again.
+void n64_controller_tx_complete(n64_input_dev_t *c)
+{
+    N64_SHARED_STORE(c->port_state, N64_PORT_IDLE);
+}
+
+//CRC of a reply, used as a compact digest of the data in trace records.
+static uint8_t n64_get_digest(const uint8_t *data, uint32_t len)
+{
+    uint8_t crc = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        crc = n64_crc_update(crc, data[i]);
+    }
+    return crc;
+}
+
+//Records the transaction that was just replied to. Must be called before the stream is reset.
+static void n64_trace_transaction(n64_input_dev_t *cont, uint32_t start_clock, uint8_t digest, uint8_t reply_crc)
+{
+#if (N64_TRACE >= 1)
+    n64_trace_record record;
+    uint8_t command = cont->data_buffer[N64_COMMAND_POS];
+    record.timestamp = start_clock;
+    record.address = 0;
+    if (command == N64_PERI_READ || command == N64_PERI_WRITE)
+        record.address = cont->data_buffer[N64_ADDRESS_MSB_POS] << 8 | cont->data_buffer[N64_ADDRESS_LSB_POS];
+    record.turnaround = (cont->tx_turnaround_clks > 0xFFFF) ? 0xFFFF : cont->tx_turnaround_clks;
+    record.port = cont->id;
+    record.command = command;
+    record.digest = digest;
+    record.reply_crc = reply_crc;
+    n64_trace_push(&record);
+#endif
 }
 
 static void n64_reset_stream(n64_input_dev_t *cont)
@@ -150,48 +681,96 @@ static void n64_reset_stream(n64_input_dev_t *cont)
     cont->current_bit = 7;
     cont->current_byte = 0;
     cont->data_buffer[0] = 0;
+    cont->data_crc = 0;
+    if (cont->port_state == N64_PORT_RX)
+        N64_SHARED_STORE(cont->port_state, N64_PORT_IDLE);
 }
 
-static void inline n64_wait_micros(uint32_t micros){
-    uint32_t end_clock = n64hal_hs_tick_get() + micros * (n64hal_hs_tick_get_speed() / 1000000);
-    while (n64hal_hs_tick_get() < end_clock);
+//Counts a fully received command byte by type.
+static void n64_count_command(n64_input_dev_t *cont)
+{
+    uint32_t type;
+    switch (cont->data_buffer[N64_COMMAND_POS])
+    {
+    case N64_IDENTIFY:          type = N64_STAT_IDENTIFY;   break;
+    case N64_CONTROLLER_STATUS: type = N64_STAT_STATUS;     break;
+    case N64_PERI_READ:         type = N64_STAT_PERI_READ;  break;
+    case N64_PERI_WRITE:        type = N64_STAT_PERI_WRITE; break;
+    case N64_RANDNET_REQ:       type = N64_STAT_RANDNET;    break;
+    case N64_CONTROLLER_RESET:  type = N64_STAT_RESET;      break;
+    default:                    type = N64_STAT_OTHER;      break;
+    }
+    cont->stats.commands[type]++;
 }
 
-//This function is called in the falling edge of the n64 data bus.
-void n64_controller_hande_new_edge(n64_input_dev_t *cont)
+#if (N64_PROFILE >= 1)
+//Peripheral a read or write went to, for profiling. The virtual pak is counted separately from the mempak.
+static uint32_t n64_profile_peri(n64_input_dev_t *cont)
 {
-    uint32_t start_clock = n64hal_hs_tick_get();
+    return (cont->peri_handlers == &n64_vpak_handlers) ? N64_PROFILE_PERI_VPAK : cont->current_peripheral;
+}
+#endif
 
+//Handles one received bit. start_clock is the time of the falling edge that started the bit.
+static void n64_rx_bit(n64_input_dev_t *cont, uint8_t bit, uint32_t start_clock)
+{
     //If bus has been idle for 300us, start of a new stream.
-    if ((n64hal_hs_tick_get() - cont->bus_idle_timer_clks) > (300 * n64hal_hs_tick_get_speed() / 1000000))
+    uint32_t period = start_clock - cont->bus_idle_timer_clks;
+    if (period > cont->timing.idle_clks)
     {
+        //A command was started but never answered, so the console missed a poll on this port.
+        if (cont->port_state == N64_PORT_RX)
+            cont->missed_polls++;
+        if (cont->current_byte != 0 || cont->current_bit != 7)
+            cont->stats.idle_resets++;
         n64_reset_stream(cont);
         cont->peri_access = 0;
     }
+#if (N64_CALIBRATE_TIMING >= 1)
+    //The time since the previous falling edge is one console bit period. The command and address bytes are
+    //enough to track the console, so the long write data isn't measured.
+    else if (cont->port_state == N64_PORT_RX && cont->current_byte < N64_DATA_POS)
+    {
+        n64_calibrate_bit(cont, period);
+    }
+#endif
+
+    if (cont->port_state == N64_PORT_IDLE)
+        N64_SHARED_STORE(cont->port_state, N64_PORT_RX);
 
     //If byte has completed, increment buffer for next byte and reset bit counter.
     if (cont->current_bit == -1)
     {
+        (cont->current_byte == N64_COMMAND_POS) ? n64_count_command(cont) : (0);
         cont->current_bit = 7;
         cont->current_byte++;
-        (cont->current_byte > N64_MAX_POS) ? cont->current_byte = 0 : (0);
+        if (cont->current_byte > N64_MAX_POS)
+        {
+            cont->current_byte = 0;
+            cont->stats.overflows++;
+        }
         cont->data_buffer[cont->current_byte] = 0x00;
     }
 
-    //Wait for ~1.05us to pass since falling edge before reading bit
-    uint32_t sample_clock = start_clock + (n64hal_hs_tick_get_speed() / 950000);
-    while (n64hal_hs_tick_get() < sample_clock);
-
-    //Read bit
-    cont->data_buffer[cont->current_byte] |= n64hal_input_read(cont) << cont->current_bit;
+    //Store bit
+    cont->data_buffer[cont->current_byte] |= bit << cont->current_bit;
     cont->current_bit -= 1;
 
+    //Fold each peripheral write data byte into the CRC as soon as it completes.
+    //This keeps the CRC calculation out of the reply window after the last byte.
+    if (cont->current_bit == -1 && cont->data_buffer[N64_COMMAND_POS] == N64_PERI_WRITE &&
+        cont->current_byte >= N64_DATA_POS && cont->current_byte < N64_CRC_POS)
+    {
+        cont->data_crc = n64_crc_update(cont->data_crc, cont->data_buffer[cont->current_byte]);
+    }
+
     //Reset idle timer
-    cont->bus_idle_timer_clks = n64hal_hs_tick_get();
+    cont->bus_idle_timer_clks = start_clock;
 
     //If byte 0 has been completed, we need to identify what the command is
     if (cont->current_byte == N64_COMMAND_POS + 1)
     {
+        const n64_buttonmap *b_state;
         switch (cont->data_buffer[N64_COMMAND_POS])
         {
         case N64_IDENTIFY:
@@ -212,19 +791,44 @@ void n64_controller_hande_new_edge(n64_input_dev_t *cont)
                 memcpy(&cont->data_buffer[N64_DATA_POS], n64_cont_no_peri, sizeof(n64_cont_no_peri));
 
             cont->crc_error = 0;
-            n64_wait_micros(2);
-            n64_send_stream(&cont->data_buffer[N64_DATA_POS], 3, cont);
+            N64_PROFILE_PATH(N64_PROFILE_IDENTIFY);
+            n64_send_stream(&cont->data_buffer[N64_DATA_POS], 3, cont, start_clock, N64_REPLY_TURNAROUND_US);
+            n64_trace_transaction(cont, start_clock, n64_get_digest(&cont->data_buffer[N64_DATA_POS], 3), 0);
             n64_reset_stream(cont);
             break;
 
         case N64_CONTROLLER_STATUS:
             if (cont->type == N64_RANDNET) //Randnet does not response to this
+            {
+                n64_reset_stream(cont);
                 break;
+            }
             n64hal_output_set(N64_FRAME, 1);
-            n64_wait_micros(2);
-            n64_send_stream((uint8_t *)&cont->b_state, 4, cont);
+            N64_PROFILE_PATH(N64_PROFILE_STATUS);
+            b_state = N64_DOUBLE_BUFFER_READ(cont->b_state);
+
+            //Claim the latest reply published by the main loop. See n64_controller_publish_status.
+            N64_SHARED_STORE(cont->port_state, N64_PORT_TX);
+            int32_t ready;
+            do
+            {
+                ready = N64_SHARED_LOAD(cont->status_ready);
+                N64_SHARED_STORE_SC(cont->status_sending, ready);
+            } while (N64_SHARED_LOAD_SC(cont->status_ready) != ready);
+
+            if (ready >= 0)
+            {
+                n64_send_slots(cont, n64_status_slots[cont->id][ready], N64_STATUS_SLOTS,
+                               N64_STATUS_IDLE_SLOTS, start_clock);
+            }
+            else
+            {
+                n64_send_stream((uint8_t *)b_state, sizeof(n64_buttonmap), cont, start_clock, N64_REPLY_TURNAROUND_US);
+            }
+            N64_SHARED_STORE(cont->status_clks, start_clock);
+            N64_SHARED_STORE(cont->status_sent, cont->status_sent + 1);
+            n64_trace_transaction(cont, start_clock, n64_get_digest((uint8_t *)b_state, sizeof(n64_buttonmap)), 0);
             n64_reset_stream(cont);
-            cont->b_state.dButtons = 0x0000;
             n64hal_output_set(N64_FRAME, 0);
             break;
         case N64_RANDNET_REQ:
@@ -234,6 +838,7 @@ void n64_controller_hande_new_edge(n64_input_dev_t *cont)
             cont->peri_access = 1;
             break;
         default:
+            cont->stats.unknown_commands++;
             cont->peri_access = 0;
             n64_reset_stream(cont);
             break;
@@ -244,21 +849,23 @@ void n64_controller_hande_new_edge(n64_input_dev_t *cont)
     if (cont->type == N64_RANDNET && cont->data_buffer[N64_COMMAND_POS] == N64_RANDNET_REQ && cont->current_byte == RANDNET_BTN_POS)
     {
         //First received byte is the led state of the keyboard LEDs
-        cont->kb_state.led_state = cont->data_buffer[RANDNET_LED_POS];
-        debug_print_n64("[N64] Randnet LED Status %02x\n",  cont->kb_state.led_state);
+        cont->kb_led_state = cont->data_buffer[RANDNET_LED_POS];
+        debug_print_n64("[N64] Randnet LED Status %02x\n",  cont->kb_led_state);
+        const n64_randnet_kb *kb_state = N64_DOUBLE_BUFFER_READ(cont->kb_state);
 
         //Build the output. Buttons are byte reversed so its correct on the output
-        cont->data_buffer[RANDNET_BTN_POS + 0] = cont->kb_state.buttons[0] >> 8;
-        cont->data_buffer[RANDNET_BTN_POS + 1] = cont->kb_state.buttons[0] >> 0;
-        cont->data_buffer[RANDNET_BTN_POS + 2] = cont->kb_state.buttons[1] >> 8;
-        cont->data_buffer[RANDNET_BTN_POS + 3] = cont->kb_state.buttons[1] >> 0;
-        cont->data_buffer[RANDNET_BTN_POS + 4] = cont->kb_state.buttons[2] >> 8;
-        cont->data_buffer[RANDNET_BTN_POS + 5] = cont->kb_state.buttons[2] >> 0;
-        cont->data_buffer[RANDNET_BTN_POS + 6] = cont->kb_state.flags;
-        n64_wait_micros(2);
+        cont->data_buffer[RANDNET_BTN_POS + 0] = kb_state->buttons[0] >> 8;
+        cont->data_buffer[RANDNET_BTN_POS + 1] = kb_state->buttons[0] >> 0;
+        cont->data_buffer[RANDNET_BTN_POS + 2] = kb_state->buttons[1] >> 8;
+        cont->data_buffer[RANDNET_BTN_POS + 3] = kb_state->buttons[1] >> 0;
+        cont->data_buffer[RANDNET_BTN_POS + 4] = kb_state->buttons[2] >> 8;
+        cont->data_buffer[RANDNET_BTN_POS + 5] = kb_state->buttons[2] >> 0;
+        cont->data_buffer[RANDNET_BTN_POS + 6] = kb_state->flags;
 
         //Response is 7 bytes. 3 x 16bit buttons + 1 x 8bit status flags
-        n64_send_stream(&cont->data_buffer[RANDNET_BTN_POS], 7, cont);
+        N64_PROFILE_PATH(N64_PROFILE_RANDNET);
+        n64_send_stream(&cont->data_buffer[RANDNET_BTN_POS], 7, cont, start_clock, N64_REPLY_TURNAROUND_US);
+        n64_trace_transaction(cont, start_clock, n64_get_digest(&cont->data_buffer[RANDNET_BTN_POS], 7), 0);
 
         //We're done with this packet
         n64_reset_stream(cont);
@@ -274,103 +881,30 @@ void n64_controller_hande_new_edge(n64_input_dev_t *cont)
         //If there was a 'write' command to the peripheral bus, check if all 32 bytes of data have been received
         if (cont->data_buffer[N64_COMMAND_POS] == N64_PERI_WRITE && cont->current_byte == (N64_DATA_POS + 32))
         {
-            if (!n64_compare_addr_crc(peri_address))
+            uint8_t address_ok = n64_compare_addr_crc(peri_address);
+            if (!address_ok)
             {
                 cont->crc_error = 1;
+                cont->stats.addr_crc_errors++;
                 debug_print_error("[N64] ERROR: Address CRC Error %04x\n", peri_address);
             }
 
             peri_address &= 0xFFE0;
-            cont->data_buffer[N64_CRC_POS] = n64_get_crc(&cont->data_buffer[N64_DATA_POS]);
+            cont->data_buffer[N64_CRC_POS] = cont->data_crc;
             //If no peripheral, the CRC is inverted
             if (cont->current_peripheral == PERI_NONE)
                 cont->data_buffer[N64_CRC_POS] = ~cont->data_buffer[N64_CRC_POS];
 
             //Send the data CRC out straight away. N64 expects this very quickly
-            n64_wait_micros(2);
-            n64_send_stream(&cont->data_buffer[N64_CRC_POS], 1, cont);
+            N64_PROFILE_PATH(N64_PROFILE_PERI_WRITE + n64_profile_peri(cont));
+            n64_send_stream(&cont->data_buffer[N64_CRC_POS], 1, cont, start_clock, N64_REPLY_TURNAROUND_US);
+            n64_trace_transaction(cont, start_clock, cont->data_crc, cont->data_buffer[N64_CRC_POS]);
 
-            //Now handle the write command
-            switch (peri_address >> 12)
-            {
-                case 0x0:
-                    //VIRTUAL MEMPAK NOTE TABLE HOOK
-                    if (cont->mempack->virtual_is_active && cont->current_peripheral == PERI_MEMPAK &&
-                        peri_address >= 0x300 && peri_address < 0x500)
-                    {
-                        /*
-                         * When you 'delete' a note from the mempak manager, I can hook the
-                         * address being deleted and determine what row you selected.
-                         * The note table is located between 0x300 and 0x500 in the mempak
-                         * and has 32bytes (0x20) per note.
-                         * I use this as a hacky menu for the N64
-                         */
-                        uint32_t row = (peri_address - 0x300) / 0x20; //What row you have 'selected' 0-15
-                        cont->mempack->virtual_update_req = 1;
-                        cont->mempack->virtual_selected_row = row;
-                        debug_print_n64("[N64] Virtualpak write at row %u\n", row);
-                        break;
-                    }
-                    //Intentional fallthrough
-                case 0x1:
-                case 0x2:
-                case 0x3:
-                case 0x4:
-                case 0x5:
-                case 0x6:
-                case 0x7:
-                    if (cont->current_peripheral == PERI_MEMPAK && !cont->crc_error)
-                        n64_mempack_write32(cont->mempack, peri_address, &cont->data_buffer[N64_DATA_POS]);
-                    break;
-                case 0x8:
-                    if (cont->current_peripheral == PERI_TPAK)
-                    {
-                        //N64 writes 32 bytes of 0x84 to turn on the TPAK
-                        (cont->data_buffer[N64_DATA_POS] == 0x84) ? cont->tpak->power_state = 1 : (0);
-                        (cont->data_buffer[N64_DATA_POS] == 0xFE) ? tpak_reset(cont->tpak)      : (0);
-                        debug_print_tpak("[TPAK] Powerstate set to %u\n", cont->tpak->power_state);
-                    }
-                    else if (cont->current_peripheral == PERI_RUMBLE)
-                    {
-                        //N64 writes 32 bytes of 0x80 to initialise the rumblepak, 0xFE to reset it
-                        (cont->data_buffer[N64_DATA_POS] == 0x80) ? cont->rpak->initialised = 1 : (0);
-                        (cont->data_buffer[N64_DATA_POS] == 0xFE) ? cont->rpak->initialised = 0 : (0);
-                        debug_print_n64("[N64] Rumblepak Status %u\n", cont->rpak->initialised);
-                    }
-                    break;
-                case 0xA:
-                    if (cont->current_peripheral == PERI_TPAK)
-                    {
-                        //0x00, 0x01, or 0x02 and switches over the MBC memory space.
-                        cont->tpak->selected_mbc_bank = cont->data_buffer[N64_DATA_POS];
-                        debug_print_tpak("[TPAK] MBC bank changed to %u\n",  cont->tpak->selected_mbc_bank);
-                    }
-                    break;
-                case 0xB:
-                    if (cont->current_peripheral == PERI_TPAK)
-                    {
-                        cont->tpak->access_state_changed = cont->tpak->access_state != cont->data_buffer[N64_DATA_POS];
-                        cont->tpak->access_state = cont->data_buffer[N64_DATA_POS];
-                        debug_print_tpak("[TPAK] Access state set to %u\n",  cont->tpak->access_state);
-                    }
-                    break;
-                case 0xC:
-                     if (cont->current_peripheral == PERI_RUMBLE)
-                     {
-                         (cont->data_buffer[N64_DATA_POS] == 0x01) ? (cont->rpak->state = RUMBLE_START) :
-                                                                     (cont->rpak->state = RUMBLE_STOP);
-                         break;
-                     }
-                     //Intentional fallthrough
-                case 0xD:
-                case 0xE:
-                case 0xF:
-                    if (cont->current_peripheral == PERI_TPAK)
-                    {
-                        tpak_write(cont->tpak, peri_address, &cont->data_buffer[N64_DATA_POS]);
-                    }
-                    break;
-            }
+            //Now handle the write command. Anything staged for a read may now be out of date.
+            //A corrupt address could point anywhere in the save, so that write is acknowledged but dropped.
+            __atomic_add_fetch(&cont->peri_generation, 1, __ATOMIC_RELEASE);
+            if (address_ok)
+                cont->peri_handlers->write32[peri_address >> 12](cont, peri_address, &cont->data_buffer[N64_DATA_POS]);
 
             cont->peri_access = 0;
             n64_reset_stream(cont);
@@ -391,100 +925,172 @@ void n64_controller_hande_new_edge(n64_input_dev_t *cont)
 #endif
         )
         {
-            memset(&cont->data_buffer[N64_DATA_POS], 0x00, 32); //N64 responds with 0x00s unless otherwise set
-
 #ifdef USE_N64_ADDRESS_CRC
             if (!n64_compare_addr_crc(peri_address))
             {
                 cont->crc_error = 1;
+                cont->stats.addr_crc_errors++;
                 debug_print_error("[N64] ERROR: Address CRC Error %04x\n", peri_address);
             }
 #endif
 
             //Clear the address CRC bits
             peri_address &= 0xFFE0;
-            switch(peri_address >> 12)
+            N64_PROFILE_PATH(N64_PROFILE_PERI_READ + n64_profile_peri(cont));
+            uint8_t *reply = &cont->data_buffer[N64_DATA_POS];
+            n64_read_ahead *ra = &cont->read_ahead;
+            uint32_t read_ahead = cont->peri_handlers->read_ahead;
+
+            //If the main loop has already staged this block, reply straight from that.
+            if (N64_SHARED_LOAD(ra->state) == N64_RA_STAGED && ra->staged_address == peri_address &&
+                ra->staged_generation == N64_SHARED_LOAD(cont->peri_generation))
             {
-                case 0x0: //0x0000 - 0x0FFFF
-                case 0x1: //0x1000 = 0x1FFFF
-                    if (cont->current_peripheral == PERI_TPAK && cont->tpak->power_state == 1)
-                    {
-                        memset(&cont->data_buffer[N64_DATA_POS], 0x84, 32);
-                        debug_print_tpak("[TPAK] Request powerstate. Sending 0x84s (its enabled)\n");
-                        break;
-                    }
-                    //Fall through intentional
-                case 0x3: //0x3000 - 0x3FFF
-                case 0xB: //0xB000 - 0xBFFF
-                    if (cont->current_peripheral == PERI_TPAK)
-                    {
-                        if (cont->tpak->power_state != 1) break;
-                        if (cont->tpak->gbcart == NULL)
-                        {
-                            memset(&cont->data_buffer[N64_DATA_POS], 0x44, 32); //Return 0x44's if no cart is installed.
-                            break;
-                        }
-
-                        memset(&cont->data_buffer[N64_DATA_POS], (cont->tpak->access_state) ? 0x89 : 0x80, 32);
-                        debug_print_tpak("[TPAK] Request access_state. Sending 0x%02x\n", (cont->tpak->access_state) ? 0x89 : 0x80);
-                        //Set bit 2 of the first return value if the access mode was changed since last check.
-                        cont->data_buffer[N64_DATA_POS] |= (cont->tpak->access_state_changed << 2);
-                        cont->tpak->access_state_changed = 0;
-                        break;
-                    }
-                    //Fall through intentional
-                case 0x4:
-                case 0x5:
-                case 0x6:
-                case 0x7:
-                    if (cont->current_peripheral == PERI_MEMPAK)
-                    {
-                        n64_mempack_read32(cont->mempack, peri_address, &cont->data_buffer[N64_DATA_POS]);
-                    }
-                    break;
-                case 0x8:
-                case 0x9:
-                    //If rumblepak is initialised, respond with 32bytes of 0x80.
-                    if (cont->current_peripheral == PERI_RUMBLE && cont->rpak->initialised == 1)
-                    {
-                        memset(&cont->data_buffer[N64_DATA_POS], 0x80, 32);
-                        debug_print_n64("[N64] Request rumblepak state. Sending 0x80s (its initialised)\n");
-                    }
-                    //If tpak is powered up, respond with 32bytes of 0x84.
-                    else if (cont->current_peripheral == PERI_TPAK && cont->tpak->power_state == 1)
-                    {
-                        memset(&cont->data_buffer[N64_DATA_POS], 0x84, 32);
-                        debug_print_tpak("[TPAK] Request tpak power state. Sending 0x84s (its powered up)\n");
-                    }
-                    break;
-                case 0xC:
-                case 0xD:
-                case 0xE:
-                case 0xF:
-                    if(cont->current_peripheral == PERI_TPAK && cont->tpak->gbcart)
-                    {
-                        if (cont->tpak->power_state != 1) break;
-                        tpak_read(cont->tpak, peri_address, &cont->data_buffer[N64_DATA_POS]);
-                    }
-                    break;
+                reply = ra->data;
+                ra->hits++;
             }
+            else
+            {
+                memset(reply, 0x00, 32); //N64 responds with 0x00s unless otherwise set
+                cont->peri_handlers->read32[peri_address >> 12](cont, peri_address, reply);
 
-            //Calculate the CRC of the data buffer and place it at the end of the packet.
-            cont->data_buffer[N64_CRC_POS] = n64_get_crc(&cont->data_buffer[N64_DATA_POS]);
+                //Calculate the CRC of the data buffer and place it at the end of the packet.
+                reply[32] = n64_get_crc(reply);
 
-            //CRC is inverted when no peripheral is installed.
-            if (cont->current_peripheral == PERI_NONE)
-                cont->data_buffer[N64_CRC_POS] = ~cont->data_buffer[N64_CRC_POS];
+                //CRC is inverted when no peripheral is installed.
+                if (cont->current_peripheral == PERI_NONE)
+                    reply[32] = ~reply[32];
+
+                (read_ahead & (1 << (peri_address >> 12))) ? ra->misses++ : (0);
+            }
 
 #ifdef USE_N64_ADDRESS_CRC
-            n64_wait_micros(5);
+            //Address was fully received at the stop bit edge, so time the reply from that edge.
+            //The data fetch and CRC above are absorbed into the turnaround.
+            n64_send_stream(reply, 33, cont, start_clock, N64_READ_TURNAROUND_US);
 #else
-            n64_wait_micros(30);
+            n64_send_stream(reply, 33, cont, start_clock, N64_READ_GUARD_US);
 #endif
-            n64_send_stream(&cont->data_buffer[N64_DATA_POS], 33, cont);
+            n64_trace_transaction(cont, start_clock, (cont->current_peripheral == PERI_NONE) ? ~reply[32] : reply[32], reply[32]);
+
+            //Games read in long runs of consecutive blocks, so ask the main loop to stage the next one.
+            //Only once the reply is encoded, as it may still be in ra->data.
+            uint16_t next_address = peri_address + 0x20;
+            if (read_ahead & (1 << (next_address >> 12)))
+            {
+                N64_SHARED_STORE(ra->address, next_address);
+                N64_SHARED_STORE(ra->state, N64_RA_REQUESTED);
+            }
+            else
+            {
+                N64_SHARED_STORE(ra->state, N64_RA_EMPTY);
+            }
 
             cont->peri_access = 0;
             n64_reset_stream(cont);
         }
     }
 }
+
+//Handles one received bit. start_clock is the time of the falling edge that started the bit.
+//Edge handlers that sample the line themselves can call this directly instead of n64_controller_hande_new_edge.
+void n64_controller_rx_bit(n64_input_dev_t *cont, uint8_t bit, uint32_t start_clock)
+{
+#if (N64_PROFILE >= 1)
+    uint32_t exceptions = n64hal_hs_exc_get();
+    uint32_t entry = n64hal_hs_tick_get();
+    n64_profile_path_taken = N64_PROFILE_BIT;
+    n64_rx_bit(cont, bit, start_clock);
+    n64_profile_record(n64_profile_path_taken, n64hal_hs_tick_get() - entry, n64hal_hs_exc_get() != exceptions);
+#else
+    n64_rx_bit(cont, bit, start_clock);
+#endif
+}
+
+#if (N64_RX_CAPTURE >= 1)
+//Number of bits the console must have sent before the command handler needs to act on them.
+//This includes the first bit of the next byte (or the stop bit), as that is when the handler acts on a byte.
+static uint32_t n64_rx_bits_needed(uint8_t command)
+{
+    switch (command)
+    {
+    case N64_PERI_READ:
+#ifdef USE_N64_ADDRESS_CRC
+        return N64_DATA_POS * 8 + 1;
+#else
+        return N64_ADDRESS_LSB_POS * 8 + 3;
+#endif
+    case N64_PERI_WRITE:
+        return N64_CRC_POS * 8 + 1;
+    case N64_RANDNET_REQ:
+        return RANDNET_BTN_POS * 8 + 1;
+    default:
+        return (N64_COMMAND_POS + 1) * 8 + 1;
+    }
+}
+
+//Decode everything captured since the last boundary and pass it through the command handler.
+static void n64_controller_rx_batch(n64_input_dev_t *cont)
+{
+    uint8_t bits[N64_JOYBUS_MAX_RX_EDGES / 2];
+    uint32_t *edges = &n64_rx_edges[cont->id][cont->rx_decoded_edges];
+    uint32_t num_bits = n64_joybus_decode(edges, cont->rx_num_edges - cont->rx_decoded_edges,
+                                          cont->timing.threshold_clks, bits);
+
+    for (uint32_t i = 0; i < num_bits; i++)
+    {
+        n64_controller_rx_bit(cont, bits[i], edges[i * 2]);
+    }
+    cont->rx_decoded_edges += num_bits * 2;
+
+    //If the handler finished with the stream, ignore everything (including our own reply) until the bus goes idle.
+    if (cont->current_byte == 0 && cont->current_bit == 7)
+        cont->rx_boundary = 0;
+    else
+        cont->rx_boundary = n64_rx_bits_needed(cont->data_buffer[N64_COMMAND_POS]) * 2;
+}
+
+//Stores the time of an edge on the data line. The command handler only runs once enough edges
+//have arrived for it to do something.
+static void n64_controller_capture_edge(n64_input_dev_t *cont, uint32_t clock)
+{
+    //Falling edges are the even entries. If the bus has been idle, this is the start of a new command.
+    if ((cont->rx_num_edges & 1) == 0 && (clock - cont->rx_last_edge_clks) > cont->timing.idle_clks)
+    {
+        cont->rx_num_edges = 0;
+        cont->rx_decoded_edges = 0;
+        cont->rx_boundary = n64_rx_bits_needed(N64_IDENTIFY) * 2;
+    }
+    cont->rx_last_edge_clks = clock;
+
+    if (cont->rx_boundary == 0)
+        return;
+
+    if (cont->rx_num_edges >= N64_JOYBUS_MAX_RX_EDGES)
+    {
+        cont->rx_boundary = 0;
+        return;
+    }
+
+    n64_rx_edges[cont->id][cont->rx_num_edges++] = clock;
+    if (cont->rx_num_edges == cont->rx_boundary)
+        n64_controller_rx_batch(cont);
+}
+#endif
+
+//This function is called in the falling edge of the n64 data bus.
+//If N64_RX_CAPTURE is enabled, it is called on both edges instead.
+void n64_controller_hande_new_edge(n64_input_dev_t *cont)
+{
+    uint32_t start_clock = n64hal_hs_tick_get();
+
+#if (N64_RX_CAPTURE >= 1)
+    n64_controller_capture_edge(cont, start_clock);
+#else
+    //Wait for ~1.05us to pass since falling edge before reading bit
+    //Compared as elapsed ticks so it still works when the timer wraps.
+    uint32_t sample_clks = cont->timing.sample_clks;
+    while ((n64hal_hs_tick_get() - start_clock) < sample_clks);
+
+    n64_controller_rx_bit(cont, n64hal_input_read(cont), start_clock);
+#endif
+}
@@ -26,6 +26,28 @@ typedef struct __attribute__((packed))
     uint8_t flags;
 } n64_randnet_kb;
 
+//Fields that one side of the ISR and main loop writes and the other reads. A store releases everything written
+//before it, and a load acquires it. On the Teensy these are a plain load or store and a barrier. On a PC they are
+//what lets the thread sanitizer in tools/n64_replay see the handoff.
+#define N64_SHARED_LOAD(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define N64_SHARED_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+//For where each side stores one field then checks the other's. Either the load sees the other side's store, or
+//the other side's load sees this one.
+#define N64_SHARED_LOAD_SC(field) __atomic_load_n(&(field), __ATOMIC_SEQ_CST)
+#define N64_SHARED_STORE_SC(field, value) __atomic_store_n(&(field), (value), __ATOMIC_SEQ_CST)
+
+//Double buffer for state the main loop hands to the ISR. The main loop fills the buffer the ISR isn't using, then
+//flips index. The main loop can't interrupt the ISR, so the ISR always reads one complete update and never a mix
+//of two. Only the main loop may write.
+#define N64_DOUBLE_BUFFER(type) struct { type buffer[2]; volatile uint32_t index; }
+#define N64_DOUBLE_BUFFER_READ(db) (&(db).buffer[N64_SHARED_LOAD((db).index)])
+#define N64_DOUBLE_BUFFER_WRITE(db, value)                  \
+    do                                                      \
+    {                                                       \
+        (db).buffer[(db).index ^ 1] = *(value);             \
+        N64_SHARED_STORE((db).index, (db).index ^ 1);       \
+    } while (0)
+
 typedef enum
 {
     N64_CONTROLLER,
@@ -41,25 +63,144 @@ typedef enum
     PERI_TPAK
 } n64_peri_type;
 
+struct n64_input_dev;
+
+//Peripheral bus handler. address has its CRC bits cleared and data is the 32 byte data block.
+typedef void (*n64_peri_handler)(struct n64_input_dev *cont, uint16_t address, uint8_t *data);
+
+//Read and write handlers for each 4kB region of the peripheral address space (address >> 12).
+//Read handlers are called with data cleared to 0x00.
 typedef struct
 {
-    uint32_t id;                      //Controller ID
+    n64_peri_handler read32[16];
+    n64_peri_handler write32[16];
+    uint16_t read_ahead;
+} n64_peri_handlers;
+
+#define N64_RA_EMPTY 0
+#define N64_RA_REQUESTED 1
+#define N64_RA_STAGED 2
+
+//Peripheral read-ahead. The ISR requests the block after each read and the main loop stages it with its CRC.
+typedef struct
+{
+    uint8_t data[33];               //Staged 32 byte block followed by its CRC
+    volatile uint32_t state;        //N64_RA_EMPTY, N64_RA_REQUESTED or N64_RA_STAGED
+    volatile uint16_t address;      //Address the console is expected to read next
+    uint16_t staged_address;        //Address of the staged block
+    uint32_t staged_generation;     //peri_generation when the block was staged
+    uint32_t hits;                  //Reads answered from the staged block
+    uint32_t misses;                //Reads that had to be fetched in the reply window
+} n64_read_ahead;
+
+typedef enum
+{
+    N64_PORT_IDLE, //Waiting for the console to start a command
+    N64_PORT_RX,   //Receiving a command
+    N64_PORT_TX    //Reply is being played out by the transmitter
+} n64_port_state;
+
+//Registers for a port's data line, looked up once by n64hal_gpio_init so the ISR doesn't go through the pin tables.
+typedef struct
+{
+    volatile uint32_t *dir; //Direction register. The pin is driven low while it's an output
+    volatile uint32_t *in;  //Input level register
+    uint32_t mask;          //Bit for this pin in both registers
+} n64_gpio;
+
+//Joybus bit timing for a port, in timer ticks. Starts from the nominal 4us bit and follows the console's
+//measured bit period, so slow or overclocked consoles and long cables are sampled and answered at their own rate.
+typedef struct
+{
+    uint32_t bit_clks;       //Measured console bit period
+    uint32_t sample_clks;    //Falling edge to the bit sample point. Just after a '1' releases the line
+    uint32_t threshold_clks; //N64_RX_CAPTURE: Low time that separates a '1' from a '0'
+    uint32_t slot_clks;      //Length of each reply transmit slot. Turnaround delays are counted in slots
+    uint32_t idle_clks;      //Bus idle time that starts a new command
+    uint32_t period_sum;     //Bit periods measured since the last update
+    uint32_t period_count;   //Number of bit periods in period_sum
+} n64_bit_timing;
+
+//Protocol health counters. These are always enabled and cheap enough to update in the ISR.
+#define N64_STAT_IDENTIFY 0
+#define N64_STAT_STATUS 1
+#define N64_STAT_PERI_READ 2
+#define N64_STAT_PERI_WRITE 3
+#define N64_STAT_RANDNET 4
+#define N64_STAT_RESET 5
+#define N64_STAT_OTHER 6
+#define N64_STAT_NUM_COMMANDS 7
+#define N64_STAT_TURNAROUND_BUCKETS 32
+
+typedef struct
+{
+    uint32_t commands[N64_STAT_NUM_COMMANDS]; //Commands received, by N64_STAT_* type
+    uint32_t addr_crc_errors;                 //Peripheral accesses with a bad address CRC
+    uint32_t unknown_commands;                //Commands that hit the default case and were ignored
+    uint32_t idle_resets;                     //Partially received streams thrown away by the 300us idle rule
+    uint32_t overflows;                       //Streams longer than N64_MAX_POS bytes that wrapped the buffer
+    uint32_t turnaround[N64_STAT_TURNAROUND_BUCKETS]; //Timer ticks from the last bit received to each reply. Bucket n is 2^n to 2^(n+1)-1
+    uint32_t input_latency[N64_STAT_TURNAROUND_BUCKETS]; //Timer ticks from a USB report arriving to the first status reply that carried it
+} n64_port_stats;
+
+//Each port starts on its own 32 byte line, and the ISR state is at the start of it. The port array and the pak state
+//are ordinary globals, which the Teensy 4 linker places in DTCM. setup() checks they are still there.
+typedef struct __attribute__((aligned(32))) n64_input_dev
+{
+    //Edge ISR state. Read or written on every bit, so kept together at the start of the struct.
     int32_t current_bit;              //The current bit to being received in
     uint32_t current_byte;            //The current byte being received in
-    uint8_t data_buffer[50];          //Controller main tx and rx buffer
+    uint32_t bus_idle_timer_clks;     //Timer counter for bus idle timing
+    volatile n64_port_state port_state; //Where this port is up to in the current command
     uint32_t peri_access;             //Peripheral flag is set when a peripheral is being accessed
-    uint32_t crc_error;               //Set if the 2 byte address has a CRC error.
+    uint8_t data_crc;                 //Running CRC of the peripheral write data received so far
+    uint8_t data_buffer[50];          //Controller main tx and rx buffer
+    n64_gpio gpio;                    //Precomputed registers for gpio_pin
+    n64_bit_timing timing;            //Calibrated bit timing for this port
+    uint32_t rx_num_edges;            //N64_RX_CAPTURE: Number of edges captured for the current command
+    uint32_t rx_decoded_edges;        //N64_RX_CAPTURE: Number of captured edges already decoded
+    uint32_t rx_boundary;             //N64_RX_CAPTURE: Edge count when the command handler next needs to run. 0 to wait for idle
+    uint32_t rx_last_edge_clks;       //N64_RX_CAPTURE: Timer counter of the last edge
+
+    //Command state. Used by the ISR once per command.
+    uint32_t id;                      //Controller ID
     n64_input_type type;              //Store the type of input device. Controller, Mouse. Randnet etc.
-    n64_buttonmap b_state;            //N64 controller button and analog stick map
-    n64_randnet_kb kb_state;          //Randnet keyboard object
+    uint32_t crc_error;               //Set if the 2 byte address has a CRC error.
     n64_peri_type current_peripheral; //Peripheral flag, PERI_NONE, PERI_RUMBLE, PERI_MEMPAK, PERI_TPAK
+    const n64_peri_handlers *peri_handlers; //Peripheral bus handlers for current_peripheral
+    volatile uint32_t peri_generation; //Incremented on every peripheral write or change
+    volatile int32_t status_ready;    //Pre-encoded status reply buffer to send next. -1 if none published yet
+    volatile int32_t status_sending;  //Pre-encoded status reply buffer last handed to the transmitter
+    volatile uint32_t status_sent;    //Number of status replies sent
+    volatile uint32_t status_clks;    //Timer counter when the last status reply was sent
+    uint32_t tx_turnaround_clks;      //Timer ticks from the last bit received to the start of the last reply
+    uint32_t missed_polls;            //Number of commands started by the console that were never answered
+    N64_DOUBLE_BUFFER(n64_buttonmap) b_state; //N64 controller button and analog stick map
+    N64_DOUBLE_BUFFER(n64_randnet_kb) kb_state; //Randnet keyboard object. led_state is unused, see kb_led_state
+    volatile uint8_t kb_led_state;    //Randnet keyboard LEDs, as last set by the console
+    uint16_t status_buttons[2];       //dButtons encoded into each pre-encoded status reply buffer
+    uint32_t status_report_clks[2];   //Arrival time of the USB report encoded into each status reply buffer
+    uint32_t report_clks;             //Arrival time of the USB report in b_state
+    uint32_t latency_seen;            //status_sent when input_latency was last updated
+    uint32_t latency_report_clks;     //Arrival time of the last report recorded in input_latency
+    uint32_t latch_buttons;           //Set to hold each button change until a status reply has sent it
+    uint32_t latch_polls;             //status_sent when latch_delivered was last updated
+    uint16_t latch_delivered;         //dButtons in the last status reply the console was sent
+    uint16_t latch_report;            //dButtons in the last report, which the latched buttons are heading to
+    uint32_t poll_period_clks;        //Estimated time between the console's status polls. 0 until measured
+    uint32_t poll_last_clks;          //Timer counter of the last status poll the estimate has seen
+    uint32_t poll_seen;               //status_sent when poll_last_clks was read
+    uint32_t poll_rejects;            //Consecutive poll periods too far from the estimate to use
+    uint32_t poll_sampled;            //poll_seen when the input was last sampled ahead of the next poll
+    n64_port_stats stats;             //Protocol health counters
+    n64_read_ahead read_ahead;        //Next peripheral read staged by the main loop
+
+    //Main loop state, and state only the peripheral handlers need.
     n64_peri_type next_peripheral;    //What Peripheral to change to next after timer
     n64_transferpak *tpak;            //Pointer to installed transferpak
     n64_rumblepak *rpak;              //Pointer to installed rumblepak
     n64_mempack *mempack;             //Pointer to installed mempack
-                                      //
     uint32_t interrupt_attached;      //Flag is set when this controller is connected to an ext int.
-    uint32_t bus_idle_timer_clks;     //Timer counter for bus idle timing
     uint32_t gpio_pin;                //What pin is this controller connected to
 } n64_input_dev_t;
 
@@ -112,6 +253,17 @@ typedef struct
 
 void n64_subsystem_init(n64_input_dev_t *in_dev);
 void n64_controller_hande_new_edge(n64_input_dev_t *cont);
+void n64_controller_rx_bit(n64_input_dev_t *cont, uint8_t bit, uint32_t start_clock);
+void n64_controller_tx_complete(n64_input_dev_t *cont);
+void n64_controller_set_peripheral(n64_input_dev_t *cont, n64_peri_type peripheral);
+void n64_controller_set_buttons(n64_input_dev_t *cont, const n64_buttonmap *state, uint32_t report_clks);
+void n64_controller_set_kb(n64_input_dev_t *cont, const n64_randnet_kb *state);
+uint8_t n64_controller_publish_status(n64_input_dev_t *cont);
+void n64_controller_poll_update(n64_input_dev_t *cont);
+void n64_controller_latency_update(n64_input_dev_t *cont);
+uint8_t n64_controller_poll_due(n64_input_dev_t *cont, uint32_t margin_clks);
+uint8_t n64_controller_latch_pending(n64_input_dev_t *cont);
+void n64_controller_read_ahead(n64_input_dev_t *cont);
 
 #ifdef __cplusplus
 }
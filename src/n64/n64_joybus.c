@@ -0,0 +1,65 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Portable joybus line coding. Nothing in here touches hardware, the results are played out
+ * or consumed by the n64hal_* wrappers.
+ */
+
+#include <stdint.h>
+#include "n64_joybus.h"
+
+/*
+ * Function: Converts a byte stream into a transmit schedule of 1us slots, followed by the stop bit.
+ * See n64_joybus.h for the schedule format.
+ * The source buffer is not modified.
+ * ----------------------------
+ *   Returns: The number of slots written to slots.
+ *
+ *   txbuff: The bytes to send, MSB first.
+ *   len: Number of bytes to send. Must be <= N64_JOYBUS_MAX_TX_BYTES.
+ *   edge: The value to store for a slot that flips the data line. Other slots are stored as 0.
+ *   slots: Output schedule. Must hold atleast len * 8 * N64_JOYBUS_SLOTS_PER_BIT + N64_JOYBUS_STOP_SLOTS entries.
+ */
+uint32_t n64_joybus_encode(const uint8_t *txbuff, uint32_t len, uint32_t edge, uint32_t *slots)
+{
+    uint32_t n = 0;
+    for (uint32_t byte = 0; byte < len; byte++)
+    {
+        for (int32_t bit = 7; bit >= 0; bit--)
+        {
+            //Pull low, then release after 1us for a '1' or 3us for a '0'
+            uint32_t one = (txbuff[byte] >> bit) & 1;
+            slots[n++] = edge;
+            slots[n++] = one ? edge : 0;
+            slots[n++] = 0;
+            slots[n++] = one ? 0 : edge;
+        }
+    }
+
+    //Stop bit. Pull low for 2us, then release the bus.
+    slots[n++] = edge;
+    slots[n++] = 0;
+    slots[n++] = edge;
+    return n;
+}
+
+/*
+ * Function: Decodes joybus bits from captured edge timestamps. Even entries are falling edges and each odd entry
+ * is the rising edge that follows it. The bit value comes from how long the line was held low.
+ * ----------------------------
+ *   Returns: The number of bits written to bits.
+ *
+ *   edges: Edge timestamps in timer ticks, starting with a falling edge.
+ *   num_edges: Number of timestamps. A trailing falling edge without its rising edge is not decoded.
+ *   threshold: Low time in timer ticks that separates a '1' (1us low) from a '0' (3us low). Normally 2us.
+ *   bits: Output, one entry of 0 or 1 per bit.
+ */
+uint32_t n64_joybus_decode(const uint32_t *edges, uint32_t num_edges, uint32_t threshold, uint8_t *bits)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i + 1 < num_edges; i += 2)
+    {
+        bits[n++] = (edges[i + 1] - edges[i]) < threshold;
+    }
+    return n;
+}
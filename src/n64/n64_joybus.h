@@ -0,0 +1,37 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#ifndef _N64_JOYBUS_h
+#define _N64_JOYBUS_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+//Joybus bits are 4us long and are transmitted as four 1us slots.
+//A '1' is 1us low then 3us high. A '0' is 3us low then 1us high.
+//A transmit schedule holds the edges rather than the levels. Each slot is either 0, or the value that flips the data
+//line at the start of that slot. The line is released before and after every schedule, so a transmitter only ever
+//touches its own pin.
+#define N64_JOYBUS_SLOT_US 1
+#define N64_JOYBUS_SLOTS_PER_BIT 4
+#define N64_JOYBUS_STOP_SLOTS 3    //Controller stop bit is 2us low, then the line is released
+#define N64_JOYBUS_MAX_TX_BYTES 33 //Largest reply is a 32 byte peripheral read plus its CRC
+#define N64_JOYBUS_MAX_IDLE_SLOTS 32 //Reply turnaround can be prepended to a schedule as idle slots
+#define N64_JOYBUS_MAX_TX_SLOTS (N64_JOYBUS_MAX_IDLE_SLOTS + \
+                                 N64_JOYBUS_MAX_TX_BYTES * 8 * N64_JOYBUS_SLOTS_PER_BIT + N64_JOYBUS_STOP_SLOTS)
+
+//Received bits are captured as a falling and rising edge timestamp pair.
+#define N64_JOYBUS_MAX_RX_BYTES 36 //Largest command is a peripheral write. Command, address, 32 bytes data + stop bit.
+#define N64_JOYBUS_MAX_RX_EDGES ((N64_JOYBUS_MAX_RX_BYTES * 8 + 1) * 2)
+
+uint32_t n64_joybus_encode(const uint8_t *txbuff, uint32_t len, uint32_t edge, uint32_t *slots);
+uint32_t n64_joybus_decode(const uint32_t *edges, uint32_t num_edges, uint32_t threshold, uint8_t *bits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -20,9 +20,6 @@ typedef struct
     uint32_t virtual_selected_row;
 } n64_mempack;
 
-void n64_mempack_read32(n64_mempack *mempack, uint16_t address, uint8_t *rx_buff);
-void n64_mempack_write32(n64_mempack *mempack, uint16_t address, uint8_t *tx_buff);
-
 #ifdef __cplusplus
 }
 #endif
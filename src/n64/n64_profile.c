@@ -0,0 +1,104 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Execution time of each path through the controller ISR, measured from the bit being sampled to the handler
+ * returning. Enabled with N64_PROFILE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "usb64_conf.h"
+#include "n64_profile.h"
+
+#if (N64_PROFILE >= 1)
+static n64_profile_path n64_profile_paths[N64_PROFILE_NUM_PATHS];
+
+static const char *n64_profile_names[N64_PROFILE_NUM_PATHS] = {
+    "bit", "identify", "status", "randnet", "vpak hook",
+    "read none", "read rumblepak", "read mempak", "read tpak", "read vpak",
+    "write none", "write rumblepak", "write mempak", "write tpak", "write vpak"};
+
+/*
+ * Function: Adds one run of an ISR path to its statistics.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: void
+ *
+ *   path: N64_PROFILE_* path that was taken
+ *   ticks: Timer ticks the path took
+ *   preempted: Non zero if a higher priority interrupt ran during the path
+ */
+void n64_profile_record(uint32_t path, uint32_t ticks, uint32_t preempted)
+{
+    n64_profile_path *p = &n64_profile_paths[path];
+    (p->count == 0 || ticks < p->min) ? p->min = ticks : (0);
+    (ticks > p->max) ? p->max = ticks : (0);
+    p->total += ticks;
+    p->preempted += (preempted) ? 1 : 0;
+    p->count++;
+}
+
+/*
+ * Function: Copies out the statistics for a path. The ISR may update them during the copy, so this is only
+ * for reporting.
+ * ----------------------------
+ *   Returns: void
+ *
+ *   path: N64_PROFILE_* path
+ *   out: Where to copy the statistics
+ */
+void n64_profile_get(uint32_t path, n64_profile_path *out)
+{
+    *out = n64_profile_paths[path];
+}
+
+/*
+ * Function: Clears the statistics for every path.
+ * ----------------------------
+ *   Returns: void
+ */
+void n64_profile_clear()
+{
+    memset(n64_profile_paths, 0, sizeof(n64_profile_paths));
+}
+
+/*
+ * Function: Returns a readable name for a path, i.e "read mempak".
+ * ----------------------------
+ *   Returns: The name
+ *
+ *   path: N64_PROFILE_* path
+ */
+const char *n64_profile_name(uint32_t path)
+{
+    return (path < N64_PROFILE_NUM_PATHS) ? n64_profile_names[path] : "unknown";
+}
+
+/*
+ * Function: Returns the most time a path may take. All ports share one interrupt, so an edge on another port can
+ * be waiting behind this ISR. It must still be sampled after a '1' has been released (1us) and before a '0'
+ * is released (3us), so every path has to be well under 2us.
+ * These assume the ISR only runs on falling edges. With N64_RX_CAPTURE it is attached to CHANGE, so it also runs
+ * on every rising edge, 1us after the falling edge of a '1'. Bits are also decoded in batches, up to a whole
+ * peripheral write from a single edge, so one ISR run covers many recorded paths. There is no budget then.
+ * ----------------------------
+ *   Returns: Budget in nanoseconds, or 0 if there isn't one
+ *
+ *   path: N64_PROFILE_* path
+ */
+uint32_t n64_profile_budget_ns(uint32_t path)
+{
+#if (N64_RX_CAPTURE >= 1)
+    return 0;
+#endif
+    switch (path)
+    {
+    case N64_PROFILE_BIT:       return 500;
+    case N64_PROFILE_IDENTIFY:  return 1000;
+    case N64_PROFILE_STATUS:    return 1000;
+    case N64_PROFILE_RANDNET:   return 1000;
+    case N64_PROFILE_VPAK_HOOK: return 1000;
+    default:                    return 1800; //Peripheral reads and writes
+    }
+}
+#endif
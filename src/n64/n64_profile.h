@@ -0,0 +1,50 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#ifndef _N64_PROFILE_h
+#define _N64_PROFILE_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+//Peripherals that are profiled separately. The first four match n64_peri_type.
+#define N64_PROFILE_PERI_NONE 0
+#define N64_PROFILE_PERI_RUMBLE 1
+#define N64_PROFILE_PERI_MEMPAK 2
+#define N64_PROFILE_PERI_TPAK 3
+#define N64_PROFILE_PERI_VPAK 4
+#define N64_PROFILE_NUM_PERI 5
+
+//Paths through the controller ISR
+#define N64_PROFILE_BIT 0       //A bit that didn't need a reply
+#define N64_PROFILE_IDENTIFY 1  //Identify or reset
+#define N64_PROFILE_STATUS 2
+#define N64_PROFILE_RANDNET 3
+#define N64_PROFILE_VPAK_HOOK 4 //Virtual pak menu selection
+#define N64_PROFILE_PERI_READ 5 //Plus N64_PROFILE_PERI_*
+#define N64_PROFILE_PERI_WRITE (N64_PROFILE_PERI_READ + N64_PROFILE_NUM_PERI)
+#define N64_PROFILE_NUM_PATHS (N64_PROFILE_PERI_WRITE + N64_PROFILE_NUM_PERI)
+
+typedef struct
+{
+    uint32_t count;     //Times this path was taken
+    uint32_t min;       //Timer ticks
+    uint32_t max;       //Timer ticks
+    uint64_t total;     //Timer ticks
+    uint32_t preempted; //Runs interrupted by a higher priority interrupt. These are included in min/max/total
+} n64_profile_path;
+
+void n64_profile_record(uint32_t path, uint32_t ticks, uint32_t preempted);
+void n64_profile_get(uint32_t path, n64_profile_path *out);
+void n64_profile_clear();
+const char *n64_profile_name(uint32_t path);
+uint32_t n64_profile_budget_ns(uint32_t path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,7 +1,8 @@
 // Copyright 2020, Ryan Wendland, usb64
 // SPDX-License-Identifier: MIT
 
-#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
 #include "n64_settings.h"
 #include "n64_wrapper.h"
 #include "printf.h"
@@ -35,6 +36,7 @@ void n64_settings_init(n64_settings *settings)
             settings->sensitivity[i]  = DEFAULT_SENSITIVITY;
             settings->snap_axis[i]    = DEFAULT_SNAP;
             settings->octa_correct[i] = DEFAULT_OCTA_CORRECT;
+            settings->latch_buttons[i] = DEFAULT_LATCH_BUTTONS;
         }
         n64_settings_update_checksum(settings);
     }
@@ -18,6 +18,7 @@ typedef struct
     uint8_t deadzone[MAX_CONTROLLERS];           //0 to 4
     uint8_t snap_axis[MAX_CONTROLLERS];          //0 or 1
     uint8_t octa_correct[MAX_CONTROLLERS];       //0 or 1
+    uint8_t latch_buttons[MAX_CONTROLLERS];      //0 or 1
     uint8_t checksum;
 } n64_settings;
 
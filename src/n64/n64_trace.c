@@ -0,0 +1,80 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#include <stdint.h>
+#include "usb64_conf.h"
+#include "n64_trace.h"
+
+#if (N64_TRACE >= 1)
+//Single producer (the port's ISR), single consumer (the main loop) ring per port.
+//head and tail only ever increase and are wrapped when indexing, so no locking is needed.
+typedef struct
+{
+    n64_trace_record records[N64_TRACE_DEPTH];
+    volatile uint32_t head;    //Only written by the ISR
+    volatile uint32_t tail;    //Only written by the main loop
+    volatile uint32_t dropped; //Records lost because the ring was full
+} n64_trace_ring;
+
+static n64_trace_ring n64_trace_rings[MAX_CONTROLLERS];
+
+/*
+ * Function: Adds a record to the trace ring of record->port. If the ring is full, the record is dropped and counted.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: void
+ *
+ *   record: The record to add
+ */
+void n64_trace_push(const n64_trace_record *record)
+{
+    n64_trace_ring *ring = &n64_trace_rings[record->port];
+    uint32_t head = ring->head;
+    if (head - ring->tail >= N64_TRACE_DEPTH)
+    {
+        ring->dropped++;
+        return;
+    }
+    ring->records[head & (N64_TRACE_DEPTH - 1)] = *record;
+    __sync_synchronize();
+    ring->head = head + 1;
+}
+
+/*
+ * Function: Removes records from the trace ring of a port. Call from the main loop only.
+ * ----------------------------
+ *   Returns: Number of records copied into records
+ *
+ *   port: Controller port
+ *   records: Output buffer
+ *   max: Maximum number of records to copy
+ */
+uint32_t n64_trace_pop(uint32_t port, n64_trace_record *records, uint32_t max)
+{
+    n64_trace_ring *ring = &n64_trace_rings[port];
+    uint32_t tail = ring->tail;
+    uint32_t head = ring->head;
+    uint32_t count = 0;
+    __sync_synchronize();
+    while (tail != head && count < max)
+    {
+        records[count++] = ring->records[tail & (N64_TRACE_DEPTH - 1)];
+        tail++;
+    }
+    __sync_synchronize();
+    ring->tail = tail;
+    return count;
+}
+
+/*
+ * Function: Returns the total number of records dropped on a port because its ring was full.
+ * ----------------------------
+ *   Returns: Number of dropped records
+ *
+ *   port: Controller port
+ */
+uint32_t n64_trace_dropped(uint32_t port)
+{
+    return n64_trace_rings[port].dropped;
+}
+#endif
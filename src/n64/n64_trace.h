@@ -0,0 +1,38 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#ifndef _N64_TRACE_h
+#define _N64_TRACE_h
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define N64_TRACE_DEPTH 128 //Records buffered per port. Must be a power of 2
+
+#define N64_TRACE_PORT_SESSION 0xFF //Start of a capture. timestamp is the timer speed in Hz
+#define N64_TRACE_PORT_DROPPED 0xFE //Records were lost because a ring was full. command is the port, timestamp is the number lost
+
+//One joybus transaction. These are written to the SD card as is, so keep the layout in sync with tools/n64_trace.py
+typedef struct __attribute__((packed))
+{
+    uint32_t timestamp;  //Timer ticks at the falling edge of the last bit received from the console
+    uint16_t address;    //Peripheral address including its CRC bits. 0 for other commands
+    uint16_t turnaround; //Timer ticks from timestamp to the start of the reply
+    uint8_t port;        //Controller port, or N64_TRACE_PORT_*
+    uint8_t command;     //Joybus command byte
+    uint8_t digest;      //CRC of the data received (peripheral write) or sent (everything else)
+    uint8_t reply_crc;   //Data CRC byte sent in a peripheral read or write reply. 0 otherwise
+} n64_trace_record;
+
+void n64_trace_push(const n64_trace_record *record);
+uint32_t n64_trace_pop(uint32_t port, n64_trace_record *records, uint32_t max);
+uint32_t n64_trace_dropped(uint32_t port);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
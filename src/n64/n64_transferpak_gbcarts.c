@@ -7,7 +7,8 @@
  * Tranferpak emulation is my own RE.
  */
 
-#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
 #include "printf.h"
 #include "n64_mempak.h"
 #include "n64_virtualpak.h"
@@ -96,6 +97,35 @@ static uint8_t _gb_get_mbc_number(uint8_t mbc_type)
     }
 }
 
+//Keeps the ROM bank in range of the loaded cart. Carts with an unknown ROM size have no banks.
+static uint32_t _gb_wrap_rom_bank(gameboycart *gb, uint32_t bank)
+{
+    return (gb->num_rom_banks) ? bank % gb->num_rom_banks : 0;
+}
+
+//MBC3 maps the RTC registers into RAM banks 0x08 to 0x0C. Anything above that is not mapped.
+static uint8_t _gb_is_rtc_bank(gameboycart *gb, uint8_t mbc)
+{
+    return mbc == 3 && gb->selected_ram_bank >= 0x08 && gb->selected_ram_bank < 0x08 + sizeof(gb->rtc);
+}
+
+//All cart memory accesses are checked against the size of the backing memory. The bank registers
+//are set by the N64, so a noisy bus or a bank beyond the end of a small cart could otherwise reach
+//past it. Blocks that aren't backed by memory read as the 0x00s already in the reply.
+static void _gb_read_mem(uint8_t *mem, uint32_t size, uint32_t offset, uint8_t *outBuffer)
+{
+    if (mem == NULL || offset >= size || size - offset < 32)
+        return;
+    n64hal_read_extram(outBuffer, mem, offset, 32);
+}
+
+static void _gb_write_mem(uint8_t *mem, uint32_t size, uint32_t offset, uint8_t *inBuffer)
+{
+    if (mem == NULL || offset >= size || size - offset < 32)
+        return;
+    n64hal_write_extram(inBuffer, mem, offset, 32);
+}
+
 static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
 {
     uint8_t mbc = _gb_get_mbc_number(gb->mbc);
@@ -120,7 +150,7 @@ static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
         {
             //MBC5 lower ROM bank byte is set
             gb->selected_rom_bank = (gb->selected_rom_bank & 0x100) | val;
-            gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
+            gb->selected_rom_bank = _gb_wrap_rom_bank(gb, gb->selected_rom_bank);
             debug_print_tpak("[TPAK] MBC%u - ROM Bank changed to %u/%u\n", mbc,
                              gb->selected_rom_bank,
                              gb->num_rom_banks);
@@ -157,7 +187,7 @@ static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
             //MBC5 has a 9th ROM bank bit
             gb->selected_rom_bank = ((val & 0x01) << 8) | (gb->selected_rom_bank & 0xFF);
         }
-        gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
+        gb->selected_rom_bank = _gb_wrap_rom_bank(gb, gb->selected_rom_bank);
 
         debug_print_tpak("[TPAK] MBC%u - ROM Bank changed to %u/%u\n", mbc,
                          gb->selected_rom_bank,
@@ -170,7 +200,7 @@ static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
         {
             gb->selected_ram_bank = (val & 3);
             gb->selected_rom_bank = ((val & 3) << 5) | (gb->selected_rom_bank & 0x1F);
-            gb->selected_rom_bank = gb->selected_rom_bank % gb->num_rom_banks;
+            gb->selected_rom_bank = _gb_wrap_rom_bank(gb, gb->selected_rom_bank);
         }
         else if (mbc == 3)
         {
@@ -193,7 +223,7 @@ static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
     case 0xB:
         if (gb->ramsize > 0 && gb->enable_cart_ram)
         {
-            if (mbc == 3 && gb->selected_ram_bank >= 0x08)
+            if (_gb_is_rtc_bank(gb, mbc))
             {
                 gb->rtc[gb->selected_ram_bank - 0x08] = val;
                 n64hal_rtc_write(&gb->rtc_bits.high, &gb->rtc_bits.yday,
@@ -202,11 +232,11 @@ static void gb_write_cart(uint16_t addr, gameboycart *gb, uint8_t *inBuffer)
             }
             else if (gb->cart_mode_select && gb->selected_ram_bank < gb->num_ram_banks)
             {
-                n64hal_write_extram(inBuffer, gb->ram, addr - CART_RAM_ADDR + (gb->selected_ram_bank * CRAM_BANK_SIZE), 32);
+                _gb_write_mem(gb->ram, gb->ramsize, addr - CART_RAM_ADDR + (gb->selected_ram_bank * CRAM_BANK_SIZE), inBuffer);
             }
             else if (gb->num_ram_banks)
             {
-                n64hal_write_extram(inBuffer, gb->ram, addr - CART_RAM_ADDR, 32);
+                _gb_write_mem(gb->ram, gb->ramsize, addr - CART_RAM_ADDR, inBuffer);
             }
         }
         return;
@@ -223,7 +253,7 @@ static void gb_read_cart(uint16_t addr, gameboycart *gb, uint8_t *outBuffer)
     case 0x1:
     case 0x2:
     case 0x3:
-        n64hal_read_extram(outBuffer, gb->rom, addr, 32);
+        _gb_read_mem(gb->rom, gb->romsize, addr, outBuffer);
         return;
 
     case 0x4:
@@ -232,11 +262,11 @@ static void gb_read_cart(uint16_t addr, gameboycart *gb, uint8_t *outBuffer)
     case 0x7:
         if (mbc == 1 && gb->cart_mode_select)
         {
-            n64hal_read_extram(outBuffer, gb->rom, addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE, 32);
+            _gb_read_mem(gb->rom, gb->romsize, addr + ((gb->selected_rom_bank & 0x1F) - 1) * ROM_BANK_SIZE, outBuffer);
         }
         else
         {
-            n64hal_read_extram(outBuffer, gb->rom, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE, 32);
+            _gb_read_mem(gb->rom, gb->romsize, addr + (gb->selected_rom_bank - 1) * ROM_BANK_SIZE, outBuffer);
         }
         return;
 
@@ -244,7 +274,7 @@ static void gb_read_cart(uint16_t addr, gameboycart *gb, uint8_t *outBuffer)
     case 0xB:
         if (gb->ramsize > 0 && gb->enable_cart_ram)
         {
-            if (mbc == 3 && gb->selected_ram_bank >= 0x08)
+            if (_gb_is_rtc_bank(gb, mbc))
             {
                 n64hal_rtc_read(&gb->rtc_bits.high, &gb->rtc_bits.yday,
                                 &gb->rtc_bits.hour, &gb->rtc_bits.min, &gb->rtc_bits.sec);
@@ -253,11 +283,11 @@ static void gb_read_cart(uint16_t addr, gameboycart *gb, uint8_t *outBuffer)
             }
             else if ((gb->cart_mode_select || mbc != 1) && gb->selected_ram_bank < gb->num_ram_banks)
             {
-                n64hal_read_extram(outBuffer, gb->ram, addr - CART_RAM_ADDR + (gb->selected_ram_bank * CRAM_BANK_SIZE), 32);
+                _gb_read_mem(gb->ram, gb->ramsize, addr - CART_RAM_ADDR + (gb->selected_ram_bank * CRAM_BANK_SIZE), outBuffer);
             }
             else
             {
-                n64hal_read_extram(outBuffer, gb->ram, addr - CART_RAM_ADDR, 32);
+                _gb_read_mem(gb->ram, gb->ramsize, addr - CART_RAM_ADDR, outBuffer);
             }
         }
         return;
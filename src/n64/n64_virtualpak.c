@@ -1,7 +1,9 @@
 // Copyright 2020, Ryan Wendland, usb64
 // SPDX-License-Identifier: MIT
 
-#include <Arduino.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "printf.h"
 #include "usb64_conf.h"
 #include "n64_mempak.h"
@@ -168,22 +170,23 @@ static void n64_virtualpak_write_string(char *msg, uint8_t line, uint8_t ext)
     {
         uint8_t n64char = 0;
 
-        //If string terminator, fix length
-        if (msg[i] == '\0')
+        //If string terminator, fix length. Nothing past it is read.
+        if (len == 255 && msg[i] == '\0')
             len = i;
+        char c = (i < len) ? msg[i] : '\0';
 
         //Force upper case
-        if (msg[i] > 96)
-            msg[i] -= 32;
+        if (c > 96)
+            c -= 32;
 
         //Handle some unique cases
-        if (msg[i] == '_')
-            msg[i] = '-'; //replace _ with -
+        if (c == '_')
+            c = '-'; //replace _ with -
 
         //Find a match in the CHARMAP
         for (uint32_t j = 0; j < sizeof(MEMPACK_CHARMAP); j++)
         {
-            if (msg[i] == MEMPACK_CHARMAP[j])
+            if (c == MEMPACK_CHARMAP[j])
                 n64char = j;
         }
 
@@ -360,14 +363,15 @@ void n64_virtualpak_update(n64_mempack *vpak)
         n64_virtualpak_write_string("________________", SUBHEADING + 1, MENU_NAME_FIELD);
         n64_virtualpak_write_string("CONT SETTINGS", SUBHEADING + 2, MENU_NAME_FIELD);
 
-        n64_virtualpak_write_string("SENSITIVITY+", SUBHEADING + 4, MENU_NAME_FIELD);
-        n64_virtualpak_write_string("SENSITIVITY-", SUBHEADING + 5, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("SENSITIVITY+", SUBHEADING + 3, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("SENSITIVITY-", SUBHEADING + 4, MENU_NAME_FIELD);
 
-        n64_virtualpak_write_string("DEADZONE+", SUBHEADING + 7, MENU_NAME_FIELD);
-        n64_virtualpak_write_string("DEADZONE-", SUBHEADING + 8, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("DEADZONE+", SUBHEADING + 6, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("DEADZONE-", SUBHEADING + 7, MENU_NAME_FIELD);
 
-        n64_virtualpak_write_string("SNAP TOGGLE", SUBHEADING + 10, MENU_NAME_FIELD);
-        n64_virtualpak_write_string("OCTA TOGGLE", SUBHEADING + 11, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("SNAP TOGGLE", SUBHEADING + 9, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("OCTA TOGGLE", SUBHEADING + 10, MENU_NAME_FIELD);
+        n64_virtualpak_write_string("LATCH TOGGLE", SUBHEADING + 11, MENU_NAME_FIELD);
 
         n64_virtualpak_write_string("RESTORE DEFAULT", SUBHEADING + 12, MENU_NAME_FIELD);
 
@@ -375,39 +379,45 @@ void n64_virtualpak_update(n64_mempack *vpak)
         uint32_t selected_row = vpak->virtual_selected_row;
         if (selected_row != -1)
         {
-            if (selected_row == SUBHEADING + 4 && settings->sensitivity[controller_page] < 4)
+            if (selected_row == SUBHEADING + 3 && settings->sensitivity[controller_page] < 4)
                 settings->sensitivity[controller_page]++;     //Sensitivity increase
-            else if (selected_row == SUBHEADING + 5 && settings->sensitivity[controller_page] > 0)
+            else if (selected_row == SUBHEADING + 4 && settings->sensitivity[controller_page] > 0)
                 settings->sensitivity[controller_page]--;     //Sensitivity decrese
-            else if (selected_row == SUBHEADING + 7 && settings->deadzone[controller_page] < 4)
+            else if (selected_row == SUBHEADING + 6 && settings->deadzone[controller_page] < 4)
                 settings->deadzone[controller_page]++;        //Deadzone increase
-            else if (selected_row == SUBHEADING + 8 && settings->deadzone[controller_page] > 0)
+            else if (selected_row == SUBHEADING + 7 && settings->deadzone[controller_page] > 0)
                 settings->deadzone[controller_page]--;        //Deadzone decrease
-            else if (selected_row == SUBHEADING + 10)
+            else if (selected_row == SUBHEADING + 9)
                 settings->snap_axis[controller_page] ^= 1;    //Toggle axis 45 degree snapping
-            else if (selected_row == SUBHEADING + 11)
+            else if (selected_row == SUBHEADING + 10)
                 settings->octa_correct[controller_page] ^= 1; //Toggle octagonal correction
+            else if (selected_row == SUBHEADING + 11)
+                settings->latch_buttons[controller_page] ^= 1; //Toggle holding button changes until polled
             else if (selected_row == SUBHEADING + 12)
             {
                 settings->deadzone[controller_page] = DEFAULT_DEADZONE;
                 settings->sensitivity[controller_page] = DEFAULT_SENSITIVITY;
                 settings->snap_axis[controller_page] = DEFAULT_SNAP;
                 settings->octa_correct[controller_page] = DEFAULT_OCTA_CORRECT;
+                settings->latch_buttons[controller_page] = DEFAULT_LATCH_BUTTONS;
             }
             n64_settings_update_checksum(settings);
         }
 
         //Print the current values of each setting
         sprintf(buff, "%u\0", settings->sensitivity[controller_page]);
-        n64_virtualpak_write_string(buff, SUBHEADING + 4, MENU_EXT_FIELD);
+        n64_virtualpak_write_string(buff, SUBHEADING + 3, MENU_EXT_FIELD);
 
         sprintf(buff, "%u\0", settings->deadzone[controller_page]);
-        n64_virtualpak_write_string(buff, SUBHEADING + 7, MENU_EXT_FIELD);
+        n64_virtualpak_write_string(buff, SUBHEADING + 6, MENU_EXT_FIELD);
 
         sprintf(buff, "%u\0", settings->snap_axis[controller_page]);
-        n64_virtualpak_write_string(buff, SUBHEADING + 10, MENU_EXT_FIELD);
+        n64_virtualpak_write_string(buff, SUBHEADING + 9, MENU_EXT_FIELD);
 
         sprintf(buff, "%u\0", settings->octa_correct[controller_page]);
+        n64_virtualpak_write_string(buff, SUBHEADING + 10, MENU_EXT_FIELD);
+
+        sprintf(buff, "%u\0", settings->latch_buttons[controller_page]);
         n64_virtualpak_write_string(buff, SUBHEADING + 11, MENU_EXT_FIELD);
 
         vpak->virtual_selected_row = -1;
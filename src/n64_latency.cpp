@@ -0,0 +1,230 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Measures how late the controller edge ISR starts after each falling edge. Enabled with N64_LATENCY_PROFILE.
+ * There's no timestamp on a GPIO edge, so during a capture the main loop spins reading each data line and the
+ * cycle counter. The last time a line was seen high is just before its falling edge, which makes ISR entry minus
+ * that time the latency, give or take one pass of the loop.
+ * Every other interrupt vector is wrapped for the capture so that when an edge is late, the interrupt that
+ * finished most recently before the ISR could start can be blamed for it. The wrapper adds a few cycles to every
+ * interrupt, including the edge ISR itself, so the latencies read slightly high.
+ * The main loop does nothing else while a capture runs, so USB input is frozen for its duration.
+ */
+
+#include <Arduino.h>
+#include "usb64_conf.h"
+#include "n64_wrapper.h"
+#include "n64_latency.h"
+
+#if (N64_LATENCY_PROFILE >= 1)
+#define N64_LATENCY_FIRST_VECTOR 14 //PendSV. Faults and NMI are left alone
+#define N64_LATENCY_NUM_VECTORS (NVIC_NUM_INTERRUPTS + 16)
+
+typedef struct
+{
+    uint32_t samples;
+    uint32_t unmeasured; //Edges where the line wasn't seen high since the previous edge, so there was nothing to compare
+    uint32_t late;       //Edges where the latency pushed the bit sample past the end of a '0'
+    uint32_t min;        //Timer ticks
+    uint32_t max;        //Timer ticks
+    uint64_t total;      //Timer ticks
+    uint32_t histogram[N64_LATENCY_BUCKETS];
+} n64_latency_port;
+
+volatile uint32_t n64_latency_active = 0;
+static n64_input_dev_t *n64_latency_dev;
+static n64_latency_port n64_latency_ports[MAX_CONTROLLERS];
+static volatile uint32_t n64_latency_high_clks[MAX_CONTROLLERS]; //Last time the capture loop saw each line high
+static uint32_t n64_latency_entry_clks[MAX_CONTROLLERS];          //Last edge ISR entry on each port
+
+//Original handlers for the wrapped vectors, and the last wrapped interrupt to finish.
+static void (*n64_latency_vectors[N64_LATENCY_NUM_VECTORS])(void);
+static volatile uint32_t n64_latency_last_exception;
+static volatile uint32_t n64_latency_last_exit_clks;
+
+//Late edges by the exception number that was blamed. 0 is for edges where no other interrupt ran, so the delay
+//came from interrupts being disabled or from memory stalls.
+static uint32_t n64_latency_blame_count[N64_LATENCY_NUM_VECTORS];
+static uint32_t n64_latency_blame_max[N64_LATENCY_NUM_VECTORS];
+
+static void n64_latency_vector_wrapper()
+{
+    uint32_t exception;
+    asm volatile("mrs %0, ipsr" : "=r"(exception));
+    exception &= 0x1FF;
+    n64_latency_vectors[exception]();
+    n64_latency_last_exit_clks = ARM_DWT_CYCCNT;
+    n64_latency_last_exception = exception;
+}
+
+static const char *n64_latency_exception_name(uint32_t exception)
+{
+    switch (exception)
+    {
+    case 0:
+        return "none";
+    case 14:
+        return "PendSV";
+    case 15:
+        return "SysTick";
+    case IRQ_GPIO6789 + 16:
+        return "controller edge";
+    case IRQ_USB1 + 16:
+        return "USB device";
+    case IRQ_USB2 + 16:
+        return "USB host";
+    case IRQ_SDHC1 + 16:
+        return "SD card";
+    case IRQ_PIT + 16:
+        return "PIT";
+    case IRQ_LPUART6 + 16:
+        return "serial";
+    }
+    if (exception >= IRQ_DMA_CH0 + 16 && exception < IRQ_DMA_CH0 + 16 + 16)
+        return "DMA";
+    return "";
+}
+
+/*
+ * Function: Records the latency of one falling edge. Called from the edge ISR through n64_latency_edge.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: void
+ *
+ *   port: Controller port the edge was on
+ *   entry_clks: Cycle counter on entry to the ISR
+ */
+void n64_latency_record(uint32_t port, uint32_t entry_clks)
+{
+    n64_latency_port *p = &n64_latency_ports[port];
+    uint32_t high_clks = n64_latency_high_clks[port];
+    uint32_t previous_clks = n64_latency_entry_clks[port];
+    n64_latency_entry_clks[port] = entry_clks;
+
+    //If the capture loop hasn't seen the line high since the last edge it was held off by other ISRs for the
+    //whole of the bit, so the edge time isn't known.
+    if ((int32_t)(high_clks - previous_clks) <= 0 || (int32_t)(entry_clks - high_clks) < 0)
+    {
+        p->unmeasured++;
+        return;
+    }
+
+    uint32_t latency = entry_clks - high_clks;
+    (p->samples == 0 || latency < p->min) ? p->min = latency : (0);
+    (latency > p->max) ? p->max = latency : (0);
+    p->total += latency;
+    p->samples++;
+
+    uint32_t bucket = latency * 1000 / (n64hal_hs_tick_get_speed() / 1000000) / N64_LATENCY_BUCKET_NS;
+    p->histogram[(bucket < N64_LATENCY_BUCKETS) ? bucket : N64_LATENCY_BUCKETS - 1]++;
+
+    //A '0' holds the line low for 3/4 of the bit. Sampling after that reads it as a '1'.
+    n64_bit_timing *timing = &n64_latency_dev[port].timing;
+    if (latency + timing->sample_clks >= timing->bit_clks * 3 / 4)
+        p->late++;
+
+    //Blame the last interrupt to finish between the line being seen high and this ISR starting.
+    uint32_t exception = 0;
+    if ((int32_t)(n64_latency_last_exit_clks - high_clks) > 0)
+        exception = n64_latency_last_exception;
+    n64_latency_blame_count[exception]++;
+    (latency > n64_latency_blame_max[exception]) ? n64_latency_blame_max[exception] = latency : (0);
+}
+
+static void n64_latency_print()
+{
+    uint32_t ticks_per_us = n64hal_hs_tick_get_speed() / 1000000;
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        n64_latency_port *p = &n64_latency_ports[c];
+        if (p->samples == 0 && p->unmeasured == 0)
+            continue;
+        serial_port.printf("[N64] C%u edge latency n=%lu min=%lu avg=%lu max=%lu ns, unmeasured %lu, sampled outside the bit window %lu\n",
+                           c, p->samples, p->min * 1000 / ticks_per_us,
+                           p->samples ? (uint32_t)(p->total * 1000 / ticks_per_us / p->samples) : 0,
+                           p->max * 1000 / ticks_per_us, p->unmeasured, p->late);
+        for (uint32_t i = 0; i < N64_LATENCY_BUCKETS; i++)
+        {
+            if (p->histogram[i] == 0)
+                continue;
+            if (i == N64_LATENCY_BUCKETS - 1)
+                serial_port.printf("[N64] C%u %lu+ ns: %lu\n", c, i * N64_LATENCY_BUCKET_NS, p->histogram[i]);
+            else
+                serial_port.printf("[N64] C%u %lu-%lu ns: %lu\n", c, i * N64_LATENCY_BUCKET_NS,
+                                   (i + 1) * N64_LATENCY_BUCKET_NS - 1, p->histogram[i]);
+        }
+    }
+
+    for (uint32_t i = 0; i < N64_LATENCY_NUM_VECTORS; i++)
+    {
+        if (n64_latency_blame_count[i] == 0)
+            continue;
+        serial_port.printf("[N64] Ran before the edge ISR: exception %lu (IRQ %ld) %s, %lu edges, max %lu ns\n",
+                           i, (int32_t)i - 16, n64_latency_exception_name(i), n64_latency_blame_count[i],
+                           n64_latency_blame_max[i] * 1000 / ticks_per_us);
+    }
+}
+#endif
+
+/*
+ * Function: Measures the edge ISR latency on every attached port for a while, then prints the distribution and
+ * which interrupts ran before the late edges. Blocks the main loop until it's done.
+ * ----------------------------
+ *   Returns: void
+ *
+ *   in_dev: The array of MAX_CONTROLLERS controller ports
+ *   ms: How long to capture for
+ */
+void n64_latency_capture(n64_input_dev_t *in_dev, uint32_t ms)
+{
+#if (N64_LATENCY_PROFILE >= 1)
+    memset(n64_latency_ports, 0, sizeof(n64_latency_ports));
+    memset(n64_latency_blame_count, 0, sizeof(n64_latency_blame_count));
+    memset(n64_latency_blame_max, 0, sizeof(n64_latency_blame_max));
+    n64_latency_dev = in_dev;
+    n64_latency_last_exit_clks = ARM_DWT_CYCCNT;
+    for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+    {
+        n64_latency_entry_clks[c] = ARM_DWT_CYCCNT;
+        n64_latency_high_clks[c] = n64_latency_entry_clks[c];
+    }
+
+    __disable_irq();
+    for (uint32_t i = N64_LATENCY_FIRST_VECTOR; i < N64_LATENCY_NUM_VECTORS; i++)
+    {
+        n64_latency_vectors[i] = _VectorsRam[i];
+        _VectorsRam[i] = n64_latency_vector_wrapper;
+    }
+    asm volatile("dsb");
+    n64_latency_active = 1;
+    __enable_irq();
+
+    //Read the cycle counter before the line, so an edge that lands between the two is never stamped with a
+    //time after it.
+    uint32_t start = millis();
+    while ((millis() - start) < ms)
+    {
+        for (uint32_t c = 0; c < MAX_CONTROLLERS; c++)
+        {
+            uint32_t now = ARM_DWT_CYCCNT;
+            if (*in_dev[c].gpio.in & in_dev[c].gpio.mask)
+                n64_latency_high_clks[c] = now;
+        }
+    }
+
+    //Only put back vectors that weren't changed during the capture
+    __disable_irq();
+    n64_latency_active = 0;
+    for (uint32_t i = N64_LATENCY_FIRST_VECTOR; i < N64_LATENCY_NUM_VECTORS; i++)
+    {
+        if (_VectorsRam[i] == n64_latency_vector_wrapper)
+            _VectorsRam[i] = n64_latency_vectors[i];
+    }
+    asm volatile("dsb");
+    __enable_irq();
+
+    n64_latency_print();
+#else
+    serial_port.printf("[N64] Latency profiling is off. Set N64_LATENCY_PROFILE to 1 in usb64_conf.h\n");
+#endif
+}
@@ -0,0 +1,35 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#ifndef _N64_LATENCY_H
+#define _N64_LATENCY_H
+
+#include <Arduino.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+
+#define N64_LATENCY_BUCKET_NS 50 //Width of each latency histogram bucket
+#define N64_LATENCY_BUCKETS 64   //Buckets up to 3.2us. The last one also holds anything longer
+
+extern volatile uint32_t n64_latency_active;
+
+void n64_latency_record(uint32_t port, uint32_t entry_clks);
+void n64_latency_capture(n64_input_dev_t *in_dev, uint32_t ms);
+
+/*
+ * Function: Called at the start of the edge ISR to measure how late it started. Does nothing unless a
+ * capture is running.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: void
+ *
+ *   port: Controller port the edge was on
+ *   entry_clks: Cycle counter on entry to the ISR
+ */
+static inline void n64_latency_edge(uint32_t port, uint32_t entry_clks)
+{
+    if (n64_latency_active)
+        n64_latency_record(port, entry_clks);
+}
+
+#endif
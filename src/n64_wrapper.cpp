@@ -2,12 +2,19 @@
 // SPDX-License-Identifier: MIT
 
 #include <Arduino.h>
+#include <DMAChannel.h>
+#include <utility>
 #include "n64_controller.h"
+#include "n64_joybus.h"
 #include "n64_wrapper.h"
 #include "memory.h"
 #include "usb64_conf.h"
 #include "fileio.h"
 
+#ifndef ARM_DWT_EXCCNT
+#define ARM_DWT_EXCCNT (*(volatile uint32_t *)0xE000100C) //DWT exception overhead count register
+#endif
+
 /*
  * Function: Reads a hardware realtime clock and populates day,h,m,s.
  * Used by Pokemon Gameboy games only with TPAK that have a RTC.
@@ -56,6 +63,7 @@ void n64hal_rtc_write(uint8_t *day_high, uint8_t *day_low, uint8_t *h, uint8_t *
 void n64hal_hs_tick_init()
 {
     ARM_DWT_CTRL |= ARM_DWT_CTRL_CYCCNTENA;
+    ARM_DWT_CTRL |= (1 << 18); //EXCEVTENA. Enables the exception overhead counter for n64hal_hs_exc_get
 }
 
 /*
@@ -81,40 +89,221 @@ uint32_t n64hal_hs_tick_get()
 }
 
 /*
- * Function: Flips the gpio pin direction from an output (driven low) to an input (pulled up)
- *           for the controller passed by controller.
+ * Function: Get a counter that changes whenever the caller is preempted by another interrupt.
+ * Only used for profiling. Return 0 if this isn't available.
  * Speed critical!
  * ----------------------------
+ *   Returns: The counter value
+ */
+uint32_t n64hal_hs_exc_get()
+{
+    //Counts the cycles spent entering and leaving exceptions, so it moves on every preemption.
+    return ARM_DWT_EXCCNT;
+}
+
+//Fast GPIO6-9 bank of a controller pin, numbered from 0. The DMA reaches the matching GPIO1-4 bank instead.
+static uint32_t n64hal_tx_bank(n64_input_dev_t *controller)
+{
+    //GPIO6-9 and GPIO1-4 are both spaced 0x4000 apart, and GPIO6 pairs with GPIO1 etc.
+    return ((uint32_t)portOutputRegister(controller->gpio_pin) - (uint32_t)&GPIO6_DR) / 0x4000;
+}
+
+static volatile uint32_t *n64hal_tx_slow_gpio(uint32_t bank)
+{
+    return (volatile uint32_t *)((uint32_t)&GPIO1_DR + bank * 0x4000);
+}
+
+/*
+ * Function: Sets up controller->gpio_pin as a pulled up input, and looks up the registers used by
+ * n64hal_input_swap and n64hal_input_read. Call once gpio_pin is set.
+ * Not speed critical
+ * ----------------------------
+ *   Returns: void
+ *
+ *   controller: Pointer to the n64 controller struct which contains the gpio mapping
+ */
+void n64hal_gpio_init(n64_input_dev_t *controller)
+{
+    pinMode(controller->gpio_pin, INPUT_PULLUP);
+    controller->gpio.dir = portModeRegister(controller->gpio_pin);
+    controller->gpio.in = portInputRegister(controller->gpio_pin);
+    controller->gpio.mask = digitalPinToBitMask(controller->gpio_pin);
+
+    //DR stays low, so switching the pin to an output drives the line low. The pad keeps the pullup and
+    //strong drive from INPUT_PULLUP, so nothing else needs to change when the direction flips.
+    //The pad is open drain for the hardware transmitter, which drives the line through DR instead. See below.
+    *portClearRegister(controller->gpio_pin) = controller->gpio.mask;
+    *(portControlRegister(controller->gpio_pin)) = IOMUXC_PAD_DSE(7) | IOMUXC_PAD_PKE | IOMUXC_PAD_PUE |
+                                                   IOMUXC_PAD_PUS(3) | IOMUXC_PAD_HYS | IOMUXC_PAD_ODE;
+
+    //On the slow bank the pin is a released open drain output, ready for whenever a reply is muxed across to it.
+    volatile uint32_t *slow = n64hal_tx_slow_gpio(n64hal_tx_bank(controller));
+    slow[33] = controller->gpio.mask; //DR_SET
+    __disable_irq();
+    slow[1] |= controller->gpio.mask; //GDIR
+    __enable_irq();
+}
+
+/*
+ * Function: Discards any edge the data line interrupt has latched for this controller but not yet handled.
+ * Used after the CPU has sent a reply itself, as the port's own edges would otherwise look like a new command.
+ * ----------------------------
  *   Returns: void
  *
  *   controller: Pointer to the n64 controller struct which contains the gpio mapping
- *   val: N64_OUTPUT or N64_INPUT
  */
-void n64hal_input_swap(n64_input_dev_t *controller, uint8_t val)
+void n64hal_input_clear_edges(n64_input_dev_t *controller)
+{
+    controller->gpio.dir[5] = controller->gpio.mask; //ISR is 0x14 after GDIR. Write 1 to clear
+}
+
+/* Joybus hardware transmitter.
+ * The controller pins normally run on the fast GPIO6-9 banks, which the DMA cannot reach. For the duration of a reply
+ * the pin is muxed across to its matching GPIO1-4 bank, and a PIT channel paces a DMA channel that writes one
+ * transmit slot per tick into that bank's DR_TOGGLE register. The CPU is free as soon as the transfer is started.
+ * On the slow bank the pin is an open drain output, so DR high releases the line and DR low pulls it down. Transmit
+ * schedules hold edges (see n64_joybus.h), and writing a slot to DR_TOGGLE only flips the bits set in it, so a
+ * transfer never touches another pin. Ports sharing a bank (ports 1-3 all use GPIO2 on the Teensy 4.1) can reply
+ * at the same time.
+ * Each port has its own DMA and PIT channel so all ports can keep receiving while any of them are replying.
+ * A port that could not get a periodic DMA channel falls back to bit banging.
+ */
+#if (MAX_CONTROLLERS > 4)
+#error Only DMA channels 0-3 can be triggered by the PIT, so the joybus transmitter supports at most 4 ports
+#endif
+
+//DMAChannel's default constructor allocates a channel straight away. These are allocated by n64hal_tx_init instead.
+struct n64_tx_dma_channel : DMAChannel
+{
+    n64_tx_dma_channel() : DMAChannel(false) {}
+};
+
+static n64_tx_dma_channel n64_tx_dma[MAX_CONTROLLERS];
+static volatile uint32_t *n64_tx_pit[MAX_CONTROLLERS] = {NULL};
+static n64_input_dev_t *volatile n64_tx_controller[MAX_CONTROLLERS] = {NULL};
+
+static void n64hal_tx_complete(uint32_t port)
+{
+    n64_tx_dma[port].clearInterrupt();
+    n64_tx_pit[port][2] = 0; //TCTRL. Stop the slot timer
+
+    //The last slot releases the bus. Hand the pin back to the fast GPIO bank so we receive on it again.
+    //The mux register is shared with the other pins in the bank, so update it with interrupts off.
+    n64_input_dev_t *controller = n64_tx_controller[port];
+    n64hal_tx_slow_gpio(n64hal_tx_bank(controller))[33] = controller->gpio.mask; //DR_SET. Always leave it released
+    __disable_irq();
+    (&IOMUXC_GPR_GPR26)[n64hal_tx_bank(controller)] |= controller->gpio.mask;
+    __enable_irq();
+    n64_tx_controller[port] = NULL;
+    n64_controller_tx_complete(controller);
+    asm volatile("dsb");
+}
+
+template <uint32_t port>
+static void n64hal_tx_complete_isr()
+{
+    n64hal_tx_complete(port);
+}
+
+//Attaches the completion ISR for port. The ISR table has an instance for each port up to MAX_CONTROLLERS.
+template <size_t... ports>
+static void n64hal_tx_attach(uint32_t port, std::index_sequence<ports...>)
+{
+    static void (*const isr[])() = {n64hal_tx_complete_isr<ports>...};
+    n64_tx_dma[port].attachInterrupt(isr[port]);
+}
+
+/*
+ * Function: Sets up the hardware used to play out joybus transmit schedules.
+ * If no suitable hardware is available for a port, n64hal_tx_start should just return 0 for it.
+ * Not speed critical
+ * ----------------------------
+ *   Returns: void
+ */
+void n64hal_tx_init()
 {
-    switch (val)
+    CCM_CCGR0 |= CCM_CCGR0_GPIO2(CCM_CCGR_ON);
+    CCM_CCGR1 |= CCM_CCGR1_GPIO1(CCM_CCGR_ON) | CCM_CCGR1_PIT(CCM_CCGR_ON);
+    CCM_CCGR2 |= CCM_CCGR2_GPIO3(CCM_CCGR_ON);
+    CCM_CCGR3 |= CCM_CCGR3_GPIO4(CCM_CCGR_ON);
+    PIT_MCR = 1;
+
+    for (uint32_t port = 0; port < MAX_CONTROLLERS; port++)
     {
-    case N64_OUTPUT:
-        pinMode(controller->gpio_pin, OUTPUT);
-        break;
-    case N64_INPUT:
-    default:
-        pinMode(controller->gpio_pin, INPUT_PULLUP);
-        break;
+        //Periodic triggering is only available on DMA channels 0-3, using the PIT channel of the same number.
+        DMAChannel *dma = &n64_tx_dma[port];
+        dma->begin(true);
+        if (dma->channel > 3)
+        {
+            debug_print_error("[N64] ERROR: No DMA channel for joybus transmit on port %u, using CPU instead\n", port);
+            dma->release();
+            continue;
+        }
+
+        //PIT runs from the 24Mhz perclk. Registers per channel are LDVAL, CVAL, TCTRL, TFLG
+        n64_tx_pit[port] = &PIT_LDVAL0 + dma->channel * 4;
+        n64_tx_pit[port][2] = 0;
+        n64_tx_pit[port][0] = 24 * N64_JOYBUS_SLOT_US - 1;
+
+        dma->disableOnCompletion();
+        dma->interruptAtCompletion();
+        n64hal_tx_attach(port, std::make_index_sequence<MAX_CONTROLLERS>());
+        NVIC_SET_PRIORITY(IRQ_DMA_CH0 + dma->channel, 0);
+        dma->triggerContinuously();
+        (&DMAMUX_CHCFG0)[dma->channel] |= DMAMUX_CHCFG_TRIG;
     }
 }
 
 /*
- * Function: Returns the data line level for the n64 controller passed to this function.
+ * Function: Returns the value of a transmit slot that flips the data line for this controller.
+ * Slots that leave the line as it is are always 0.
+ * ----------------------------
+ *   Returns: The slot value
+ *
+ *   controller: Pointer to the n64 controller struct which contains the gpio mapping
+ */
+uint32_t n64hal_tx_edge_value(n64_input_dev_t *controller)
+{
+    //This is written straight into the DR_TOGGLE register
+    return controller->gpio.mask;
+}
+
+/*
+ * Function: Starts playing out a transmit schedule in the background. Slot 0 is applied immediately, then one
+ * slot every controller->timing.slot_clks ticks. The slots buffer must remain valid until the transfer is complete, at which point
+ * n64_controller_tx_complete is called.
  * Speed critical!
  * ----------------------------
- *   Returns: 1 of the line if high, or 0 if the line is low.
+ *   Returns: 1 if the transfer was started, 0 if the caller must send it itself.
  *
  *   controller: Pointer to the n64 controller struct which contains the gpio mapping
+ *   slots: Schedule generated by n64_joybus_encode
+ *   count: Number of slots
  */
-uint8_t n64hal_input_read(n64_input_dev_t *controller)
+uint8_t n64hal_tx_start(n64_input_dev_t *controller, const uint32_t *slots, uint32_t count)
 {
-    return digitalReadFast(controller->gpio_pin);
+    uint32_t port = controller->id;
+    if (n64_tx_pit[port] == NULL || n64_tx_controller[port] != NULL || count < 2)
+        return 0;
+
+    n64_tx_controller[port] = controller;
+    uint32_t mask = controller->gpio.mask;
+    uint32_t bank = n64hal_tx_bank(controller);
+    volatile uint32_t *gpio = n64hal_tx_slow_gpio(bank);
+
+    //The slow bank pin is a released open drain output from n64hal_gpio_init. Apply slot 0 to it, then
+    //switching the mux puts it on the line straight away and the DMA plays out the rest.
+    gpio[35] = slots[0]; //DR_TOGGLE
+    n64_tx_dma[port].sourceBuffer((volatile const unsigned int *)&slots[1], (count - 1) * sizeof(uint32_t));
+    n64_tx_dma[port].destination(*(volatile unsigned int *)&gpio[35]);
+    __disable_irq();
+    (&IOMUXC_GPR_GPR26)[bank] &= ~mask;
+    __enable_irq();
+    n64_tx_dma[port].enable();
+    n64_tx_pit[port][0] = controller->timing.slot_clks * 24 / (F_CPU / 1000000) - 1; //LDVAL. Slot length in perclks
+    n64_tx_pit[port][3] = 1;
+    n64_tx_pit[port][2] = PIT_TCTRL_TEN;
+    return 1;
 }
 
 /*
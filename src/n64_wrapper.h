@@ -8,7 +8,9 @@
 extern "C" {
 #endif
 
-#include <Arduino.h>
+//The N64 library in src/n64 only depends on the C library, printf and the n64hal_* functions below.
+//tools/n64_replay/n64_sim.c implements them on a PC, which is how n64_replay and n64_check run the library.
+#include <stdint.h>
 #include "n64_controller.h"
 
 #define N64_OUTPUT 1
@@ -22,6 +24,7 @@ void n64hal_rtc_write(uint8_t *day_high, uint8_t *day_low, uint8_t *h, uint8_t *
 uint32_t n64hal_hs_tick_get_speed();
 void n64hal_hs_tick_init();
 uint32_t n64hal_hs_tick_get();
+uint32_t n64hal_hs_exc_get();
   
 //RAM access wrappers
 void n64hal_read_extram(void *rx_buff, void *src, uint32_t offset, uint32_t len);
@@ -29,8 +32,45 @@ void n64hal_write_extram(void *tx_buff, void *dst, uint32_t offset, uint32_t len
 
 //GPIO wrappers
 void n64hal_output_set(uint8_t pin, uint8_t level);
-void n64hal_input_swap(n64_input_dev_t *controller, uint8_t val);
-uint8_t n64hal_input_read(n64_input_dev_t *controller);
+void n64hal_gpio_init(n64_input_dev_t *controller);
+void n64hal_input_clear_edges(n64_input_dev_t *controller);
+
+/*
+ * Function: Flips the gpio pin direction from an output (driven low) to an input (pulled up)
+ *           for the controller passed by controller. Uses the registers set up by n64hal_gpio_init.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: void
+ *
+ *   controller: Pointer to the n64 controller struct which contains the gpio mapping
+ *   val: N64_OUTPUT or N64_INPUT
+ */
+static inline void n64hal_input_swap(n64_input_dev_t *controller, uint8_t val)
+{
+    if (val == N64_OUTPUT)
+        *controller->gpio.dir |= controller->gpio.mask;
+    else
+        *controller->gpio.dir &= ~controller->gpio.mask;
+}
+
+/*
+ * Function: Returns the data line level for the n64 controller passed to this function.
+ * Uses the registers set up by n64hal_gpio_init.
+ * Speed critical!
+ * ----------------------------
+ *   Returns: 1 of the line if high, or 0 if the line is low.
+ *
+ *   controller: Pointer to the n64 controller struct which contains the gpio mapping
+ */
+static inline uint8_t n64hal_input_read(n64_input_dev_t *controller)
+{
+    return (*controller->gpio.in & controller->gpio.mask) ? 1 : 0;
+}
+
+//Joybus transmitter wrappers
+void n64hal_tx_init();
+uint32_t n64hal_tx_edge_value(n64_input_dev_t *controller);
+uint8_t n64hal_tx_start(n64_input_dev_t *controller, const uint32_t *slots, uint32_t count);
   
 //FileIO wrappers
 uint32_t n64hal_list_gb_roms(char **list, uint32_t max);
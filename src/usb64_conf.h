@@ -26,6 +26,21 @@
 #define ENABLE_I2C_CONTROLLERS 0      //Received button presses over I2C, useful for integrating with a rasp pi etc.
 #define ENABLE_HARDWIRED_CONTROLLER 1 //Ability to hardware a N64 controller into the usb64.
 #define PERI_CHANGE_TIME 750          //Milliseconds to simulate a peripheral changing time. Needed for some games.
+#define N64_RX_CAPTURE 0              //1 to timestamp both edges of the data line and decode bits from their low time in batches.
+                                      //0 samples each bit 1.05us after its falling edge. 1 interrupts on both edges, so
+                                      //the N64_PROFILE budgets don't apply.
+#define N64_CALIBRATE_TIMING 1        //1 to measure each console's bit period and scale the bit sample point, reply timing
+                                      //and idle detection to match it. 0 to always use the nominal 4us bit.
+#define N64_TRACE 0                   //1 to record every joybus transaction and save them to N64_TRACE_FILENAME on the SD card.
+                                      //Decode the file with tools/n64_trace.py
+#define N64_PROFILE 0                 //1 to measure how long each path through the controller ISR takes, per command and
+                                      //peripheral. Send 'p' over the serial port to print them against their budgets.
+#define N64_INPUT_FAST_PATH 1         //1 to check for new USB reports between each main loop step and publish them to the
+                                      //port straight away. 0 to only read each input device once per main loop.
+#define N64_INPUT_POLL_MARGIN_US 1000 //Learn how often the console polls each port and sample its input this long before the
+                                      //next poll is due, so the console gets the freshest input. 0 to disable.
+#define N64_LATENCY_PROFILE 0         //1 to measure how late the controller ISR starts after each falling edge. Send 'l' over
+                                      //the serial port for a 2 second capture. USB input is frozen while it runs.
 
 /* PIN MAPPING */
 #define N64_CONSOLE_SENSE 37
@@ -61,12 +76,14 @@
 #define SETTINGS_FILENAME "SETTINGS.DAT"
 #define GAMEBOY_SAVE_EXT ".SAV" //ROMFILENAME.SAV
 #define MEMPAK_SAVE_EXT ".MPK" //MEMPAKXX.MPK
+#define N64_TRACE_FILENAME "N64TRACE.BIN"
 
 /* FIRMWARE DEFAULTS (CONFIGURABLE DURING USE) */
 #define DEFAULT_SENSITIVITY 2  //0 to 4 (0 = low sensitivity, 4 = max)
 #define DEFAULT_DEADZONE 2     //0 to 4 (0 = no deadzone correction, 4 = max (40%))
 #define DEFAULT_SNAP 1         //0 or 1 (0 = will output raw analog stick angle, 1 will snap to 45deg angles)
 #define DEFAULT_OCTA_CORRECT 1 //0 or 1 (Will correct the circular analog stuck shape to N64 octagonal)
+#define DEFAULT_LATCH_BUTTONS 1 //0 or 1 (1 will hold each button press or release until the N64 has polled it, so quick taps aren't lost)
 
 /* FIRMWARE DEFAULTS (NOT CONFIGURABLE DURING USE) */
 #define SNAP_RANGE 5           //+/- what angle range will snap. 5 will snap to 45 degree if between 40 and 50 degrees.
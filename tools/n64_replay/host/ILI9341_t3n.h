@@ -0,0 +1,13 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* src/tft/tft.h includes the display driver. Nothing from it is used by src/input.cpp. */
+
+#ifndef _HOST_ILI9341_T3N_H
+#define _HOST_ILI9341_T3N_H
+
+class ILI9341_t3n
+{
+};
+
+#endif
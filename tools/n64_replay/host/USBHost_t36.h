@@ -0,0 +1,129 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Fake USBHost_t36 drivers, so src/input.cpp can be run on a PC. Each has the methods input.cpp calls, backed by
+ * public state that a check sets as if the USB stack had received a report. */
+
+#ifndef _HOST_USBHOST_T36_H
+#define _HOST_USBHOST_T36_H
+
+#include <stdint.h>
+#include <string.h>
+
+class USBHost
+{
+public:
+    void begin() {}
+    void Task() {}
+};
+
+class USBDriver
+{
+public:
+    bool connected = false;
+    uint16_t vid = 0;
+    uint16_t pid = 0;
+
+    operator bool() { return connected; }
+    uint16_t idVendor() { return vid; }
+    uint16_t idProduct() { return pid; }
+    const uint8_t *manufacturer() { return (const uint8_t *)"FAKE"; }
+    const uint8_t *product() { return (const uint8_t *)"FAKE"; }
+};
+
+class USBHub : public USBDriver
+{
+public:
+    USBHub(USBHost &host) {}
+};
+
+class USBHIDParser : public USBDriver
+{
+public:
+    USBHIDParser(USBHost &host) {}
+};
+
+class USBHIDInput : public USBDriver
+{
+};
+
+class JoystickController : public USBDriver
+{
+public:
+    enum joytype_t
+    {
+        UNKNOWN,
+        PS3,
+        PS4,
+        XBOXONE,
+        XBOX360,
+        PS3_MOTION,
+        SpaceNav,
+        SWITCH,
+        XBOX360_WIRED,
+        XBOXDUKE
+    };
+    static const int TOTAL_AXIS_COUNT = 64;
+
+    joytype_t type = UNKNOWN;
+    uint32_t buttons = 0;
+    int axis[TOTAL_AXIS_COUNT] = {0};
+    bool report = false; //Set when a report arrives, cleared by joystickDataClear
+
+    JoystickController(USBHost &host) {}
+    bool available() { return report; }
+    uint32_t getButtons() { return buttons; }
+    int getAxis(uint32_t index) { return (index < TOTAL_AXIS_COUNT) ? axis[index] : 0; }
+    joytype_t joystickType() { return type; }
+    void joystickDataClear() { report = false; }
+    bool setLEDs(uint8_t lr, uint8_t lg = 0, uint8_t lb = 0) { return true; }
+    bool setRumble(uint8_t lValue, uint8_t rValue, uint32_t timeout = 0) { return true; }
+
+    //A report from the controller, as the USB stack would store it
+    void receive(uint32_t new_buttons)
+    {
+        buttons = new_buttons;
+        report = true;
+    }
+};
+
+class MouseController : public USBHIDInput
+{
+public:
+    uint8_t buttons = 0;
+    int x = 0, y = 0;
+    bool report = false;
+
+    MouseController(USBHost &host) {}
+    bool available() { return report; }
+    uint8_t getButtons() { return buttons; }
+    int getMouseX() { return x; }
+    int getMouseY() { return y; }
+    void mouseDataClear()
+    {
+        report = false;
+        x = 0;
+        y = 0;
+    }
+};
+
+class KeyboardController : public USBHIDInput
+{
+public:
+    void (*raw_press)(uint8_t keycode) = nullptr;
+    void (*raw_release)(uint8_t keycode) = nullptr;
+    bool caps = false, num = false, scroll = false;
+
+    KeyboardController(USBHost &host) {}
+    void attachRawPress(void (*f)(uint8_t keycode)) { raw_press = f; }
+    void attachRawRelease(void (*f)(uint8_t keycode)) { raw_release = f; }
+    void capsLock(bool on) { caps = on; }
+    void numLock(bool on) { num = on; }
+    void scrollLock(bool on) { scroll = on; }
+
+    //Key events from the keyboard, as the USB stack would deliver them
+    void press(uint16_t key) { (raw_press) ? raw_press(key & 0xFF) : (void)0; }
+    void release(uint16_t key) { (raw_release) ? raw_release(key & 0xFF) : (void)0; }
+};
+
+#endif
@@ -0,0 +1,90 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* The key codes from the Teensy core's US English layout that src/input.h uses. The low byte is the USB HID usage,
+ * which is what the USBHost keyboard raw press and release callbacks are given. */
+
+#ifndef _HOST_KEYLAYOUTS_H
+#define _HOST_KEYLAYOUTS_H
+
+#define KEY_A (4 | 0xF000)
+#define KEY_B (5 | 0xF000)
+#define KEY_C (6 | 0xF000)
+#define KEY_D (7 | 0xF000)
+#define KEY_E (8 | 0xF000)
+#define KEY_F (9 | 0xF000)
+#define KEY_G (10 | 0xF000)
+#define KEY_H (11 | 0xF000)
+#define KEY_I (12 | 0xF000)
+#define KEY_J (13 | 0xF000)
+#define KEY_K (14 | 0xF000)
+#define KEY_L (15 | 0xF000)
+#define KEY_M (16 | 0xF000)
+#define KEY_N (17 | 0xF000)
+#define KEY_O (18 | 0xF000)
+#define KEY_P (19 | 0xF000)
+#define KEY_Q (20 | 0xF000)
+#define KEY_R (21 | 0xF000)
+#define KEY_S (22 | 0xF000)
+#define KEY_T (23 | 0xF000)
+#define KEY_U (24 | 0xF000)
+#define KEY_V (25 | 0xF000)
+#define KEY_W (26 | 0xF000)
+#define KEY_X (27 | 0xF000)
+#define KEY_Y (28 | 0xF000)
+#define KEY_Z (29 | 0xF000)
+#define KEY_1 (30 | 0xF000)
+#define KEY_2 (31 | 0xF000)
+#define KEY_3 (32 | 0xF000)
+#define KEY_4 (33 | 0xF000)
+#define KEY_5 (34 | 0xF000)
+#define KEY_6 (35 | 0xF000)
+#define KEY_7 (36 | 0xF000)
+#define KEY_8 (37 | 0xF000)
+#define KEY_9 (38 | 0xF000)
+#define KEY_0 (39 | 0xF000)
+#define KEY_ENTER (40 | 0xF000)
+#define KEY_ESC (41 | 0xF000)
+#define KEY_BACKSPACE (42 | 0xF000)
+#define KEY_TAB (43 | 0xF000)
+#define KEY_SPACE (44 | 0xF000)
+#define KEY_MINUS (45 | 0xF000)
+#define KEY_LEFT_BRACE (47 | 0xF000)
+#define KEY_RIGHT_BRACE (48 | 0xF000)
+#define KEY_SEMICOLON (51 | 0xF000)
+#define KEY_QUOTE (52 | 0xF000)
+#define KEY_TILDE (53 | 0xF000)
+#define KEY_COMMA (54 | 0xF000)
+#define KEY_PERIOD (55 | 0xF000)
+#define KEY_SLASH (56 | 0xF000)
+#define KEY_CAPS_LOCK (57 | 0xF000)
+#define KEY_F1 (58 | 0xF000)
+#define KEY_F2 (59 | 0xF000)
+#define KEY_F3 (60 | 0xF000)
+#define KEY_F4 (61 | 0xF000)
+#define KEY_F5 (62 | 0xF000)
+#define KEY_F6 (63 | 0xF000)
+#define KEY_F7 (64 | 0xF000)
+#define KEY_F8 (65 | 0xF000)
+#define KEY_F9 (66 | 0xF000)
+#define KEY_F10 (67 | 0xF000)
+#define KEY_F11 (68 | 0xF000)
+#define KEY_F12 (69 | 0xF000)
+#define KEY_PRINTSCREEN (70 | 0xF000)
+#define KEY_SCROLL_LOCK (71 | 0xF000)
+#define KEY_PAUSE (72 | 0xF000)
+#define KEY_HOME (74 | 0xF000)
+#define KEY_END (77 | 0xF000)
+#define KEY_RIGHT (79 | 0xF000)
+#define KEY_LEFT (80 | 0xF000)
+#define KEY_DOWN (81 | 0xF000)
+#define KEY_UP (82 | 0xF000)
+#define KEY_NUM_LOCK (83 | 0xF000)
+#define KEYPAD_ASTERIX (85 | 0xF000)
+#define KEYPAD_MINUS (86 | 0xF000)
+#define KEYPAD_PLUS (87 | 0xF000)
+#define KEYPAD_1 (89 | 0xF000)
+#define KEYPAD_2 (90 | 0xF000)
+#define KEYPAD_3 (91 | 0xF000)
+
+#endif
@@ -0,0 +1,933 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Checks for the joybus engine in src/n64, run on a PC against the simulated hardware in n64_sim.c.
+ * Each check drives the engine with console commands and main loop calls, and compares what the engine sends
+ * back against what a real controller would send.
+ *
+ * Usage: n64_check
+ * Prints each failure and exits with 1 if there were any.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_wrapper.h"
+#include "n64_sim.h"
+
+#define CHECK_BIT_CLKS SIM_US(4)   //Console bit period
+#define CHECK_LATENCY SIM_US(0.1)  //Falling edge to the edge ISR running
+#define CHECK_GAP SIM_US(500)      //Idle time between the end of a reply and the next command
+
+static uint32_t checks, failures;
+
+#define CHECK(cond, ...)                                              \
+    do                                                                \
+    {                                                                 \
+        checks++;                                                     \
+        if (!(cond))                                                  \
+        {                                                             \
+            failures++;                                               \
+            printf("FAIL %s:%d: %s: ", __func__, __LINE__, #cond);    \
+            printf(__VA_ARGS__);                                      \
+            printf("\n");                                             \
+        }                                                             \
+    } while (0)
+
+static n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+static uint64_t next_command; //When the console starts its next command
+static uint64_t stop_edge;    //Falling edge of the console stop bit of the last command
+
+/* HELPERS */
+//Starts every check from a freshly initialised port 0 with the given peripheral.
+static n64_input_dev_t *setup(n64_peri_type peripheral)
+{
+    sim_clear();
+    sim_reply_hook = NULL;
+    memset(n64_in_dev, 0, sizeof(n64_in_dev));
+    n64_subsystem_init(n64_in_dev);
+    n64_input_dev_t *cont = &n64_in_dev[0];
+    n64hal_gpio_init(cont);
+    memset(cont->rpak, 0, sizeof(n64_rumblepak));
+    cont->mempack->virtual_is_active = 0;
+    n64_controller_set_peripheral(cont, peripheral);
+    next_command = SIM_US(1000);
+    return cont;
+}
+
+//Sends a command from the console and waits for the reply to finish. Returns the reply, or NULL if there wasn't one.
+static const sim_reply *transact(n64_input_dev_t *cont, const uint8_t *command, uint32_t len)
+{
+    uint32_t first = sim_lines[0].num_edges;
+    uint32_t replies = sim_replies;
+    stop_edge = sim_add_command(0, next_command, command, len, CHECK_BIT_CLKS);
+    sim_run(cont, first, CHECK_LATENCY, 0, NULL);
+    sim_tx_finish(cont);
+    next_command = ((sim_now > stop_edge) ? sim_now : stop_edge) + CHECK_GAP;
+    return (sim_replies != replies) ? &sim_last_reply : NULL;
+}
+
+//Returns how long after the edge ISR ran for the console stop bit the reply started, in us. The engine can't see
+//the ISR latency, so replies are timed from when it ran.
+static double reply_delay_us(const sim_reply *reply, uint64_t latency)
+{
+    return reply ? ((double)reply->first_edge - (double)(stop_edge + latency)) / SIM_US(1) : -1;
+}
+
+static const sim_reply *poll_status(n64_input_dev_t *cont)
+{
+    static const uint8_t command[] = {N64_CONTROLLER_STATUS};
+    return transact(cont, command, sizeof(command));
+}
+
+//Returns the length of each low pulse in the line levels of a transmit schedule, in slots.
+static uint32_t low_pulses(const uint32_t *levels, uint32_t count, uint32_t *pulses)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (levels[i] == 0)
+            continue;
+        if (i == 0 || levels[i - 1] == 0)
+            pulses[n++] = 0;
+        pulses[n - 1]++;
+    }
+    return n;
+}
+
+//Adds the 5 bit address CRC to a peripheral address. Worked out bit by bit, independently of the engine's table.
+static uint16_t peri_address(uint16_t address)
+{
+    static const uint8_t bit_crc[11] = {0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01};
+    uint8_t crc = 0;
+    address &= 0xFFE0;
+    for (uint32_t i = 0; i < 11; i++)
+    {
+        if ((address >> (i + 5)) & 1)
+            crc ^= bit_crc[i];
+    }
+    return address | crc;
+}
+
+//CRC of a 32 byte peripheral data block. Polynomial 0x85, shifted through bit by bit with 8 zero bits appended.
+static uint8_t peri_data_crc(const uint8_t *data)
+{
+    uint8_t crc = 0;
+    for (uint32_t i = 0; i <= 32; i++)
+    {
+        for (int32_t bit = 7; bit >= 0; bit--)
+        {
+            uint8_t poly = (crc & 0x80) ? 0x85 : 0x00;
+            crc = (crc << 1) | ((i < 32) ? (data[i] >> bit) & 1 : 0);
+            crc ^= poly;
+        }
+    }
+    return crc;
+}
+
+static const sim_reply *identify(n64_input_dev_t *cont)
+{
+    static const uint8_t command[] = {N64_IDENTIFY};
+    return transact(cont, command, sizeof(command));
+}
+
+static const sim_reply *peri_read(n64_input_dev_t *cont, uint16_t encoded_address)
+{
+    uint8_t command[] = {N64_PERI_READ, encoded_address >> 8, encoded_address & 0xFF};
+    return transact(cont, command, sizeof(command));
+}
+
+static const sim_reply *peri_write(n64_input_dev_t *cont, uint16_t encoded_address, const uint8_t *data)
+{
+    uint8_t command[3 + 32] = {N64_PERI_WRITE, encoded_address >> 8, encoded_address & 0xFF};
+    memcpy(&command[3], data, 32);
+    return transact(cont, command, sizeof(command));
+}
+
+//Returns 1 if the reply is a valid waveform carrying exactly len bytes of data
+static int reply_is(const sim_reply *reply, const uint8_t *data, uint32_t len)
+{
+    return reply != NULL && reply->error == NULL && reply->num_bits == len * 8 && memcmp(reply->data, data, len) == 0;
+}
+
+//xorshift32, so a failing sequence is the same on every run
+static uint32_t check_rand()
+{
+    static uint32_t x = 0x6A09E667;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+static n64_buttonmap random_buttons()
+{
+    uint32_t r = check_rand();
+    n64_buttonmap state = {.dButtons = (uint16_t)r, .x_axis = (int8_t)(r >> 16), .y_axis = (int8_t)(r >> 24)};
+    return state;
+}
+
+//Starts a status poll and returns once the reply has started, leaving the transmitter busy.
+static void start_poll(n64_input_dev_t *cont)
+{
+    static const uint8_t command[] = {N64_CONTROLLER_STATUS};
+    uint32_t first = sim_lines[0].num_edges;
+    sim_tx_finish(cont); //The console doesn't poll until the last reply is over
+    stop_edge = sim_add_command(0, next_command, command, sizeof(command), CHECK_BIT_CLKS);
+    sim_run(cont, first, CHECK_LATENCY, 0, NULL);
+    next_command = stop_edge + CHECK_GAP;
+}
+
+/* CHECKS */
+//The line coding of every reply: each bit is 4us with a 1us low pulse for a '1' and 3us for a '0', then the
+//controller stop bit is 2us low before the line is released.
+static void check_encode_waveform()
+{
+    static const uint8_t patterns[][4] = {{0x00, 0x00, 0x00, 0x00}, {0xFF, 0xFF, 0xFF, 0xFF},
+                                          {0xA5, 0x5A, 0x01, 0x80}, {0x05, 0x00, 0x02, 0x00}};
+    uint32_t slots[N64_JOYBUS_MAX_TX_SLOTS];
+    uint32_t levels[N64_JOYBUS_MAX_TX_SLOTS];
+    uint32_t pulses[N64_JOYBUS_MAX_TX_SLOTS];
+
+    for (uint32_t p = 0; p < sizeof(patterns) / sizeof(patterns[0]); p++)
+    {
+        for (uint32_t len = 1; len <= sizeof(patterns[0]); len++)
+        {
+            //Schedules hold edges, only ever the value given for this pin
+            uint32_t count = n64_joybus_encode(patterns[p], len, 0x40, slots);
+            CHECK(count == len * 8 * N64_JOYBUS_SLOTS_PER_BIT + N64_JOYBUS_STOP_SLOTS, "count %u", count);
+            uint32_t other = 0;
+            for (uint32_t i = 0; i < count; i++)
+                other += (slots[i] != 0 && slots[i] != 0x40);
+            CHECK(other == 0, "pattern %u len %u touches other pins in %u slots", p, len, other);
+
+            sim_slot_levels(slots, count, levels);
+            CHECK(levels[count - 1] == 0, "pattern %u len %u doesn't release the line", p, len);
+
+            uint32_t num_pulses = low_pulses(levels, count, pulses);
+            CHECK(num_pulses == len * 8 + 1, "pattern %u len %u has %u pulses", p, len, num_pulses);
+            for (uint32_t i = 0; i < len * 8 && i < num_pulses; i++)
+            {
+                uint32_t expected = ((patterns[p][i / 8] >> (7 - (i % 8))) & 1) ? 1 : 3;
+                CHECK(pulses[i] == expected, "pattern %u bit %u is %uus low", p, i, pulses[i]);
+            }
+            CHECK(pulses[num_pulses - 1] == 2, "pattern %u stop bit is %uus low", p, pulses[num_pulses - 1]);
+
+            //Each bit starts exactly 4us after the last
+            for (uint32_t i = 0; i < len * 8; i++)
+            {
+                CHECK(levels[i * N64_JOYBUS_SLOTS_PER_BIT] != 0, "pattern %u bit %u doesn't start low", p, i);
+                CHECK(levels[i * N64_JOYBUS_SLOTS_PER_BIT + 3] == 0, "pattern %u bit %u doesn't end high", p, i);
+            }
+
+            sim_reply reply;
+            sim_decode_reply(slots, count, 0x40, SIM_US(1), &reply);
+            CHECK(reply.error == NULL, "pattern %u len %u: %s", p, len, reply.error);
+            CHECK(reply.num_bits == len * 8 && memcmp(reply.data, patterns[p], len) == 0, "pattern %u round trip", p);
+        }
+    }
+}
+
+//Replies sent through n64_send_stream and n64_send_slots, by the pre-encoded status buffers and by commands
+//encoded in the ISR, all have the joybus waveform and start 3us (4us for a peripheral read) after the ISR ran for
+//the falling edge of the console's 1us stop bit.
+static void check_reply_waveform()
+{
+    n64_input_dev_t *cont = setup(PERI_RUMBLE);
+    static const uint8_t identify[] = {N64_IDENTIFY};
+    static const uint8_t read[] = {N64_PERI_READ, 0x80, 0x01}; //0x8000 with its address CRC
+    const sim_reply *reply;
+
+    CHECK(cont->timing.slot_clks == SIM_US(1), "slot is %u ticks", cont->timing.slot_clks);
+
+    //n64_send_stream
+    reply = transact(cont, identify, sizeof(identify));
+    CHECK(reply != NULL && reply->error == NULL, "identify: %s", reply ? reply->error : "no reply");
+    CHECK(reply && reply->num_bits == 24, "identify is %u bits", reply ? reply->num_bits : 0);
+    CHECK(reply_delay_us(reply, CHECK_LATENCY) >= 3 && reply_delay_us(reply, CHECK_LATENCY) < 4,
+          "identify starts %.2fus after the stop bit", reply_delay_us(reply, CHECK_LATENCY));
+
+    //n64_send_stream, status before anything has been published
+    n64_buttonmap state = {.dButtons = N64_A | N64_CU, .x_axis = -80, .y_axis = 80};
+    N64_DOUBLE_BUFFER_WRITE(cont->b_state, &state);
+    reply = poll_status(cont);
+    CHECK(reply != NULL && reply->error == NULL, "status: %s", reply ? reply->error : "no reply");
+    CHECK(reply && reply->num_bits == 32 && memcmp(reply->data, &state, sizeof(state)) == 0, "status data");
+    CHECK(reply_delay_us(reply, CHECK_LATENCY) >= 3 && reply_delay_us(reply, CHECK_LATENCY) < 4,
+          "status starts %.2fus after the stop bit", reply_delay_us(reply, CHECK_LATENCY));
+
+    //n64_send_slots, from the pre-encoded buffer
+    CHECK(n64_controller_publish_status(cont) == 1, "publish");
+    reply = poll_status(cont);
+    CHECK(reply != NULL && reply->error == NULL, "published status: %s", reply ? reply->error : "no reply");
+    CHECK(reply && memcmp(reply->data, &state, sizeof(state)) == 0, "published status data");
+    CHECK(reply_delay_us(reply, CHECK_LATENCY) >= 3 && reply_delay_us(reply, CHECK_LATENCY) < 4,
+          "published status starts %.2fus after the stop bit", reply_delay_us(reply, CHECK_LATENCY));
+
+    //33 byte read reply with the longer turnaround
+    reply = transact(cont, read, sizeof(read));
+    CHECK(reply != NULL && reply->error == NULL, "read: %s", reply ? reply->error : "no reply");
+    CHECK(reply && reply->num_bits == 33 * 8, "read is %u bits", reply ? reply->num_bits : 0);
+    CHECK(reply_delay_us(reply, CHECK_LATENCY) >= 4 && reply_delay_us(reply, CHECK_LATENCY) < 5,
+          "read starts %.2fus after the stop bit", reply_delay_us(reply, CHECK_LATENCY));
+
+    //A late ISR still replies 3us after it ran, and the reply is timed in the console's calibrated slots
+    uint32_t first = sim_lines[0].num_edges;
+    stop_edge = sim_add_command(0, next_command, identify, sizeof(identify), CHECK_BIT_CLKS);
+    sim_run(cont, first, SIM_US(2.5), 0, NULL);
+    reply = &sim_last_reply;
+    CHECK(reply->error == NULL, "late identify: %s", reply->error);
+    CHECK(reply_delay_us(reply, SIM_US(2.5)) >= 3 && reply_delay_us(reply, SIM_US(2.5)) < 4,
+          "late identify starts %.2fus after the stop bit", reply_delay_us(reply, SIM_US(2.5)));
+    CHECK(reply->end - reply->first_edge == (24 * N64_JOYBUS_SLOTS_PER_BIT + N64_JOYBUS_STOP_SLOTS) * SIM_US(1),
+          "identify lasts %.2fus", (double)(reply->end - reply->first_edge) / SIM_US(1));
+    sim_tx_finish(cont);
+}
+
+//The ISR only reads b_state, so a held button stays held in every status reply until the main loop hands over a
+//new state. The main loop only services a port when its device sends a report or a poll is due, and most devices
+//only report changes, so clearing the buttons after each reply would release a held button on later polls.
+static void check_status_holds_buttons()
+{
+    n64_input_dev_t *cont = setup(PERI_RUMBLE);
+    n64_buttonmap state = {.dButtons = N64_A | N64_Z, .x_axis = 10, .y_axis = -10};
+    const sim_reply *reply;
+
+    //Encoded by the ISR before anything is published, then from the pre-encoded buffer
+    N64_DOUBLE_BUFFER_WRITE(cont->b_state, &state);
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        if (i == 3)
+            CHECK(n64_controller_publish_status(cont) == 1, "publish");
+        reply = poll_status(cont);
+        CHECK(reply && reply->error == NULL && memcmp(reply->data, &state, sizeof(state)) == 0,
+              "poll %u dropped the held buttons", i);
+        CHECK(memcmp(N64_DOUBLE_BUFFER_READ(cont->b_state), &state, sizeof(state)) == 0, "poll %u changed b_state", i);
+    }
+
+    //A release is sent on the next poll after it is published
+    state.dButtons = 0;
+    n64_controller_set_buttons(cont, &state, 0);
+    n64_controller_publish_status(cont);
+    reply = poll_status(cont);
+    CHECK(reply && reply->data[0] == 0 && reply->data[1] == 0, "release wasn't sent");
+}
+
+//Identify and reset replies for each device type and peripheral. An address CRC error is reported once.
+static void check_identify()
+{
+    static const uint8_t with_peri[] = {0x05, 0x00, 0x01};
+    static const uint8_t no_peri[] = {0x05, 0x00, 0x02};
+    static const uint8_t crc_error[] = {0x05, 0x00, 0x04};
+    static const uint8_t mouse[] = {0x02, 0x00, 0x00};
+    static const uint8_t randnet[] = {0x00, 0x02, 0x00};
+    static const uint8_t reset[] = {N64_CONTROLLER_RESET};
+    uint8_t data[32] = {0};
+
+    n64_input_dev_t *cont = setup(PERI_RUMBLE);
+    CHECK(reply_is(identify(cont), with_peri, 3), "controller with a rumblepak");
+    CHECK(reply_is(transact(cont, reset, sizeof(reset)), with_peri, 3), "reset");
+    CHECK(cont->stats.commands[N64_STAT_IDENTIFY] == 1 && cont->stats.commands[N64_STAT_RESET] == 1, "counted");
+
+    peri_write(cont, peri_address(0x8000) ^ 0x01, data);
+    CHECK(cont->stats.addr_crc_errors == 1, "address CRC error not counted");
+    CHECK(reply_is(identify(cont), crc_error, 3), "CRC error not reported");
+    CHECK(reply_is(identify(cont), with_peri, 3), "CRC error reported twice");
+
+    cont = setup(PERI_NONE);
+    CHECK(reply_is(identify(cont), no_peri, 3), "controller with no peripheral");
+
+    cont = setup(PERI_NONE);
+    cont->type = N64_MOUSE;
+    CHECK(reply_is(identify(cont), mouse, 3), "mouse");
+
+    cont = setup(PERI_NONE);
+    cont->type = N64_RANDNET;
+    CHECK(reply_is(identify(cont), randnet, 3), "randnet keyboard");
+}
+
+//Status replies carry b_state as it was published. The randnet keyboard doesn't answer them.
+static void check_status()
+{
+    n64_input_dev_t *cont = setup(PERI_RUMBLE);
+    n64_buttonmap state = {.dButtons = N64_ST | N64_DL | N64_RB, .x_axis = 127, .y_axis = -128};
+    n64_buttonmap zero = {0};
+
+    CHECK(reply_is(poll_status(cont), (uint8_t *)&zero, sizeof(zero)), "status before any input");
+    n64_controller_set_buttons(cont, &state, 0);
+    CHECK(reply_is(poll_status(cont), (uint8_t *)&state, sizeof(state)), "status before it's published");
+    CHECK(n64_controller_publish_status(cont) == 1, "publish");
+    CHECK(reply_is(poll_status(cont), (uint8_t *)&state, sizeof(state)), "published status");
+    CHECK(cont->status_sent == 3 && cont->stats.commands[N64_STAT_STATUS] == 3, "%u polls counted", cont->status_sent);
+
+    cont->type = N64_RANDNET;
+    CHECK(poll_status(cont) == NULL, "randnet keyboard answered a status poll");
+}
+
+//The double buffer between the main loop and the ISR, driven by random interleavings of new states, publishes,
+//polls and replies finishing. Every reply is the complete state of the last publish before it, or of b_state until
+//something has been published. A publish is only refused while the transmitter is still playing out the buffer it
+//would write, and no reply is changed while it is being sent.
+static void check_status_handoff()
+{
+    n64_input_dev_t *cont = setup(PERI_NONE);
+    n64_buttonmap published;
+    uint8_t any_published = 0;
+    uint32_t refused = 0, replies_checked = 0;
+
+    for (uint32_t i = 0; i < 20000; i++)
+    {
+        uint32_t action = check_rand() % 4;
+        if (action == 0)
+        {
+            n64_buttonmap state = random_buttons();
+            n64_controller_set_buttons(cont, &state, 0);
+        }
+        else if (action == 1)
+        {
+            uint32_t next = (cont->status_ready == 0) ? 1 : 0;
+            uint8_t in_use = (cont->port_state == N64_PORT_TX && cont->status_sending == (int32_t)next);
+            uint8_t ok = n64_controller_publish_status(cont);
+            CHECK(ok == !in_use, "step %u: publish returned %u with the buffer %s", i, ok, in_use ? "in use" : "free");
+            if (ok)
+            {
+                published = *N64_DOUBLE_BUFFER_READ(cont->b_state);
+                any_published = 1;
+            }
+            refused += !ok;
+        }
+        else if (action == 2)
+        {
+            n64_buttonmap expected = any_published ? published : *N64_DOUBLE_BUFFER_READ(cont->b_state);
+            uint32_t replies = sim_replies;
+            start_poll(cont);
+            CHECK(sim_replies == replies + 1, "step %u: poll wasn't answered", i);
+            CHECK(reply_is(&sim_last_reply, (uint8_t *)&expected, sizeof(expected)),
+                  "step %u: reply %02x%02x%02x%02x isn't the last published state %04x %d %d", i,
+                  sim_last_reply.data[0], sim_last_reply.data[1], sim_last_reply.data[2], sim_last_reply.data[3],
+                  expected.dButtons, expected.x_axis, expected.y_axis);
+            replies_checked++;
+        }
+        else
+        {
+            sim_tx_finish(cont);
+        }
+    }
+    sim_tx_finish(cont);
+
+    CHECK(sim_tx_overwrites == 0, "%u replies were changed while they were sent", sim_tx_overwrites);
+    CHECK(refused > 0 && replies_checked > 0, "%u publishes refused, %u replies checked", refused, replies_checked);
+    CHECK(cont->status_sent == replies_checked, "%u polls counted", cont->status_sent);
+}
+
+//A publish refused because the transmitter is still sending the buffer it needs goes through once the reply has
+//finished, as the main loop retries it, and the next poll carries that state rather than a stale one.
+static void check_publish_retry()
+{
+    n64_input_dev_t *cont = setup(PERI_NONE);
+    n64_buttonmap state[4];
+    for (uint32_t i = 0; i < 4; i++)
+        state[i] = random_buttons();
+
+    n64_controller_set_buttons(cont, &state[0], 0);
+    n64_controller_publish_status(cont);
+    poll_status(cont);
+    n64_controller_set_buttons(cont, &state[1], 0);
+    n64_controller_publish_status(cont);
+    start_poll(cont);
+    n64_controller_set_buttons(cont, &state[2], 0);
+    CHECK(n64_controller_publish_status(cont) == 1, "publish into the free buffer");
+    n64_controller_set_buttons(cont, &state[3], 0);
+    CHECK(n64_controller_publish_status(cont) == 0, "publish into the buffer being sent");
+
+    sim_tx_finish(cont);
+    CHECK(n64_controller_publish_status(cont) == 1, "retry once the reply has finished");
+    const sim_reply *reply = poll_status(cont);
+    CHECK(reply_is(reply, (uint8_t *)&state[3], sizeof(state[3])), "poll after the retry isn't the latest state");
+}
+
+//Button latching, driven by random reports and polls with the main loop publishing after every report. With
+//latch_buttons set, no button change is lost between polls even if it is undone before the next one, no change is
+//sent that no report made, the stick always follows the latest report, and once reports stop changing the console
+//sees the last one within two polls. Without it, every poll is just the latest report.
+static void check_latch_buttons()
+{
+    for (uint32_t latch = 0; latch <= 1; latch++)
+    {
+        n64_input_dev_t *cont = setup(PERI_NONE);
+        cont->latch_buttons = latch;
+        n64_buttonmap input = {0}; //Latest report
+        uint16_t shown = 0;        //dButtons in the last reply
+        uint16_t reported = 0;     //Buttons a report has differed from shown in since the last poll
+
+        for (uint32_t i = 0; i < 4000; i++)
+        {
+            if (check_rand() % 3 != 0)
+            {
+                //A report changing a button or two, or just the stick
+                n64_buttonmap next = random_buttons();
+                input.dButtons ^= (1 << (next.dButtons & 15)) | ((next.dButtons & 0x100) ? 1 << (next.dButtons >> 12) : 0);
+                input.x_axis = next.x_axis;
+                input.y_axis = next.y_axis;
+                n64_controller_set_buttons(cont, &input, 0);
+                n64_controller_publish_status(cont);
+                reported |= input.dButtons ^ shown;
+                continue;
+            }
+
+            const sim_reply *reply = poll_status(cont);
+            n64_buttonmap sent = {0};
+            CHECK(reply && reply->error == NULL && reply->num_bits == 32, "step %u: bad status reply", i);
+            reply ? memcpy(&sent, reply->data, sizeof(sent)) : (0);
+            CHECK(sent.x_axis == input.x_axis && sent.y_axis == input.y_axis, "step %u: stick %d %d isn't %d %d", i,
+                  sent.x_axis, sent.y_axis, input.x_axis, input.y_axis);
+
+            uint16_t changed = sent.dButtons ^ shown;
+            if (latch)
+            {
+                CHECK((reported & ~changed) == 0, "step %u: changes to %04x were lost", i, reported & ~changed);
+                CHECK((changed & ~reported) == 0, "step %u: %04x changed with no report", i, changed & ~reported);
+            }
+            else
+            {
+                CHECK(sent.dButtons == input.dButtons, "step %u: sent %04x, not the report %04x", i, sent.dButtons,
+                      input.dButtons);
+            }
+            shown = sent.dButtons;
+            reported = 0;
+        }
+
+        //The same report again after each poll, as a device holding its buttons does
+        for (uint32_t i = 0; i < 2; i++)
+        {
+            n64_controller_set_buttons(cont, &input, 0);
+            n64_controller_publish_status(cont);
+            poll_status(cont);
+        }
+        CHECK(reply_is(&sim_last_reply, (uint8_t *)&input, sizeof(input)), "latch %u: %02x%02x isn't the last report %04x",
+              latch, sim_last_reply.data[0], sim_last_reply.data[1], input.dButtons);
+    }
+}
+
+//A tap that starts and ends between two polls, reported once, followed by nothing but polls. This is how a device
+//that only reports changes behaves, with no poll estimate yet or N64_INPUT_POLL_MARGIN_US at 0, so the main loop
+//only services the port again when n64_controller_latch_pending asks it to. The console sees the tap pressed for
+//one poll, then released for good.
+static void check_latch_tap()
+{
+    n64_input_dev_t *cont = setup(PERI_NONE);
+    cont->latch_buttons = 1;
+    n64_buttonmap input = {.dButtons = N64_A, .x_axis = 5, .y_axis = -5};
+    n64_controller_set_buttons(cont, &input, 0);
+    n64_controller_publish_status(cont);
+    input.dButtons = 0;
+    n64_controller_set_buttons(cont, &input, 0);
+    n64_controller_publish_status(cont);
+
+    for (uint32_t i = 0; i < 6; i++)
+    {
+        const sim_reply *reply = poll_status(cont);
+        uint16_t expected = (i == 0) ? N64_A : 0;
+        n64_buttonmap sent = {0};
+        reply ? memcpy(&sent, reply->data, sizeof(sent)) : (0);
+        CHECK(reply && reply->error == NULL && sent.dButtons == expected, "poll %u sent %04x, not %04x", i,
+              sent.dButtons, expected);
+
+        //Main loop passes between polls, servicing the port with the same last report when asked to
+        for (uint32_t pass = 0; pass < 3; pass++)
+        {
+            uint8_t pending = n64_controller_latch_pending(cont);
+            CHECK(pending == (i == 0 && pass == 0), "poll %u pass %u: latch_pending is %u", i, pass, pending);
+            if (pending)
+            {
+                n64_controller_set_buttons(cont, &input, 0);
+                n64_controller_publish_status(cont);
+            }
+        }
+    }
+}
+
+static uint32_t latency_count(n64_input_dev_t *cont, int32_t *bucket)
+{
+    uint32_t total = 0;
+    for (int32_t i = 0; i < N64_STAT_TURNAROUND_BUCKETS; i++)
+    {
+        total += cont->stats.input_latency[i];
+        cont->stats.input_latency[i] ? *bucket = i : (0);
+    }
+    return total;
+}
+
+//Report to console latency. Each report is recorded once, in the bucket for the time from its arrival to the first
+//status reply that carried it. Bucket n is 2^n to 2^(n+1)-1 ticks. If more than one poll went out since the last
+//update, it isn't known which one carried the report first, so nothing is recorded.
+static void check_input_latency()
+{
+    n64_input_dev_t *cont = setup(PERI_NONE);
+
+    for (uint32_t i = 0; i < 400; i++)
+    {
+        //A report that arrived between 1us and 30ms before the console starts its next poll
+        uint32_t age = SIM_US(1) + check_rand() % SIM_US(30000);
+        uint32_t arrived = (uint32_t)next_command - age;
+        n64_buttonmap state = random_buttons();
+        n64_controller_set_buttons(cont, &state, arrived);
+        n64_controller_publish_status(cont);
+        memset(cont->stats.input_latency, 0, sizeof(cont->stats.input_latency));
+
+        //Every fourth report is polled twice before the main loop gets to it
+        uint32_t polls = (i % 4 == 3) ? 2 : 1;
+        uint32_t first_poll = 0;
+        for (uint32_t p = 0; p < polls; p++)
+        {
+            poll_status(cont);
+            (p == 0) ? first_poll = cont->status_clks : (0);
+        }
+        n64_controller_latency_update(cont);
+
+        int32_t bucket = -1;
+        uint32_t count = latency_count(cont, &bucket);
+        if (polls == 1)
+        {
+            //The poll is timed from the ISR for its stop bit, 8 bits into the command
+            uint32_t waited = first_poll - arrived;
+            int32_t expected = 0;
+            while (expected < 31 && (waited >> (expected + 1)) != 0)
+                expected++;
+            CHECK(waited >= age + SIM_US(32) && waited < age + SIM_US(33), "step %u: waited %u ticks for a %u tick old report",
+                  i, waited, age);
+            CHECK(count == 1 && bucket == expected, "step %u: %u recorded in bucket %d, not bucket %d", i, count, bucket,
+                  expected);
+        }
+        else
+        {
+            CHECK(count == 0, "step %u: recorded after two polls", i);
+        }
+
+        //Nothing more for the same report, with or without another poll
+        n64_controller_latency_update(cont);
+        poll_status(cont);
+        n64_controller_latency_update(cont);
+        CHECK(latency_count(cont, &bucket) == count, "step %u: the same report was recorded again", i);
+    }
+}
+
+//Peripheral reads return the 32 byte block and its data CRC, which is inverted if there's no peripheral.
+static void check_peri_read()
+{
+    static uint8_t mempak[MEMPAK_SIZE];
+    uint8_t expected[33];
+    n64_input_dev_t *cont = setup(PERI_MEMPAK);
+    cont->mempack->data = mempak;
+    cont->mempack->id = 0;
+    n64_controller_set_peripheral(cont, PERI_MEMPAK);
+    for (uint32_t i = 0; i < sizeof(mempak); i++)
+        mempak[i] = i * 7 + (i >> 8);
+
+    static const uint16_t addresses[] = {0x0000, 0x0120, 0x0140, 0x3FE0, 0x7FE0};
+    for (uint32_t i = 0; i < sizeof(addresses) / sizeof(addresses[0]); i++)
+    {
+        memcpy(expected, &mempak[addresses[i]], 32);
+        expected[32] = peri_data_crc(expected);
+        CHECK(reply_is(peri_read(cont, peri_address(addresses[i])), expected, 33), "mempak read %04x", addresses[i]);
+    }
+
+    //Rumblepak state reads 0x80s once it's been initialised
+    cont = setup(PERI_RUMBLE);
+    memset(expected, 0x00, 32);
+    expected[32] = peri_data_crc(expected);
+    CHECK(reply_is(peri_read(cont, peri_address(0x8000)), expected, 33), "uninitialised rumblepak");
+    cont->rpak->initialised = 1;
+    memset(expected, 0x80, 32);
+    expected[32] = peri_data_crc(expected);
+    CHECK(reply_is(peri_read(cont, peri_address(0x8000)), expected, 33), "initialised rumblepak");
+
+    cont = setup(PERI_NONE);
+    memset(expected, 0x00, 32);
+    expected[32] = ~peri_data_crc(expected);
+    CHECK(reply_is(peri_read(cont, peri_address(0x0000)), expected, 33), "no peripheral");
+    CHECK(cont->stats.commands[N64_STAT_PERI_READ] == 1 && cont->stats.addr_crc_errors == 0, "counted");
+}
+
+//Peripheral writes are acknowledged with the data CRC and then applied. A write with a bad address CRC is
+//acknowledged but dropped.
+static void check_peri_write()
+{
+    static uint8_t mempak[MEMPAK_SIZE];
+    uint8_t data[32], crc;
+    n64_input_dev_t *cont = setup(PERI_MEMPAK);
+    cont->mempack->data = mempak;
+    cont->mempack->id = 0;
+    n64_controller_set_peripheral(cont, PERI_MEMPAK);
+    memset(mempak, 0xFF, sizeof(mempak));
+    for (uint32_t i = 0; i < sizeof(data); i++)
+        data[i] = 0xA0 + i;
+
+    crc = peri_data_crc(data);
+    CHECK(reply_is(peri_write(cont, peri_address(0x0240), data), &crc, 1), "mempak write");
+    CHECK(memcmp(&mempak[0x0240], data, 32) == 0, "mempak write wasn't stored");
+    CHECK(mempak[0x023F] == 0xFF && mempak[0x0260] == 0xFF, "mempak write spilled over");
+
+    data[0] ^= 0xFF;
+    crc = peri_data_crc(data);
+    CHECK(reply_is(peri_write(cont, peri_address(0x0240) ^ 0x03, data), &crc, 1), "bad address not acknowledged");
+    CHECK(mempak[0x0240] != data[0], "write to a bad address was stored");
+    CHECK(cont->stats.addr_crc_errors == 1, "bad address not counted");
+
+    //Rumblepak init and motor control
+    cont = setup(PERI_RUMBLE);
+    memset(data, 0x80, sizeof(data));
+    crc = peri_data_crc(data);
+    CHECK(reply_is(peri_write(cont, peri_address(0x8000), data), &crc, 1), "rumblepak init");
+    CHECK(cont->rpak->initialised == 1, "rumblepak wasn't initialised");
+    memset(data, 0x01, sizeof(data));
+    crc = peri_data_crc(data);
+    CHECK(reply_is(peri_write(cont, peri_address(0xC000), data), &crc, 1), "rumblepak motor");
+    CHECK(cont->rpak->state == RUMBLE_START, "motor wasn't started");
+    memset(data, 0x00, sizeof(data));
+    peri_write(cont, peri_address(0xC000), data);
+    CHECK(cont->rpak->state == RUMBLE_STOP, "motor wasn't stopped");
+
+    cont = setup(PERI_NONE);
+    crc = ~peri_data_crc(data);
+    CHECK(reply_is(peri_write(cont, peri_address(0x0000), data), &crc, 1), "no peripheral");
+    CHECK(cont->stats.commands[N64_STAT_PERI_WRITE] == 1, "write not counted");
+}
+
+//Everything a peripheral handler can change
+typedef struct
+{
+    n64_rumblepak rpak;
+    n64_mempack mempack;
+    n64_transferpak tpak;
+    gameboycart cart;
+    uint8_t ram[0x2000];
+} peri_snapshot;
+
+static void take_snapshot(n64_input_dev_t *cont, peri_snapshot *snap)
+{
+    memset(snap, 0, sizeof(peri_snapshot));
+    snap->rpak = *cont->rpak;
+    snap->mempack = *cont->mempack;
+    snap->tpak = *cont->tpak;
+    snap->cart = *cont->tpak->gbcart;
+    memcpy(snap->ram, cont->tpak->gbcart->ram ? cont->tpak->gbcart->ram : snap->ram, sizeof(snap->ram));
+}
+
+//Every region of each peripheral's handler table, as the ISR dispatches to it. Each access is answered with a
+//well formed reply, and regions marked for read-ahead can be read any number of times with no side effects, as
+//the main loop reads them before the console asks.
+static void check_peri_handlers()
+{
+    static const char *names[] = {"none", "rumblepak", "mempak", "virtual pak", "transferpak"};
+    static uint8_t mempak[MEMPAK_SIZE], rom[0x8000], ram[0x2000];
+    uint8_t data[32] = {0};
+
+    for (uint32_t i = 0; i < sizeof(rom); i++)
+        rom[i] = i ^ (i >> 8);
+    for (uint32_t p = 0; p < sizeof(names) / sizeof(names[0]); p++)
+    {
+        n64_input_dev_t *cont = setup(PERI_NONE);
+        gameboycart *cart = cont->tpak->gbcart;
+        memset(cart, 0, sizeof(gameboycart));
+        cart->rom = rom;
+        cart->romsize = sizeof(rom);
+        cart->num_rom_banks = 2;
+        cart->ram = ram;
+        cart->ramsize = sizeof(ram);
+        cart->num_ram_banks = 1;
+        cart->mbc = MBC1_RAM_BAT;
+        cont->mempack->data = mempak;
+        cont->mempack->id = 0;
+        cont->mempack->virtual_is_active = (p == 3);
+        static const n64_peri_type peripheral[] = {PERI_NONE, PERI_RUMBLE, PERI_MEMPAK, PERI_MEMPAK, PERI_TPAK};
+        n64_controller_set_peripheral(cont, peripheral[p]);
+        if (p == 4)
+        {
+            //Power the transferpak up and give the console access to the cart
+            memset(data, 0x84, sizeof(data));
+            peri_write(cont, peri_address(0x8000), data);
+            memset(data, 0x01, sizeof(data));
+            peri_write(cont, peri_address(0xB000), data);
+        }
+
+        const n64_peri_handlers *handlers = cont->peri_handlers;
+        for (uint32_t region = 0; region < 16; region++)
+        {
+            uint16_t address = peri_address(region << 12 | 0x0020);
+            CHECK(handlers->read32[region] != NULL && handlers->write32[region] != NULL, "%s region %x has no handler",
+                  names[p], region);
+
+            peri_snapshot before, after;
+            take_snapshot(cont, &before);
+            const sim_reply *reply = peri_read(cont, address);
+            uint8_t first[32];
+            CHECK(reply && reply->error == NULL && reply->num_bits == 33 * 8, "%s read of region %x", names[p], region);
+            if (reply == NULL || reply->num_bits != 33 * 8)
+                continue;
+            memcpy(first, reply->data, 32);
+            uint8_t crc = (p == 0) ? ~peri_data_crc(first) : peri_data_crc(first);
+            CHECK(reply->data[32] == crc, "%s read of region %x has CRC %02x, not %02x", names[p], region,
+                  reply->data[32], crc);
+
+            if (handlers->read_ahead & (1 << region))
+            {
+                reply = peri_read(cont, address);
+                take_snapshot(cont, &after);
+                CHECK(reply && memcmp(reply->data, first, 32) == 0, "%s region %x read differently twice", names[p],
+                      region);
+                CHECK(memcmp(&before, &after, sizeof(before)) == 0, "%s region %x is read-ahead but reading it changed "
+                      "the peripheral", names[p], region);
+            }
+
+            //A write is acknowledged with the data CRC, whatever the region does with it
+            memset(data, 0x00, sizeof(data));
+            crc = (p == 0) ? ~peri_data_crc(data) : peri_data_crc(data);
+            CHECK(reply_is(peri_write(cont, address, data), &crc, 1), "%s write to region %x", names[p], region);
+        }
+    }
+}
+
+//What each port is expected to reply in the current frame of four port traffic
+static struct
+{
+    uint64_t stop_edge;  //Falling edge of the console stop bit
+    uint32_t num_bits;   //Length of the reply
+    uint8_t answered;    //A good reply started in time
+} four_port[MAX_CONTROLLERS];
+static uint32_t four_port_bad_replies;
+
+#define FOUR_PORT_TIMEOUT SIM_US(10) //Latest a reply can start after the console stop bit and still count
+
+static void four_port_reply_hook(n64_input_dev_t *cont, const sim_reply *reply)
+{
+    const n64_buttonmap *state = N64_DOUBLE_BUFFER_READ(cont->b_state);
+    uint8_t command = cont->data_buffer[N64_COMMAND_POS];
+    if (reply->error != NULL || reply->num_bits != four_port[cont->id].num_bits ||
+        (command == N64_CONTROLLER_STATUS && memcmp(reply->data, state, sizeof(n64_buttonmap)) != 0))
+    {
+        four_port_bad_replies++;
+        return;
+    }
+    if (reply->first_edge > four_port[cont->id].stop_edge &&
+        reply->first_edge - four_port[cont->id].stop_edge < FOUR_PORT_TIMEOUT)
+        four_port[cont->id].answered = 1;
+}
+
+//Replays frames of traffic on all four ports, with each port's command starting 2us after the stop bit of the
+//port before it, so every port has to receive while others are still replying. Commands are a random mix of status
+//polls, mempak reads and mempak writes. Returns the number of commands sent to each port and fills in how many of
+//them didn't get a good reply in time.
+static uint32_t four_port_traffic(uint8_t hardware, uint32_t frames, uint32_t *unanswered)
+{
+    static uint8_t mempak[MAX_CONTROLLERS][MEMPAK_SIZE];
+    n64_input_dev_t *conts[MAX_CONTROLLERS];
+
+    setup(PERI_NONE);
+    sim_tx_hardware = hardware;
+    sim_reply_hook = four_port_reply_hook;
+    four_port_bad_replies = 0;
+    for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+    {
+        conts[p] = &n64_in_dev[p];
+        n64hal_gpio_init(conts[p]);
+        conts[p]->mempack->data = mempak[p];
+        conts[p]->mempack->id = 0;
+        n64_controller_set_peripheral(conts[p], PERI_MEMPAK);
+        n64_buttonmap state = {.dButtons = (uint16_t)(N64_A << p), .x_axis = (int8_t)(10 * p), .y_axis = -1};
+        N64_DOUBLE_BUFFER_WRITE(conts[p]->b_state, &state);
+        n64_controller_publish_status(conts[p]);
+        unanswered[p] = 0;
+    }
+
+    uint64_t time = next_command;
+    for (uint32_t f = 0; f < frames; f++)
+    {
+        uint32_t first[MAX_CONTROLLERS];
+        for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+        {
+            uint8_t command[3 + 32] = {N64_CONTROLLER_STATUS};
+            uint32_t len = 1, r = check_rand(), address = peri_address((r >> 8) & 0x7FE0);
+            four_port[p].num_bits = sizeof(n64_buttonmap) * 8;
+            if (r % 4 == 2 || r % 4 == 3)
+            {
+                command[0] = (r % 4 == 2) ? N64_PERI_READ : N64_PERI_WRITE;
+                command[1] = address >> 8;
+                command[2] = address & 0xFF;
+                len = (r % 4 == 2) ? 3 : sizeof(command);
+                four_port[p].num_bits = (r % 4 == 2) ? 33 * 8 : 8;
+            }
+            first[p] = sim_lines[p].num_edges;
+            four_port[p].stop_edge = sim_add_command(p, time, command, len, CHECK_BIT_CLKS);
+            four_port[p].answered = 0;
+            time = four_port[p].stop_edge + SIM_US(2);
+        }
+        sim_run_ports(conts, MAX_CONTROLLERS, first, CHECK_LATENCY);
+        for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+        {
+            sim_tx_finish(conts[p]);
+            unanswered[p] += !four_port[p].answered;
+        }
+        time = ((sim_now > time) ? sim_now : time) + CHECK_GAP;
+    }
+    sim_reply_hook = NULL;
+    return frames;
+}
+
+//The missed poll benchmark. With a transmitter per port nothing is missed. With every reply sent from the edge
+//ISR, a reply holds up the other ports for up to a millisecond and their commands are lost.
+static void check_four_port_polls()
+{
+    static const char *names[2] = {"edge ISR", "hardware"};
+    for (uint8_t hardware = 0; hardware <= 1; hardware++)
+    {
+        uint32_t unanswered[MAX_CONTROLLERS], total = 0;
+        uint32_t commands = four_port_traffic(hardware, 500, unanswered);
+        printf("Four port traffic, %s transmitter: %u commands per port, unanswered", names[hardware], commands);
+        for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+        {
+            printf(" P%u %u", p + 1, unanswered[p]);
+            total += unanswered[p];
+        }
+        printf(", %u edges lost\n", sim_lost_edges);
+
+        if (hardware)
+        {
+            CHECK(total == 0 && sim_lost_edges == 0, "%u commands unanswered, %u edges lost", total, sim_lost_edges);
+            CHECK(four_port_bad_replies == 0, "%u bad or unexpected replies", four_port_bad_replies);
+            for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+                CHECK(n64_in_dev[p].missed_polls == 0 && n64_in_dev[p].stats.idle_resets == 0,
+                      "P%u missed_polls %u idle_resets %u", p + 1, n64_in_dev[p].missed_polls,
+                      n64_in_dev[p].stats.idle_resets);
+        }
+        else
+        {
+            CHECK(total > 0, "replies from the edge ISR didn't hold up the other ports");
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    check_encode_waveform();
+    check_reply_waveform();
+    check_status_holds_buttons();
+    check_identify();
+    check_status();
+    check_status_handoff();
+    check_publish_retry();
+    check_latch_buttons();
+    check_latch_tap();
+    check_input_latency();
+    check_peri_read();
+    check_peri_write();
+    check_peri_handlers();
+    check_four_port_polls();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,244 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Fuzz target for the joybus engine in src/n64, run on a PC against the simulated hardware in n64_sim.c.
+ * Each input is turned into a data line and fed to the engine edge by edge, with main loop calls mixed in, so the
+ * command decoder, the peripheral handlers and the transferpak MBC emulation all see hostile commands. Peripheral
+ * memory is allocated to its exact size so AddressSanitizer catches any access past it.
+ *
+ * Input format. The first byte picks the setup:
+ *   bits 0-2  Peripheral. None, rumblepak, mempak, virtual pak, mempak with no memory, transferpak.
+ *   bits 3-4  Input device. Controller, mouse, randnet keyboard.
+ *   bits 5-7  Transferpak cart MBC.
+ * Every byte after that is one piece of the line:
+ *   00xxxxxx  A '0' bit, 3/4 of the period low. The period is 4us + (x - 32) * 10ns.
+ *   01xxxxxx  A '1' bit, 1/4 of the period low, with the same period.
+ *   10xxxxxx  A low pulse of x * 100ns + 50ns, then high until 4us after it started.
+ *   11mxxxxx  Line idle high for x * 40us. If m is set the main loop runs once in the gap, and if x is 31 it also
+ *             swaps to the next peripheral.
+ *
+ * Usage:
+ *   n64_fuzz corpus/        Built with clang -fsanitize=fuzzer, see the Makefile fuzz target.
+ *   n64_fuzz file...        Built without libFuzzer. Runs each file once, or each file in a directory.
+ */
+
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_wrapper.h"
+#include "n64_settings.h"
+#include "n64_virtualpak.h"
+#include "n64_transferpak_gbcarts.h"
+#include "n64_sim.h"
+
+#define FUZZ_LATENCY SIM_US(0.1) //Falling edge to the edge ISR running
+
+static n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+static n64_settings settings;
+
+static const uint8_t fuzz_mbc[8] = {ROM_ONLY, MBC1_RAM_BAT, MBC2_BAT, MBC3_TIM_RAM_BAT,
+                                    MBC5_RAM_BAT, MBC1_RAM_BAT, MBC3_TIM_RAM_BAT, MBC5_RAM_BAT};
+static const n64_input_type fuzz_type[4] = {N64_CONTROLLER, N64_MOUSE, N64_RANDNET, N64_CONTROLLER};
+
+typedef struct
+{
+    uint8_t *mempak;
+    uint8_t *rom;
+    uint8_t *ram;
+} fuzz_memory;
+
+//Installs peripheral 0-7 from the setup byte. The memory behind it is allocated to its exact size.
+static void fuzz_set_peripheral(n64_input_dev_t *cont, uint8_t peripheral, uint8_t mbc, fuzz_memory *mem)
+{
+    n64_mempack *mempack = cont->mempack;
+    gameboycart *cart = cont->tpak->gbcart;
+
+    mempack->virtual_is_active = 0;
+    mempack->data = NULL;
+    switch (peripheral % 6)
+    {
+    case 1:
+        n64_controller_set_peripheral(cont, PERI_RUMBLE);
+        break;
+    case 2:
+        if (mem->mempak == NULL)
+            mem->mempak = calloc(1, MEMPAK_SIZE);
+        mempack->id = 0;
+        mempack->data = mem->mempak;
+        n64_controller_set_peripheral(cont, PERI_MEMPAK);
+        break;
+    case 3:
+        mempack->id = VIRTUAL_PAK;
+        n64_virtualpak_init(mempack);
+        n64_controller_set_peripheral(cont, PERI_MEMPAK);
+        break;
+    case 4:
+        mempack->id = 0;
+        n64_controller_set_peripheral(cont, PERI_MEMPAK);
+        break;
+    case 5:
+        memset(cart, 0, sizeof(gameboycart));
+        cart->mbc = fuzz_mbc[mbc];
+        cart->num_rom_banks = (cart->mbc == ROM_ONLY) ? 2 : 8;
+        cart->romsize = cart->num_rom_banks * 0x4000;
+        cart->num_ram_banks = (cart->mbc == ROM_ONLY || cart->mbc == MBC2_BAT) ? 0 : 4;
+        cart->ramsize = (cart->mbc == MBC2_BAT) ? 512 : cart->num_ram_banks * 0x2000;
+        free(mem->rom);
+        free(mem->ram);
+        mem->rom = calloc(1, cart->romsize);
+        mem->ram = cart->ramsize ? calloc(1, cart->ramsize) : NULL;
+        cart->rom = mem->rom;
+        cart->ram = mem->ram;
+        tpak_reset(cont->tpak);
+        n64_controller_set_peripheral(cont, PERI_TPAK);
+        break;
+    default:
+        n64_controller_set_peripheral(cont, PERI_NONE);
+        break;
+    }
+}
+
+//One pass of the main loop, fed from the input so the state it hands the ISR changes between commands.
+static void fuzz_main_loop(n64_input_dev_t *cont, uint8_t seed)
+{
+    n64_buttonmap state = {.dButtons = (uint16_t)(seed * 0x0101), .x_axis = (int8_t)seed, .y_axis = (int8_t)~seed};
+    n64_randnet_kb kb = {.buttons = {seed, (uint16_t)(seed << 8), 0}, .flags = seed & 0x11};
+
+    cont->latch_buttons = seed & 1;
+    n64_controller_read_ahead(cont);
+    n64_controller_set_buttons(cont, &state, n64hal_hs_tick_get());
+    n64_controller_set_kb(cont, &kb);
+    n64_controller_publish_status(cont);
+    n64_controller_poll_update(cont);
+    n64_controller_latency_update(cont);
+    n64_controller_poll_due(cont, SIM_US(500));
+    if (cont->mempack->virtual_update_req == 1)
+        n64_virtualpak_update(cont->mempack);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size < 1)
+        return 0;
+
+    fuzz_memory mem = {NULL, NULL, NULL};
+    uint8_t peripheral = data[0] & 0x07;
+    uint8_t mbc = data[0] >> 5;
+
+    n64_settings_init(&settings);
+    sim_clear();
+    sim_reply_hook = NULL;
+    memset(n64_in_dev, 0, sizeof(n64_in_dev));
+    n64_subsystem_init(n64_in_dev);
+    n64_input_dev_t *cont = &n64_in_dev[0];
+    n64hal_gpio_init(cont);
+    memset(cont->rpak, 0, sizeof(n64_rumblepak));
+    memset(cont->tpak->gbcart, 0, sizeof(gameboycart));
+    cont->type = fuzz_type[(data[0] >> 3) & 0x03];
+    fuzz_set_peripheral(cont, peripheral, mbc, &mem);
+
+    //Pieces of the line are added until an idle gap, then everything since the last gap is fed to the engine
+    uint64_t time = SIM_US(1000);
+    uint32_t first = 1;
+    sim_add_sample(0, 0, 1);
+    for (size_t i = 1; i < size; i++)
+    {
+        uint8_t cell = data[i];
+        uint8_t x = cell & 0x3F;
+
+        if ((cell & 0x80) == 0)
+        {
+            uint64_t period = SIM_US(4) + (int32_t)(x - 32) * (int64_t)SIM_US(0.01);
+            sim_add_sample(0, time, 0);
+            sim_add_sample(0, time + ((cell & 0x40) ? period / 4 : period * 3 / 4), 1);
+            time += period;
+            continue;
+        }
+        if ((cell & 0x40) == 0)
+        {
+            uint64_t low = x * SIM_US(0.1) + SIM_US(0.05);
+            sim_add_sample(0, time, 0);
+            sim_add_sample(0, time + low, 1);
+            time += (low + SIM_US(0.1) > SIM_US(4)) ? low + SIM_US(0.1) : SIM_US(4);
+            continue;
+        }
+
+        uint8_t gap = cell & 0x1F;
+        sim_run(cont, first, FUZZ_LATENCY, 0, NULL);
+        first = sim_lines[0].num_edges;
+        time += gap * SIM_US(40);
+        (sim_now < time) ? sim_now = time : (0);
+        sim_tx_finish(cont);
+        if (cell & 0x20)
+        {
+            fuzz_main_loop(cont, (uint8_t)i);
+            if (gap == 0x1F)
+                fuzz_set_peripheral(cont, ++peripheral, mbc, &mem);
+        }
+        (time < sim_now) ? time = sim_now : (0);
+    }
+    sim_run(cont, first, FUZZ_LATENCY, 0, NULL);
+    sim_tx_finish(cont);
+
+    free(mem.mempak);
+    free(mem.rom);
+    free(mem.ram);
+    cont->mempack->data = NULL;
+    cont->tpak->gbcart->rom = NULL;
+    cont->tpak->gbcart->ram = NULL;
+    return 0;
+}
+
+#ifndef N64_FUZZ_LIBFUZZER
+static void fuzz_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open %s\n", path);
+        exit(1);
+    }
+    static uint8_t data[1 << 20];
+    size_t size = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+//Without libFuzzer, runs each input once so a corpus can be replayed under the sanitizers with any compiler.
+int main(int argc, char **argv)
+{
+    uint32_t inputs = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        struct stat st;
+        if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            DIR *dir = opendir(argv[i]);
+            struct dirent *entry;
+            while (dir != NULL && (entry = readdir(dir)) != NULL)
+            {
+                if (entry->d_name[0] == '.')
+                    continue;
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+                fuzz_file(path);
+                inputs++;
+            }
+            (dir != NULL) ? closedir(dir) : 0;
+        }
+        else
+        {
+            fuzz_file(argv[i]);
+            inputs++;
+        }
+    }
+    fprintf(stderr, "%u inputs ran\n", inputs);
+    return 0;
+}
+#endif
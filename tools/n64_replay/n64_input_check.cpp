@@ -0,0 +1,420 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Checks for src/input.cpp, run on a PC with the fake USB drivers in host/ and the joybus engine on the simulated
+ * hardware in n64_sim.c. Reports are fed in through the fake drivers and followed through input.cpp, the engine and
+ * the console poll that carries them, as n64_service_inputs in src/main.cpp does on the Teensy.
+ *
+ * Usage: n64_input_check
+ * Prints each failure and exits with 1 if there were any.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "USBHost_t36.h"
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_wrapper.h"
+#include "input.h"
+#include "tft.h"
+extern "C" {
+#include "n64_sim.h"
+}
+
+#define CHECK_BIT_CLKS SIM_US(4)  //Console bit period
+#define CHECK_LATENCY SIM_US(0.1) //Falling edge to the edge ISR running
+
+static uint32_t checks, failures;
+
+#define CHECK(cond, ...)                                              \
+    do                                                                \
+    {                                                                 \
+        checks++;                                                     \
+        if (!(cond))                                                  \
+        {                                                             \
+            failures++;                                               \
+            printf("FAIL %s:%d: %s: ", __func__, __LINE__, #cond);    \
+            printf(__VA_ARGS__);                                      \
+            printf("\n");                                             \
+        }                                                             \
+    } while (0)
+
+//The USB devices in src/input.cpp
+extern JoystickController *gamecontroller[];
+extern MouseController *mousecontroller[];
+extern KeyboardController *kbcontroller[];
+
+static n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+
+/* TEENSY CORE */
+uint32_t millis()
+{
+    return sim_now / SIM_US(1000);
+}
+
+uint32_t micros()
+{
+    return sim_now / SIM_US(1);
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+//Every pin reads high, so the hardwired controller is never enabled
+uint8_t digitalRead(uint8_t pin)
+{
+    return HIGH;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+}
+
+int analogRead(uint8_t pin)
+{
+    return 512;
+}
+
+void tft_flag_update()
+{
+}
+
+/* HELPERS */
+static uint32_t check_rand()
+{
+    static uint32_t state = 0x1234567;
+    state = state * 1103515245 + 12345;
+    return state >> 8;
+}
+
+//Unplugs every USB device, lets input.cpp clear its slots, and starts the engine and simulated hardware afresh.
+static void setup()
+{
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        gamecontroller[i]->connected = false;
+        gamecontroller[i]->report = false;
+    }
+    for (uint32_t i = 0; i < MAX_MICE; i++)
+        mousecontroller[i]->connected = false;
+    for (uint32_t i = 0; i < MAX_KB; i++)
+        kbcontroller[i]->connected = false;
+    input_update_input_devices();
+
+    sim_clear();
+    memset(n64_in_dev, 0, sizeof(n64_in_dev));
+    n64_subsystem_init(n64_in_dev);
+    for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+    {
+        n64hal_gpio_init(&n64_in_dev[p]);
+        memset(n64_in_dev[p].rpak, 0, sizeof(n64_rumblepak));
+        n64_in_dev[p].mempack->virtual_is_active = 0;
+        n64_controller_set_peripheral(&n64_in_dev[p], PERI_NONE);
+    }
+    sim_now = SIM_US(1000);
+}
+
+//Runs fn, and returns the timer ticks it could have read in first and last
+template <typename F>
+static void timed(F fn, uint32_t *first, uint32_t *last)
+{
+    *first = (uint32_t)sim_now;
+    fn();
+    *last = (uint32_t)sim_now;
+}
+
+//Reads the device on port c and publishes it, as n64_service_input does for a game controller
+static void service_gamecontroller(uint32_t c, n64_buttonmap *state)
+{
+    bool combo;
+    input_get_state(c, state, &combo);
+    n64_controller_set_buttons(&n64_in_dev[c], state, input_get_report_time(c));
+    n64_controller_publish_status(&n64_in_dev[c]);
+}
+
+//The console polls port c 20us from now. Returns the reply, or NULL if there wasn't one.
+static const sim_reply *poll_status(uint32_t c)
+{
+    static const uint8_t command[] = {N64_CONTROLLER_STATUS};
+    n64_input_dev_t *cont = &n64_in_dev[c];
+    uint32_t first = sim_lines[c].num_edges;
+    uint32_t replies = sim_replies;
+    sim_add_command(c, sim_now + SIM_US(20), command, sizeof(command), CHECK_BIT_CLKS);
+    sim_run(cont, first, CHECK_LATENCY, 0, NULL);
+    sim_tx_finish(cont);
+    return (sim_replies != replies) ? &sim_last_reply : NULL;
+}
+
+static uint32_t latency_count(n64_input_dev_t *cont, int32_t *bucket)
+{
+    uint32_t total = 0;
+    for (int32_t i = 0; i < N64_STAT_TURNAROUND_BUCKETS; i++)
+    {
+        total += cont->stats.input_latency[i];
+        cont->stats.input_latency[i] ? *bucket = i : (0);
+    }
+    return total;
+}
+
+/* CHECKS */
+//A game controller report is timed from when input_has_new_report first sees it, or from when input_get_state reads
+//it if nothing checked first. That time goes with the buttons through the engine, and the console poll that carries
+//them records the time since then in input_latency. Reports on one controller don't show on the other.
+static void check_gamecontroller_reports()
+{
+    //XBOX360 button bits and what they map to. No combo button, and not L+R+START together, so nothing is changed.
+    static const struct
+    {
+        uint8_t bit;
+        uint16_t n64;
+    } buttons[] = {{12, N64_A}, {13, N64_B}, {4, N64_ST}, {8, N64_LB}, {0, N64_DU}, {3, N64_DR}};
+
+    setup();
+    for (uint32_t i = 0; i < 2; i++)
+    {
+        gamecontroller[i]->connected = true;
+        gamecontroller[i]->type = JoystickController::XBOX360;
+    }
+    input_update_input_devices();
+    CHECK(input_is_gamecontroller(0) && input_is_gamecontroller(1), "controllers not registered to ports 1 and 2");
+    CHECK(input_is_report_driven(0) && input_is_report_driven(1), "controllers not report driven");
+
+    for (uint32_t i = 0; i < 300; i++)
+    {
+        uint32_t c = check_rand() % 2;
+        n64_input_dev_t *cont = &n64_in_dev[c];
+        JoystickController *joy = gamecontroller[c];
+
+        uint32_t usb_buttons = 0;
+        uint16_t expected = 0;
+        for (uint32_t b = 0; b < sizeof(buttons) / sizeof(buttons[0]); b++)
+        {
+            if (check_rand() & 1)
+            {
+                usb_buttons |= 1UL << buttons[b].bit;
+                expected |= buttons[b].n64;
+            }
+        }
+        sim_now += SIM_US(1) + check_rand() % SIM_US(5000);
+        joy->receive(usb_buttons);
+
+        //Most reports are seen by the fast path some time after they arrive. It may look more than once.
+        uint32_t first, last;
+        bool checked = (i % 3) != 2;
+        if (checked)
+        {
+            sim_now += check_rand() % SIM_US(2000);
+            bool seen;
+            timed([&] { seen = input_has_new_report(c); }, &first, &last);
+            CHECK(seen, "step %u: report on port %u not seen", i, c + 1);
+            CHECK(!input_has_new_report(1 - c), "step %u: report on port %u seen on port %u", i, c + 1, 2 - c);
+            sim_now += check_rand() % SIM_US(500);
+            CHECK(input_has_new_report(c), "step %u: report on port %u not seen again", i, c + 1);
+        }
+
+        n64_buttonmap state;
+        sim_now += check_rand() % SIM_US(1000);
+        uint32_t read_first, read_last;
+        timed([&] { service_gamecontroller(c, &state); }, &read_first, &read_last);
+        if (!checked)
+        {
+            first = read_first;
+            last = read_last;
+        }
+        uint32_t report_clks = input_get_report_time(c);
+        CHECK(report_clks - first <= last - first, "step %u: report timed at %u, not between %u and %u", i, report_clks,
+              first, last);
+        CHECK(state.dButtons == expected, "step %u: buttons %04x, not %04x", i, state.dButtons, expected);
+        CHECK(!input_has_new_report(c), "step %u: report on port %u still new after it was read", i, c + 1);
+
+        memset(cont->stats.input_latency, 0, sizeof(cont->stats.input_latency));
+        const sim_reply *reply = poll_status(c);
+        CHECK(reply != NULL && reply->error == NULL && reply->num_bits == 32 && memcmp(reply->data, &state, 4) == 0,
+              "step %u: poll on port %u didn't carry the report", i, c + 1);
+        n64_controller_latency_update(cont);
+
+        uint32_t waited = cont->status_clks - report_clks;
+        int32_t expected_bucket = 0;
+        while (expected_bucket < 31 && (waited >> (expected_bucket + 1)) != 0)
+            expected_bucket++;
+        int32_t bucket = -1;
+        uint32_t count = latency_count(cont, &bucket);
+        CHECK(count == 1 && bucket == expected_bucket, "step %u: %u recorded in bucket %d, not bucket %d", i, count,
+              bucket, expected_bucket);
+    }
+}
+
+//A PS3 pad maps through its own table. The D pad is four buttons, the sticks are 0 to 255 centred on 127 with y
+//inverted, and SELECT is the combo button.
+static void check_ps3_mapping()
+{
+    //Not R1 as well as L1, so L+R+START never turns into reset
+    static const struct
+    {
+        uint8_t bit;
+        uint16_t n64;
+    } buttons[] = {{14, N64_A}, {15, N64_B}, {13, N64_B}, {3, N64_ST}, {10, N64_LB}, {8, N64_Z},
+                   {4, N64_DU}, {7, N64_DL}, {2, N64_CU | N64_CD | N64_CL | N64_CR}};
+
+    setup();
+    gamecontroller[0]->connected = true;
+    gamecontroller[0]->type = JoystickController::PS3;
+    input_update_input_devices();
+    CHECK(input_is_gamecontroller(0), "PS3 controller not registered to port 1");
+
+    JoystickController *joy = gamecontroller[0];
+    for (uint32_t i = 0; i < 100; i++)
+    {
+        uint32_t usb_buttons = 0;
+        uint16_t expected = 0;
+        for (uint32_t b = 0; b < sizeof(buttons) / sizeof(buttons[0]); b++)
+        {
+            if (check_rand() & 1)
+            {
+                usb_buttons |= 1UL << buttons[b].bit;
+                expected |= buttons[b].n64;
+            }
+        }
+        bool select = check_rand() & 1;
+        usb_buttons |= select ? 1 : 0;
+
+        //Left stick anywhere, right stick pushed right or left of the C button threshold now and then
+        joy->axis[0] = check_rand() % 256;
+        joy->axis[1] = check_rand() % 256;
+        joy->axis[2] = 127;
+        joy->axis[5] = 127;
+        if (i % 4 == 0)
+        {
+            joy->axis[2] = (check_rand() & 1) ? 255 : 0;
+            expected |= (joy->axis[2] == 255) ? N64_CR : N64_CL;
+        }
+        joy->receive(usb_buttons);
+
+        n64_buttonmap state;
+        bool combo;
+        input_get_state(0, &state, &combo);
+        CHECK(state.dButtons == expected, "step %u: buttons %04x, not %04x", i, state.dButtons, expected);
+        CHECK(state.x_axis == (int8_t)((joy->axis[0] - 127) * 100 / 127) &&
+                  state.y_axis == (int8_t)(-((joy->axis[1] - 127) * 100 / 127)),
+              "step %u: stick %d,%d read as %d,%d", i, joy->axis[0], joy->axis[1], state.x_axis, state.y_axis);
+        CHECK(combo == select, "step %u: combo %u with SELECT %u", i, combo, select);
+    }
+    joy->axis[0] = joy->axis[1] = joy->axis[2] = joy->axis[5] = 0;
+}
+
+//Each keyboard has its own held keys and pending report. A key event is timed by the USB callback for that keyboard,
+//and only the port it is registered to sees it. A keyboard registered again starts with no keys held.
+static void check_keyboard_reports()
+{
+    static const struct
+    {
+        uint16_t key;
+        uint16_t randnet;
+    } keys[] = {{KEY_A, 0x0D07}, {KEY_S, 0x0C07}, {KEY_1, 0x0C05}, {KEY_ENTER, 0x0D04}, {KEY_SPACE, 0x0602}};
+    const uint32_t num_keys = sizeof(keys) / sizeof(keys[0]);
+
+    setup();
+    for (uint32_t k = 0; k < MAX_KB; k++)
+        kbcontroller[k]->connected = true;
+    input_update_input_devices();
+    for (uint32_t k = 0; k < MAX_KB; k++)
+        CHECK(input_is_kb(k) && input_is_report_driven(k), "keyboard %u not registered to port %u", k, k + 1);
+
+    bool held[MAX_KB][num_keys];
+    bool pending[MAX_KB] = {false};
+    uint32_t first[MAX_KB], last[MAX_KB];
+    memset(held, 0, sizeof(held));
+
+    for (uint32_t i = 0; i < 400; i++)
+    {
+        //One to three key events, on any keyboards
+        uint32_t events = 1 + check_rand() % 3;
+        for (uint32_t e = 0; e < events; e++)
+        {
+            uint32_t k = check_rand() % MAX_KB;
+            uint32_t n = check_rand() % num_keys;
+            uint32_t num_held = 0;
+            for (uint32_t j = 0; j < num_keys; j++)
+                num_held += held[k][j];
+
+            //Pressing a held key and releasing one that isn't held aren't changes
+            bool press = (check_rand() & 1) && num_held < RANDNET_MAX_BUTTONS;
+            bool change = press ? !held[k][n] : held[k][n];
+
+            sim_now += check_rand() % SIM_US(3000);
+            uint32_t t_first, t_last;
+            timed([&] { press ? kbcontroller[k]->press(keys[n].key) : kbcontroller[k]->release(keys[n].key); },
+                  &t_first, &t_last);
+            held[k][n] = press;
+            if (change && !pending[k])
+            {
+                pending[k] = true;
+                first[k] = t_first;
+                last[k] = t_last;
+            }
+        }
+
+        sim_now += check_rand() % SIM_US(2000);
+        for (uint32_t c = 0; c < MAX_KB; c++)
+        {
+            CHECK(input_has_new_report(c) == pending[c], "step %u: port %u new report %u, not %u", i, c + 1,
+                  input_has_new_report(c), pending[c]);
+            if (!pending[c] && (check_rand() & 1))
+                continue;
+
+            n64_randnet_kb state;
+            memset(&state, 0, sizeof(state));
+            bool combo;
+            input_get_state(c, &state, &combo);
+            if (pending[c])
+            {
+                uint32_t report_clks = input_get_report_time(c);
+                CHECK(report_clks - first[c] <= last[c] - first[c], "step %u: port %u timed at %u, not between %u and %u",
+                      i, c + 1, report_clks, first[c], last[c]);
+            }
+            pending[c] = false;
+            CHECK(!input_has_new_report(c), "step %u: port %u still new after it was read", i, c + 1);
+
+            //The held keys, in any order
+            uint32_t matched = 0, num_held = 0;
+            for (uint32_t j = 0; j < num_keys; j++)
+            {
+                num_held += held[c][j];
+                for (uint32_t b = 0; b < RANDNET_MAX_BUTTONS; b++)
+                    matched += held[c][j] && state.buttons[b] == keys[j].randnet;
+            }
+            uint32_t reported = 0;
+            for (uint32_t b = 0; b < RANDNET_MAX_BUTTONS; b++)
+                reported += state.buttons[b] != 0;
+            CHECK(matched == num_held && reported == num_held, "step %u: port %u has %u of %u held keys and %u others",
+                  i, c + 1, matched, num_held, reported - matched);
+        }
+    }
+
+    //Unplug keyboard 3 with keys held. Plugged back in, it's registered to the same port with nothing held.
+    kbcontroller[2]->press(KEY_A);
+    kbcontroller[2]->connected = false;
+    input_update_input_devices();
+    CHECK(!input_is_connected(2), "unplugged keyboard still on port 3");
+    kbcontroller[2]->connected = true;
+    input_update_input_devices();
+    CHECK(input_is_kb(2) && !input_has_new_report(2), "replugged keyboard on port 3 has a report pending");
+    n64_randnet_kb state;
+    memset(&state, 0, sizeof(state));
+    bool combo;
+    input_get_state(2, &state, &combo);
+    CHECK(state.buttons[0] == 0 && state.buttons[1] == 0 && state.buttons[2] == 0, "replugged keyboard has keys held");
+}
+
+int main(int argc, char **argv)
+{
+    input_init();
+    check_gamecontroller_reports();
+    check_ps3_mapping();
+    check_keyboard_reports();
+
+    printf("%u checks, %u failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,447 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Replays a logic analyser capture of a controller data line through the usb64 joybus engine on a PC.
+ * The capture is read from a VCD file or a sigrok CSV export and played through the simulated hardware in
+ * n64_sim.c, so the engine sees every falling edge exactly as the edge ISR would.
+ *
+ * For each transaction it prints the command, our emulated reply, the reply turnaround and how long the console
+ * waited since the previous transaction. A summary of the protocol health counters is printed at the end.
+ * If the capture also has the replies of a real controller or usb64, the width of each of their low pulses is
+ * summarised too, which shows how much the 1us, 2us and 3us pulses jitter on the line.
+ *
+ * Usage: n64_replay [options] capture.vcd|capture.csv
+ *   --channel NAME    Signal to use. Defaults to the first 1 bit signal
+ *   --samplerate HZ   Sample rate of a CSV export without a time column
+ *   --latency NS      Delay from each falling edge to the handler being called. Default 100
+ *   --holdoff US      Edges are ignored for this long after our reply ends. Default 10
+ *   --peri TYPE       none, rumble or mempak (blank). Default rumble
+ *   --quiet           Only print the summary
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_wrapper.h"
+#include "n64_sim.h"
+
+static int quiet;
+
+static n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+
+//Statistics gathered by the replay itself
+static uint64_t last_reply_end;
+static uint64_t gap_min = UINT64_MAX, gap_max, gap_total;
+static uint32_t gap_count;
+static uint32_t missed_polls;
+
+//Where the controller owns the line in the capture: from the console stop bit to the end of our reply plus holdoff
+typedef struct
+{
+    uint64_t start, end;
+} reply_window;
+static reply_window *windows;
+static uint32_t num_windows, windows_capacity;
+static uint64_t holdoff;
+
+/* CAPTURE LOADING */
+static char *read_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL)
+    {
+        perror(path);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char *data = malloc(len + 1);
+    if (data == NULL || fread(data, 1, len, f) != (size_t)len)
+    {
+        fprintf(stderr, "Could not read %s\n", path);
+        exit(1);
+    }
+    data[len] = '\0';
+    fclose(f);
+    return data;
+}
+
+//Parses a time with an optional unit, i.e "1ns", "10 us" or "0.5". Returns seconds.
+static double parse_time_unit(const char *number, const char *unit)
+{
+    char *end;
+    double value = strtod(number, &end);
+    if (unit == NULL || *unit == '\0')
+        unit = end;
+    while (*unit == ' ')
+        unit++;
+    if (strncmp(unit, "fs", 2) == 0) return value * 1e-15;
+    if (strncmp(unit, "ps", 2) == 0) return value * 1e-12;
+    if (strncmp(unit, "ns", 2) == 0) return value * 1e-9;
+    if (strncmp(unit, "us", 2) == 0) return value * 1e-6;
+    if (strncmp(unit, "ms", 2) == 0) return value * 1e-3;
+    return value;
+}
+
+static void load_vcd(char *data, const char *channel)
+{
+    double timescale = 1e-9;
+    char id[32] = {0};
+    double time = 0;
+    int in_header = 1;
+    char *save;
+
+    for (char *tok = strtok_r(data, " \t\r\n", &save); tok != NULL; tok = strtok_r(NULL, " \t\r\n", &save))
+    {
+        if (in_header)
+        {
+            if (strcmp(tok, "$timescale") == 0)
+            {
+                char scale[64] = {0};
+                while ((tok = strtok_r(NULL, " \t\r\n", &save)) != NULL && strcmp(tok, "$end") != 0)
+                    strncat(scale, tok, sizeof(scale) - strlen(scale) - 1);
+                timescale = parse_time_unit(scale, NULL);
+            }
+            else if (strcmp(tok, "$var") == 0)
+            {
+                char *type = strtok_r(NULL, " \t\r\n", &save);
+                char *size = strtok_r(NULL, " \t\r\n", &save);
+                char *var_id = strtok_r(NULL, " \t\r\n", &save);
+                char *name = strtok_r(NULL, " \t\r\n", &save);
+                if (type == NULL || size == NULL || var_id == NULL || name == NULL)
+                    break;
+                if (id[0] == '\0' && atoi(size) == 1 && (channel == NULL || strcmp(channel, name) == 0))
+                {
+                    strncpy(id, var_id, sizeof(id) - 1);
+                    if (!quiet)
+                        printf("Using VCD signal %s\n", name);
+                }
+            }
+            else if (strcmp(tok, "$enddefinitions") == 0)
+            {
+                in_header = 0;
+            }
+            continue;
+        }
+
+        if (tok[0] == '#')
+        {
+            time = strtod(&tok[1], NULL) * timescale;
+        }
+        else if (tok[0] == 'b' || tok[0] == 'B' || tok[0] == 'r' || tok[0] == 'R')
+        {
+            strtok_r(NULL, " \t\r\n", &save); //Vector value, skip its id
+        }
+        else if (tok[0] != '$' && strcmp(&tok[1], id) == 0)
+        {
+            //x and z are treated as high. The line is pulled up.
+            sim_add_sample(0, (uint64_t)(time * SIM_TICK_HZ + 0.5), tok[0] != '0');
+        }
+    }
+
+    if (id[0] == '\0')
+    {
+        fprintf(stderr, "No matching 1 bit signal found in VCD\n");
+        exit(1);
+    }
+}
+
+static void load_csv(char *data, const char *channel, double samplerate)
+{
+    int time_column = -1, value_column = -1;
+    uint64_t sample = 0;
+    int header_done = 0;
+    char *save;
+
+    for (char *line = strtok_r(data, "\r\n", &save); line != NULL; line = strtok_r(NULL, "\r\n", &save))
+    {
+        if (line[0] == ';' || line[0] == '#' || line[0] == '\0')
+            continue;
+
+        char *fields[64];
+        int num_fields = 0;
+        char *field_save;
+        for (char *f = strtok_r(line, ",", &field_save); f != NULL && num_fields < 64; f = strtok_r(NULL, ",", &field_save))
+        {
+            while (*f == ' ' || *f == '"')
+                f++;
+            char *e = f + strlen(f);
+            while (e > f && (e[-1] == ' ' || e[-1] == '"'))
+                *--e = '\0';
+            fields[num_fields++] = f;
+        }
+
+        //sigrok exports a header row naming each column
+        if (!header_done && num_fields > 0 && (fields[0][0] < '0' || fields[0][0] > '9'))
+        {
+            for (int i = 0; i < num_fields; i++)
+            {
+                if (strncasecmp(fields[i], "time", 4) == 0)
+                    time_column = i;
+                else if (value_column < 0 && (channel == NULL || strcmp(channel, fields[i]) == 0))
+                    value_column = i;
+            }
+            header_done = 1;
+            if (value_column < 0)
+            {
+                fprintf(stderr, "No matching channel found in CSV header\n");
+                exit(1);
+            }
+            if (!quiet)
+                printf("Using CSV column %s\n", fields[value_column]);
+            continue;
+        }
+        if (!header_done)
+        {
+            value_column = 0;
+            header_done = 1;
+        }
+        if (value_column >= num_fields || (time_column >= num_fields))
+            continue;
+
+        double time;
+        if (time_column >= 0)
+            time = parse_time_unit(fields[time_column], NULL);
+        else if (samplerate > 0)
+            time = sample / samplerate;
+        else
+        {
+            fprintf(stderr, "CSV has no time column, use --samplerate\n");
+            exit(1);
+        }
+        sample++;
+        sim_add_sample(0, (uint64_t)(time * SIM_TICK_HZ + 0.5), fields[value_column][0] != '0');
+    }
+}
+
+/* REPORTING */
+static const char *command_name(uint8_t command)
+{
+    switch (command)
+    {
+    case N64_IDENTIFY:          return "IDENTIFY";
+    case N64_CONTROLLER_STATUS: return "STATUS";
+    case N64_PERI_READ:         return "PERI_READ";
+    case N64_PERI_WRITE:        return "PERI_WRITE";
+    case N64_RANDNET_REQ:       return "RANDNET";
+    case N64_CONTROLLER_RESET:  return "RESET";
+    default:                    return "UNKNOWN";
+    }
+}
+
+static void print_bytes(const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i < len && i < 8; i++)
+        printf(" %02x", data[i]);
+    printf("%s", (len > 8) ? " ..." : "");
+}
+
+//Prints each transaction as our reply to it starts
+static void print_reply(n64_input_dev_t *controller, const sim_reply *reply)
+{
+    uint8_t command = controller->data_buffer[N64_COMMAND_POS];
+    uint32_t command_len = 1;
+    (command == N64_PERI_READ) ? command_len = N64_DATA_POS : (0);
+    (command == N64_PERI_WRITE) ? command_len = N64_CRC_POS : (0);
+    (command == N64_RANDNET_REQ) ? command_len = RANDNET_BTN_POS : (0);
+
+    uint64_t gap = sim_command_start - last_reply_end;
+    if (last_reply_end != 0 && sim_command_start > last_reply_end)
+    {
+        (gap < gap_min) ? gap_min = gap : (0);
+        (gap > gap_max) ? gap_max = gap : (0);
+        gap_total += gap;
+        gap_count++;
+    }
+
+    if (!quiet)
+    {
+        printf("%14.2f us  %-10s cmd:", sim_edge_time * 1e6 / SIM_TICK_HZ, command_name(command));
+        print_bytes(controller->data_buffer, command_len);
+        printf("  reply:");
+        print_bytes(reply->data, reply->num_bits / 8);
+        printf("  turnaround %.2f us", controller->tx_turnaround_clks * 1e6 / SIM_TICK_HZ);
+        if (last_reply_end != 0)
+            printf("  gap %.2f us", gap * 1e6 / SIM_TICK_HZ);
+        if (reply->error != NULL)
+            printf("  BAD WAVEFORM: %s", reply->error);
+        printf("\n");
+    }
+    last_reply_end = reply->end;
+
+    if (num_windows == windows_capacity)
+    {
+        windows_capacity = windows_capacity ? windows_capacity * 2 : 1024;
+        windows = realloc(windows, windows_capacity * sizeof(reply_window));
+        if (windows == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    windows[num_windows].start = sim_edge_time;
+    windows[num_windows].end = reply->end + holdoff;
+    num_windows++;
+}
+
+static void print_missed_polls(n64_input_dev_t *cont, uint32_t edge)
+{
+    if (cont->missed_polls != missed_polls)
+    {
+        missed_polls = cont->missed_polls;
+        if (!quiet)
+            printf("%14.2f us  Previous command was not answered\n",
+                   sim_lines[0].edges[edge].time * 1e6 / SIM_TICK_HZ);
+    }
+}
+
+//Widths of the controller's low pulses in the capture, sorted by the nominal 1us, 2us (stop bit) and 3us widths
+static void print_reply_pulses()
+{
+    static const char *names[3] = {"1us ('1')", "2us (stop)", "3us ('0')"};
+    double sum[3] = {0}, sum_sq[3] = {0}, min[3] = {1e9, 1e9, 1e9}, max[3] = {0};
+    uint32_t count[3] = {0}, other = 0, w = 0;
+
+    for (uint32_t i = 1; i + 1 < sim_lines[0].num_edges && w < num_windows; i++)
+    {
+        if (sim_lines[0].edges[i].level != 0)
+            continue;
+        while (w < num_windows && sim_lines[0].edges[i].time >= windows[w].end)
+            w++;
+        if (w == num_windows || sim_lines[0].edges[i].time <= windows[w].start)
+            continue;
+
+        double width = (sim_lines[0].edges[i + 1].time - sim_lines[0].edges[i].time) * 1e9 / SIM_TICK_HZ;
+        uint32_t n = (width < 1500) ? 0 : (width < 2500) ? 1 : 2;
+        if (width > 4500)
+        {
+            other++;
+            continue;
+        }
+        sum[n] += width;
+        sum_sq[n] += width * width;
+        (width < min[n]) ? min[n] = width : (0);
+        (width > max[n]) ? max[n] = width : (0);
+        count[n]++;
+    }
+
+    if (count[0] + count[1] + count[2] + other == 0)
+        return;
+    printf("Reply pulses in the capture:\n");
+    for (uint32_t n = 0; n < 3; n++)
+    {
+        if (count[n] == 0)
+            continue;
+        double mean = sum[n] / count[n];
+        double var = sum_sq[n] / count[n] - mean * mean;
+        printf("  %-10s %8u  min %7.1f ns  mean %7.1f ns  max %7.1f ns  sd %5.1f ns\n", names[n], count[n], min[n],
+               mean, max[n], (var > 0) ? sqrt(var) : 0);
+    }
+    if (other)
+        printf("  Longer than 4.5us: %u\n", other);
+}
+
+/* REPLAY */
+static void print_summary(n64_input_dev_t *cont)
+{
+    static const char *names[N64_STAT_NUM_COMMANDS] = {"identify", "status", "read", "write",
+                                                       "randnet", "reset", "other"};
+    n64_port_stats *stats = &cont->stats;
+
+    printf("\nCommands:");
+    for (uint32_t i = 0; i < N64_STAT_NUM_COMMANDS; i++)
+        printf(" %s=%u", names[i], stats->commands[i]);
+    printf("\nMissed polls=%u addr_crc_errors=%u unknown=%u idle_resets=%u overflows=%u\n",
+           cont->missed_polls, stats->addr_crc_errors, stats->unknown_commands, stats->idle_resets, stats->overflows);
+
+    printf("Turnaround:\n");
+    for (uint32_t i = 0; i < N64_STAT_TURNAROUND_BUCKETS; i++)
+    {
+        if (stats->turnaround[i])
+            printf("  %8.3f - %8.3f us: %u\n", (1ULL << i) * 1e6 / SIM_TICK_HZ,
+                   (2ULL << i) * 1e6 / SIM_TICK_HZ, stats->turnaround[i]);
+    }
+
+    if (gap_count)
+        printf("Console gap between transactions: min %.2f us, mean %.2f us, max %.2f us\n",
+               gap_min * 1e6 / SIM_TICK_HZ, (double)gap_total / gap_count * 1e6 / SIM_TICK_HZ,
+               gap_max * 1e6 / SIM_TICK_HZ);
+    print_reply_pulses();
+}
+
+int main(int argc, char **argv)
+{
+    const char *channel = NULL, *path = NULL, *peri = "rumble";
+    double samplerate = 0, latency_ns = 100, holdoff_us = 10;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--channel") == 0 && i + 1 < argc)
+            channel = argv[++i];
+        else if (strcmp(argv[i], "--samplerate") == 0 && i + 1 < argc)
+            samplerate = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--latency") == 0 && i + 1 < argc)
+            latency_ns = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--holdoff") == 0 && i + 1 < argc)
+            holdoff_us = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--peri") == 0 && i + 1 < argc)
+            peri = argv[++i];
+        else if (strcmp(argv[i], "--quiet") == 0)
+            quiet = 1;
+        else if (argv[i][0] != '-' && path == NULL)
+            path = argv[i];
+        else
+        {
+            fprintf(stderr, "Usage: %s [--channel NAME] [--samplerate HZ] [--latency NS] [--holdoff US] "
+                            "[--peri none|rumble|mempak] [--quiet] capture.vcd|capture.csv\n", argv[0]);
+            return 1;
+        }
+    }
+    if (path == NULL)
+    {
+        fprintf(stderr, "No capture file given\n");
+        return 1;
+    }
+
+    char *data = read_file(path);
+    const char *ext = strrchr(path, '.');
+    if (ext != NULL && strcasecmp(ext, ".vcd") == 0)
+        load_vcd(data, channel);
+    else
+        load_csv(data, channel, samplerate);
+    free(data);
+
+    if (sim_lines[0].num_edges < 2)
+    {
+        fprintf(stderr, "No edges found in %s\n", path);
+        return 1;
+    }
+
+    n64_subsystem_init(n64_in_dev);
+    n64_input_dev_t *cont = &n64_in_dev[0];
+    n64hal_gpio_init(cont);
+    static uint8_t mempak[MEMPAK_SIZE];
+    if (strcmp(peri, "none") == 0)
+        n64_controller_set_peripheral(cont, PERI_NONE);
+    else if (strcmp(peri, "mempak") == 0)
+    {
+        cont->mempack->data = mempak;
+        cont->mempack->id = 0;
+        n64_controller_set_peripheral(cont, PERI_MEMPAK);
+    }
+
+    uint64_t latency = (uint64_t)(latency_ns * SIM_TICK_HZ / 1e9);
+    holdoff = (uint64_t)(holdoff_us * SIM_TICK_HZ / 1e6);
+    sim_reply_hook = print_reply;
+    sim_run(cont, 1, latency, holdoff, print_missed_polls);
+
+    print_summary(cont);
+    return 0;
+}
@@ -0,0 +1,408 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Simulated hardware for running the joybus engine in src/n64 on a PC.
+ * Each port's data line is a list of level changes against a virtual timer. sim_run feeds every falling edge to
+ * n64_controller_hande_new_edge, exactly as the edge ISR would, and the n64hal_* functions below stand in for the
+ * Teensy hardware. There is one CPU, so time the engine spends on one port's edge delays the edges on the others.
+ * Each reply the engine starts is decoded back out of its transmit schedule and checked against the joybus waveform.
+ * Used by n64_replay, n64_check and n64_fuzz.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_wrapper.h"
+#include "n64_sim.h"
+
+//A port's transmitter, playing out a schedule against virtual time
+typedef struct
+{
+    uint8_t active;
+    uint64_t end;
+    const uint32_t *slots;                   //Schedule the transmitter is playing out
+    uint32_t copy[N64_JOYBUS_MAX_TX_SLOTS];  //What it held when the transmitter started
+    uint32_t count;
+} sim_tx;
+
+sim_line sim_lines[MAX_CONTROLLERS];
+uint64_t sim_now;
+uint64_t sim_command_start;
+uint64_t sim_edge_time;
+sim_reply sim_last_reply;
+uint32_t sim_replies;
+uint32_t sim_tx_overwrites;
+uint8_t sim_tx_hardware = 1;
+uint32_t sim_lost_edges;
+void (*sim_reply_hook)(n64_input_dev_t *cont, const sim_reply *reply);
+void (*sim_tick_hook)(void);
+
+static sim_tx sim_txs[MAX_CONTROLLERS];
+static volatile uint32_t sim_gpio_dir[MAX_CONTROLLERS], sim_gpio_in[MAX_CONTROLLERS]; //Registers the engine reads
+
+/* DATA LINE */
+//Empties every line and resets virtual time. The lines idle high.
+void sim_clear(void)
+{
+    for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+    {
+        sim_lines[p].num_edges = 0;
+        sim_txs[p].active = 0;
+        sim_txs[p].end = 0;
+    }
+    sim_now = 0;
+    sim_command_start = 0;
+    sim_edge_time = 0;
+    sim_replies = 0;
+    sim_tx_overwrites = 0;
+    sim_tx_hardware = 1;
+    sim_lost_edges = 0;
+    memset(&sim_last_reply, 0, sizeof(sim_last_reply));
+}
+
+//Appends a level to a port's line. Samples that don't change the level are dropped.
+void sim_add_sample(uint32_t port, uint64_t time, uint8_t level)
+{
+    sim_line *line = &sim_lines[port];
+    if (line->num_edges > 0 && line->edges[line->num_edges - 1].level == level)
+        return;
+    if (line->num_edges == line->capacity)
+    {
+        line->capacity = line->capacity ? line->capacity * 2 : 4096;
+        line->edges = realloc(line->edges, line->capacity * sizeof(sim_edge));
+        if (line->edges == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+    }
+    line->edges[line->num_edges].time = time;
+    line->edges[line->num_edges].level = level;
+    line->num_edges++;
+}
+
+//Appends a console command starting at time. A '1' is 1/4 of bit_clks low, a '0' is 3/4 low, and the console
+//stop bit is 1/4 low. Returns the time of the stop bit's falling edge.
+uint64_t sim_add_command(uint32_t port, uint64_t time, const uint8_t *data, uint32_t len, uint64_t bit_clks)
+{
+    if (sim_lines[port].num_edges == 0)
+        sim_add_sample(port, 0, 1);
+
+    for (uint32_t i = 0; i < len * 8; i++)
+    {
+        uint8_t one = (data[i / 8] >> (7 - (i % 8))) & 1;
+        sim_add_sample(port, time, 0);
+        sim_add_sample(port, time + (one ? bit_clks / 4 : bit_clks * 3 / 4), 1);
+        time += bit_clks;
+    }
+    sim_add_sample(port, time, 0);
+    sim_add_sample(port, time + bit_clks / 4, 1);
+    return time;
+}
+
+static uint8_t sim_line_level(const sim_line *line, uint64_t time)
+{
+    if (line->num_edges == 0 || time < line->edges[0].time)
+        return 1;
+
+    uint32_t lo = 0, hi = line->num_edges;
+    while (hi - lo > 1)
+    {
+        uint32_t mid = (lo + hi) / 2;
+        (line->edges[mid].time <= time) ? lo = mid : (hi = mid);
+    }
+    return line->edges[lo].level;
+}
+
+/* REPLY DECODING */
+//Turns a transmit schedule of edges into the level of the line in each slot. 1 is driven low, 0 is released.
+void sim_slot_levels(const uint32_t *slots, uint32_t count, uint32_t *levels)
+{
+    uint32_t level = 0;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        level ^= (slots[i] != 0);
+        levels[i] = level;
+    }
+}
+
+//Decodes a transmit schedule. A controller reply is any number of released slots, then 4 slots per bit where a
+//'1' is 1 slot low and 3 released, and a '0' is 3 slots low and 1 released, then a stop bit that is 2 slots low
+//and 1 released. The first thing that doesn't match is reported in reply->error.
+void sim_decode_reply(const uint32_t *slots, uint32_t count, uint32_t edge, uint64_t slot_clks, sim_reply *reply)
+{
+    static uint32_t low[N64_JOYBUS_MAX_TX_SLOTS];
+    memset(reply, 0, sizeof(sim_reply));
+    reply->start = sim_now;
+    reply->end = sim_now + count * slot_clks;
+
+    for (uint32_t s = 0; s < count; s++)
+    {
+        if (slots[s] != 0 && slots[s] != edge)
+        {
+            reply->error = "slot is neither 0 nor an edge on this port's pin";
+            return;
+        }
+    }
+    if (count > N64_JOYBUS_MAX_TX_SLOTS)
+    {
+        reply->error = "schedule is longer than any joybus reply";
+        return;
+    }
+    sim_slot_levels(slots, count, low);
+
+    uint32_t i = 0;
+    while (i < count && low[i] == 0)
+        i++;
+    reply->idle_slots = i;
+    reply->first_edge = sim_now + i * slot_clks;
+
+    uint32_t data_slots = count - i;
+    if (data_slots < N64_JOYBUS_STOP_SLOTS || (data_slots - N64_JOYBUS_STOP_SLOTS) % N64_JOYBUS_SLOTS_PER_BIT != 0)
+    {
+        reply->error = "schedule isn't a whole number of bits and a stop bit";
+        return;
+    }
+
+    reply->num_bits = (data_slots - N64_JOYBUS_STOP_SLOTS) / N64_JOYBUS_SLOTS_PER_BIT;
+    if (reply->num_bits > sizeof(reply->data) * 8)
+    {
+        reply->error = "reply is longer than any joybus reply";
+        return;
+    }
+
+    for (uint32_t b = 0; b < reply->num_bits; b++, i += N64_JOYBUS_SLOTS_PER_BIT)
+    {
+        const uint32_t *cell = &low[i];
+        if (cell[0] && !cell[1] && !cell[2] && !cell[3])
+            reply->data[b / 8] |= 1 << (7 - (b % 8));
+        else if (!(cell[0] && cell[1] && cell[2] && !cell[3]))
+        {
+            reply->error = "bit is neither 1us low (a '1') nor 3us low (a '0')";
+            return;
+        }
+    }
+
+    if (!low[i] || !low[i + 1] || low[i + 2])
+        reply->error = "stop bit isn't 2us low then released";
+}
+
+/* SIMULATED HARDWARE */
+uint32_t n64hal_hs_tick_get_speed()
+{
+    return SIM_TICK_HZ;
+}
+
+void n64hal_hs_tick_init()
+{
+}
+
+//The input registers follow the lines as virtual time passes
+uint32_t n64hal_hs_tick_get()
+{
+    if (sim_tick_hook != NULL)
+        sim_tick_hook();
+    sim_now += SIM_TICK_STEP;
+    for (uint32_t p = 0; p < MAX_CONTROLLERS; p++)
+    {
+        if (sim_lines[p].num_edges > 0)
+            sim_gpio_in[p] = sim_line_level(&sim_lines[p], sim_now);
+    }
+    return (uint32_t)sim_now;
+}
+
+uint32_t n64hal_hs_exc_get()
+{
+    return 0;
+}
+
+void n64hal_gpio_init(n64_input_dev_t *controller)
+{
+    sim_gpio_in[controller->id] = 1;
+    controller->gpio.dir = &sim_gpio_dir[controller->id];
+    controller->gpio.in = &sim_gpio_in[controller->id];
+    controller->gpio.mask = 1;
+}
+
+//The engine's own edges aren't added to the line, so there is never one to discard
+void n64hal_input_clear_edges(n64_input_dev_t *controller)
+{
+}
+
+void n64hal_output_set(uint8_t pin, uint8_t level)
+{
+}
+
+void n64hal_tx_init()
+{
+}
+
+uint32_t n64hal_tx_edge_value(n64_input_dev_t *controller)
+{
+    return 1;
+}
+
+//Decodes the reply and plays it out against virtual time. The transmitter is busy until sim_tx_finish.
+//Like the DMA, it keeps reading the caller's schedule until then.
+//Without the hardware transmitter the reply is still decoded, then the engine plays it out itself from now.
+uint8_t n64hal_tx_start(n64_input_dev_t *controller, const uint32_t *slots, uint32_t count)
+{
+    sim_decode_reply(slots, count, n64hal_tx_edge_value(controller), controller->timing.slot_clks, &sim_last_reply);
+    sim_replies++;
+    if (sim_reply_hook != NULL)
+        sim_reply_hook(controller, &sim_last_reply);
+    if (!sim_tx_hardware)
+        return 0;
+
+    sim_tx *tx = &sim_txs[controller->id];
+    tx->slots = slots;
+    tx->count = (count < N64_JOYBUS_MAX_TX_SLOTS) ? count : N64_JOYBUS_MAX_TX_SLOTS;
+    memcpy(tx->copy, slots, tx->count * sizeof(uint32_t));
+    tx->end = sim_last_reply.end;
+    tx->active = 1;
+    return 1;
+}
+
+//The main loop stages peripheral reads while the ISR may be writing the same block, and peri_generation tells the
+//ISR to throw the staged copy away. Bytes are copied one at a time so n64_stress sees that as intended.
+void n64hal_read_extram(void *rx_buff, void *src, uint32_t offset, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+        ((uint8_t *)rx_buff)[i] = __atomic_load_n((uint8_t *)src + offset + i, __ATOMIC_RELAXED);
+}
+
+void n64hal_write_extram(void *tx_buff, void *dst, uint32_t offset, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+        __atomic_store_n((uint8_t *)dst + offset + i, ((uint8_t *)tx_buff)[i], __ATOMIC_RELAXED);
+}
+
+void n64hal_rtc_read(uint8_t *day_high, uint8_t *day_low, uint8_t *h, uint8_t *m, uint8_t *s)
+{
+    *day_high = *day_low = *h = *m = *s = 0;
+}
+
+void n64hal_rtc_write(uint8_t *day_high, uint8_t *day_low, uint8_t *h, uint8_t *m, uint8_t *s)
+{
+}
+
+uint32_t n64hal_list_gb_roms(char **list, uint32_t max)
+{
+    return 0;
+}
+
+void n64hal_read_storage(char *name, uint32_t file_offset, uint8_t *data, uint32_t len)
+{
+    memset(data, 0, len);
+}
+
+//printf from src/printf outputs through this
+void _putchar(char character)
+{
+    putchar(character);
+}
+
+/* RUNNING */
+//Waits for any reply in progress on this port to finish and hands the line back to the engine. The transmitter
+//reads the schedule as it plays it out, so a schedule changed before now counts in sim_tx_overwrites.
+void sim_tx_finish(n64_input_dev_t *cont)
+{
+    sim_tx *tx = &sim_txs[cont->id];
+    if (!tx->active)
+        return;
+    if (memcmp(tx->copy, tx->slots, tx->count * sizeof(uint32_t)) != 0)
+        sim_tx_overwrites++;
+    (sim_now < tx->end) ? sim_now = tx->end : (0);
+    tx->active = 0;
+    n64_controller_tx_complete(cont);
+}
+
+//Returns the next falling edge on a line from edge onwards, or the number of edges if there isn't one.
+static uint32_t sim_next_fall(const sim_line *line, uint32_t edge)
+{
+    (edge == 0) ? edge = 1 : (0);
+    while (edge < line->num_edges && line->edges[edge].level != 0)
+        edge++;
+    return edge;
+}
+
+//Feeds the falling edges on each port's line, from first[n] onwards for conts[n], to the engine in time order.
+//Each edge reaches the handler latency ticks after it happened, or once the CPU has finished with the edge before
+//it. Like the edge interrupt flag, later edges on a line that arrive before their handler has started are lost.
+//While a port replies, and for holdoff ticks after, its line belongs to the transmitter and its edges are ignored.
+//edge_hook is called after each edge is handled, if it is set.
+static void sim_run_lines(n64_input_dev_t **conts, uint32_t num_ports, const uint32_t *first, uint64_t latency,
+                          uint64_t holdoff, void (*edge_hook)(n64_input_dev_t *cont, uint32_t edge))
+{
+    uint32_t next[MAX_CONTROLLERS];
+    for (uint32_t n = 0; n < num_ports; n++)
+    {
+        next[n] = sim_next_fall(&sim_lines[conts[n]->id], first[n]);
+    }
+
+    while (1)
+    {
+        //Earliest falling edge on any line
+        int32_t port = -1;
+        for (uint32_t n = 0; n < num_ports; n++)
+        {
+            const sim_line *line = &sim_lines[conts[n]->id];
+            if (next[n] < line->num_edges &&
+                (port < 0 || line->edges[next[n]].time < sim_lines[conts[port]->id].edges[next[port]].time))
+                port = n;
+        }
+        if (port < 0)
+            break;
+
+        n64_input_dev_t *cont = conts[port];
+        const sim_line *line = &sim_lines[cont->id];
+        sim_tx *tx = &sim_txs[cont->id];
+        uint32_t i = next[port];
+        next[port] = sim_next_fall(line, i + 1);
+
+        if (tx->active)
+        {
+            if (line->edges[i].time < tx->end + holdoff)
+                continue;
+            sim_tx_finish(cont);
+        }
+
+        //Edges that arrive while this one is still waiting for the CPU set the same interrupt flag
+        uint64_t handled = line->edges[i].time + latency;
+        (handled < sim_now) ? handled = sim_now : (0);
+        while (next[port] < line->num_edges && line->edges[next[port]].time + latency <= handled)
+        {
+            next[port] = sim_next_fall(line, next[port] + 1);
+            sim_lost_edges++;
+        }
+
+        if (cont->port_state == N64_PORT_IDLE ||
+            (line->edges[i].time - line->edges[i - 1].time) * 1000000 > 300 * SIM_TICK_HZ)
+            sim_command_start = line->edges[i].time;
+
+        sim_edge_time = line->edges[i].time;
+        sim_now = handled;
+        n64_controller_hande_new_edge(cont);
+
+        if (edge_hook != NULL)
+            edge_hook(cont, i);
+    }
+}
+
+//Feeds the falling edges from sim_lines[cont->id].edges[first] onwards to the engine. See sim_run_lines.
+void sim_run(n64_input_dev_t *cont, uint32_t first, uint64_t latency, uint64_t holdoff,
+             void (*edge_hook)(n64_input_dev_t *cont, uint32_t edge))
+{
+    sim_run_lines(&cont, 1, &first, latency, holdoff, edge_hook);
+}
+
+//Feeds the falling edges on several ports to the engine, one CPU handling them all in time order.
+//first[n] is the first edge to feed for conts[n].
+void sim_run_ports(n64_input_dev_t **conts, uint32_t num_ports, const uint32_t *first, uint64_t latency)
+{
+    sim_run_lines(conts, num_ports, first, latency, 0, NULL);
+}
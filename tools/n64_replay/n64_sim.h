@@ -0,0 +1,79 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+#ifndef _N64_SIM_H
+#define _N64_SIM_H
+
+#include <stdint.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+
+#define SIM_TICK_HZ 600000000ULL //Same as the Teensy 4.1 cycle counter
+#define SIM_TICK_STEP 6          //Virtual time that passes each time the engine reads the timer
+#define SIM_US(us) ((uint64_t)((us) * (double)SIM_TICK_HZ / 1000000 + 0.5))
+
+typedef struct
+{
+    uint64_t time; //Ticks
+    uint8_t level;
+} sim_edge;
+
+//A reply decoded back out of a transmit schedule
+typedef struct
+{
+    uint64_t start;       //Virtual time the transmitter was started
+    uint64_t end;         //Virtual time the last slot finishes
+    uint64_t first_edge;  //Virtual time of the first falling edge, after the idle slots
+    uint32_t idle_slots;  //Released slots before the first bit
+    uint32_t num_bits;    //Data bits, not counting the stop bit
+    uint8_t data[N64_JOYBUS_MAX_TX_BYTES];
+    const char *error;    //Why the schedule isn't a valid controller reply. NULL if it is
+} sim_reply;
+
+//A port's data line, as a list of level changes against virtual time
+typedef struct
+{
+    sim_edge *edges;
+    uint32_t num_edges;
+    uint32_t capacity;
+} sim_line;
+
+//Every port has its own line, but there is one CPU. Edges on any line are handled one at a time as sim_now passes.
+extern sim_line sim_lines[MAX_CONTROLLERS];
+extern uint64_t sim_now;
+
+//Falling edge that started the command being received, and the one being handled
+extern uint64_t sim_command_start;
+extern uint64_t sim_edge_time;
+
+//Every reply the engine starts is decoded into sim_last_reply and passed to sim_reply_hook if it is set
+extern sim_reply sim_last_reply;
+extern uint32_t sim_replies;
+extern void (*sim_reply_hook)(n64_input_dev_t *cont, const sim_reply *reply);
+
+//Called each time the engine reads the clock, so a test can let other threads run in the middle of the engine
+extern void (*sim_tick_hook)(void);
+
+//Replies whose schedule was changed while the transmitter was still playing it out
+extern uint32_t sim_tx_overwrites;
+
+//Each port has a hardware transmitter by default. With this cleared n64hal_tx_start refuses every reply after
+//decoding it, so the engine sends them itself from the edge ISR.
+extern uint8_t sim_tx_hardware;
+
+//Falling edges that were never handled, because the edge interrupt for that line was still pending from an earlier
+//edge. The CPU was busy for the whole time between them.
+extern uint32_t sim_lost_edges;
+
+void sim_clear(void);
+void sim_add_sample(uint32_t port, uint64_t time, uint8_t level);
+uint64_t sim_add_command(uint32_t port, uint64_t time, const uint8_t *data, uint32_t len, uint64_t bit_clks);
+void sim_slot_levels(const uint32_t *slots, uint32_t count, uint32_t *levels);
+void sim_decode_reply(const uint32_t *slots, uint32_t count, uint32_t edge, uint64_t slot_clks, sim_reply *reply);
+void sim_run(n64_input_dev_t *cont, uint32_t first, uint64_t latency, uint64_t holdoff,
+             void (*edge_hook)(n64_input_dev_t *cont, uint32_t edge));
+void sim_run_ports(n64_input_dev_t **conts, uint32_t num_ports, const uint32_t *first, uint64_t latency);
+void sim_tx_finish(n64_input_dev_t *cont);
+
+#endif
@@ -0,0 +1,240 @@
+// Copyright 2020, Ryan Wendland, usb64
+// SPDX-License-Identifier: MIT
+
+/* Stress test for the state the main loop and the controller ISR hand each other, run on a PC against the simulated
+ * hardware in n64_sim.c. One thread is the main loop, publishing button states and staging mempak read-ahead. The
+ * other is the ISR, answering status polls and mempak reads and writes from the console, and holding each reply on
+ * the simulated transmitter for a while so the main loop publishes under it. The ISR also yields to the main loop
+ * at random points while it handles each edge. Every reply is checked
+ * against what the console should see.
+ * Threads can interleave in ways the ISR and main loop can't, as the main loop never runs in the middle of the ISR,
+ * so this checks more than the handoff needs. Built with -fsanitize=thread by make stress-check, which also reports
+ * any access the handoff doesn't order.
+ *
+ * Usage: n64_stress [polls]
+ * Prints each failure and exits with 1 if there were any.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "usb64_conf.h"
+#include "n64_controller.h"
+#include "n64_joybus.h"
+#include "n64_mempak.h"
+#include "n64_wrapper.h"
+#include "n64_sim.h"
+
+#define STRESS_BIT_CLKS SIM_US(4)  //Console bit period
+#define STRESS_LATENCY SIM_US(0.1) //Falling edge to the edge ISR running
+#define STRESS_GAP SIM_US(500)     //Idle time between the end of a reply and the next command
+#define STRESS_PERI_EVERY 4        //Every 4th command from the console is a mempak read or write
+
+static n64_input_dev_t n64_in_dev[MAX_CONTROLLERS];
+static uint8_t mempak[MEMPAK_SIZE];
+static uint32_t failures;
+static int isr_done;
+
+//Written by the ISR thread only
+static uint32_t tick_countdown;      //Clock reads until the engine yields to the main loop
+static uint8_t expected[MEMPAK_SIZE]; //Mempak contents as the console wrote them
+static uint16_t read_address;         //Block the console is reading
+static uint32_t replies, torn_replies, stale_replies, last_seq;
+static uint32_t peri_reads, peri_writes, bad_reads;
+
+//Written by the main loop thread only
+static uint32_t publishes, publish_retries;
+
+//Each published state carries a 24 bit sequence number in dButtons and x_axis, and a check byte in y_axis
+static int8_t stress_check_byte(uint16_t seq_lo, uint8_t seq_hi)
+{
+    uint32_t h = (seq_lo * 0x9E3779B1u) ^ (seq_hi * 0x85EBCA77u);
+    return (int8_t)(h >> 24);
+}
+
+static uint32_t stress_rand(uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+//Adds the 5 bit address CRC to a peripheral address
+static uint16_t stress_peri_address(uint16_t address)
+{
+    static const uint8_t bit_crc[11] = {0x15, 0x1F, 0x0B, 0x16, 0x19, 0x07, 0x0E, 0x1C, 0x0D, 0x1A, 0x01};
+    uint8_t crc = 0;
+    for (uint32_t i = 0; i < 11; i++)
+    {
+        if ((address >> (i + 5)) & 1)
+            crc ^= bit_crc[i];
+    }
+    return address | crc;
+}
+
+//Every status reply must be exactly one published state, and never older than the last one sent. Every mempak
+//read must return what the console last wrote there, even if the main loop staged the block before that write.
+static void stress_reply_hook(n64_input_dev_t *cont, const sim_reply *reply)
+{
+    if (reply->num_bits == 33 * 8)
+    {
+        if (reply->error != NULL || memcmp(reply->data, &expected[read_address], 32) != 0)
+            bad_reads++;
+        return;
+    }
+    if (reply->num_bits != sizeof(n64_buttonmap) * 8)
+        return;
+
+    n64_buttonmap state;
+    memcpy(&state, reply->data, sizeof(state));
+    uint32_t seq = state.dButtons | ((uint32_t)(uint8_t)state.x_axis << 16);
+    replies++;
+    if (reply->error != NULL || state.y_axis != stress_check_byte(state.dButtons, state.x_axis))
+    {
+        torn_replies++;
+        return;
+    }
+    if (((seq - last_seq) & 0xFFFFFF) > 0x800000)
+        stale_replies++;
+    last_seq = seq;
+}
+
+//Lets the main loop run in the middle of the engine, at a random clock read while each edge is handled. Twice, as
+//it takes two publishes to come back round to the buffer the ISR is about to send.
+static void stress_tick_hook(void)
+{
+    if (tick_countdown > 0 && --tick_countdown == 0)
+    {
+        sched_yield();
+        sched_yield();
+    }
+}
+
+//The engine reads the clock about 100 times for each edge
+static void stress_edge_hook(n64_input_dev_t *cont, uint32_t edge)
+{
+    static uint32_t rand = 2;
+    tick_countdown = 1 + stress_rand(&rand) % 128;
+}
+
+//The console. Each command is received by the engine, then the reply plays out while the main loop carries on.
+static void *stress_isr(void *arg)
+{
+    n64_input_dev_t *cont = &n64_in_dev[0];
+    uint32_t polls = *(uint32_t *)arg;
+    uint32_t rand = 1;
+    uint64_t next_command = SIM_US(1000);
+
+    //The console reads through the first 32k of the mempak, and sometimes writes the block it's about to read,
+    //which the main loop may have staged already
+    uint16_t block = 0;
+    for (uint32_t i = 0; i < polls; i++)
+    {
+        uint8_t command[3 + 32] = {N64_CONTROLLER_STATUS};
+        uint32_t len = 1;
+        if (i % STRESS_PERI_EVERY == STRESS_PERI_EVERY - 1)
+        {
+            uint16_t address = stress_peri_address(block);
+            command[1] = address >> 8;
+            command[2] = address & 0xFF;
+            if (stress_rand(&rand) % 3 == 0)
+            {
+                command[0] = N64_PERI_WRITE;
+                for (uint32_t b = 3; b < sizeof(command); b++)
+                    command[b] = stress_rand(&rand);
+                memcpy(&expected[block], &command[3], 32);
+                len = sizeof(command);
+                peri_writes++;
+            }
+            else
+            {
+                command[0] = N64_PERI_READ;
+                read_address = block;
+                len = 3;
+                peri_reads++;
+                block = (block + 0x20) & 0x7FE0;
+            }
+        }
+
+        //Old edges are dropped so the line doesn't grow. The engine only looks at the time since the last one.
+        sim_lines[0].num_edges = 0;
+        tick_countdown = 1 + stress_rand(&rand) % 128;
+        uint64_t stop_edge = sim_add_command(0, next_command, command, len, STRESS_BIT_CLKS);
+        sim_run(cont, 0, STRESS_LATENCY, 0, stress_edge_hook);
+
+        //The reply is on the wire for a while
+        for (uint32_t spin = stress_rand(&rand) % 64; spin > 0; spin--)
+            sched_yield();
+        sim_tx_finish(cont);
+        next_command = ((sim_now > stop_edge) ? sim_now : stop_edge) + STRESS_GAP;
+    }
+    __atomic_store_n(&isr_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    uint32_t polls = (argc > 1) ? strtoul(argv[1], NULL, 0) : 20000;
+
+    sim_clear();
+    memset(n64_in_dev, 0, sizeof(n64_in_dev));
+    n64_subsystem_init(n64_in_dev);
+    n64_input_dev_t *cont = &n64_in_dev[0];
+    n64hal_gpio_init(cont);
+    memset(cont->rpak, 0, sizeof(n64_rumblepak));
+    for (uint32_t i = 0; i < sizeof(mempak); i++)
+        mempak[i] = expected[i] = i * 7 + (i >> 8);
+    cont->mempack->data = mempak;
+    cont->mempack->id = 0;
+    cont->mempack->virtual_is_active = 0;
+    n64_controller_set_peripheral(cont, PERI_MEMPAK);
+    sim_reply_hook = stress_reply_hook;
+    sim_tick_hook = stress_tick_hook;
+
+    //The first state is published before the console starts polling
+    n64_buttonmap state = {0, 0, stress_check_byte(0, 0)};
+    n64_controller_set_buttons(cont, &state, 0);
+    n64_controller_publish_status(cont);
+    uint32_t generation = cont->peri_generation;
+
+    pthread_t isr;
+    pthread_create(&isr, NULL, stress_isr, &polls);
+    uint32_t seq = 1;
+    while (!__atomic_load_n(&isr_done, __ATOMIC_ACQUIRE))
+    {
+        state.dButtons = seq & 0xFFFF;
+        state.x_axis = (int8_t)(seq >> 16);
+        state.y_axis = stress_check_byte(state.dButtons, state.x_axis);
+        n64_controller_set_buttons(cont, &state, seq);
+        while (!n64_controller_publish_status(cont))
+        {
+            publish_retries++;
+            sched_yield();
+        }
+        publishes++;
+        seq = (seq + 1) & 0xFFFFFF;
+        n64_controller_read_ahead(cont);
+
+        //Back to the ISR, so on one CPU each yield in there runs exactly one pass of this loop
+        sched_yield();
+    }
+    pthread_join(isr, NULL);
+
+    printf("%u polls, %u publishes (%u retried), %u mempak reads (%u staged), %u mempak writes\n", replies, publishes,
+           publish_retries, peri_reads, cont->read_ahead.hits, peri_writes);
+    if (torn_replies || stale_replies || sim_tx_overwrites)
+    {
+        printf("FAIL %u torn replies, %u older than the one before, %u changed while they were sent\n", torn_replies,
+               stale_replies, sim_tx_overwrites);
+        failures++;
+    }
+    if (bad_reads || cont->peri_generation - generation != peri_writes)
+    {
+        printf("FAIL %u mempak reads didn't return the last write, peri_generation moved %u for %u writes\n", bad_reads,
+               cont->peri_generation - generation, peri_writes);
+        failures++;
+    }
+    return failures ? 1 : 0;
+}
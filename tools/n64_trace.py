@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+# Copyright 2020, Ryan Wendland, usb64
+# SPDX-License-Identifier: MIT
+
+"""Decodes a joybus trace file (N64TRACE.BIN) recorded by usb64 with N64_TRACE enabled.
+
+Prints each transaction, then timing statistics per command and per port.
+Usage: n64_trace.py [--stats] [--port N] N64TRACE.BIN
+"""
+
+import argparse
+import struct
+import sys
+from collections import defaultdict
+
+#Must match n64_trace_record in src/n64/n64_trace.h
+RECORD = struct.Struct('<IHHBBBB')
+PORT_SESSION = 0xFF
+PORT_DROPPED = 0xFE
+DEFAULT_TICK_HZ = 600000000
+
+COMMANDS = {
+    0x00: 'IDENTIFY',
+    0x01: 'STATUS',
+    0x02: 'PERI_READ',
+    0x03: 'PERI_WRITE',
+    0x13: 'RANDNET',
+    0xFF: 'RESET',
+}
+
+
+def read_sessions(path):
+    """Splits the file into capture sessions. Each is a list of records with timestamps unwrapped to 64 bit."""
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    sessions = []
+    session = None
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        timestamp, address, turnaround, port, command, digest, reply_crc = RECORD.unpack_from(data, offset)
+        if port == PORT_SESSION or session is None:
+            session = {'tick_hz': timestamp if port == PORT_SESSION and timestamp else DEFAULT_TICK_HZ,
+                       'records': [], 'dropped': defaultdict(int), 'last': {}, 'base': None}
+            sessions.append(session)
+            if port == PORT_SESSION:
+                continue
+        if port == PORT_DROPPED:
+            session['dropped'][command] += timestamp
+            continue
+
+        #Records are in order per port, but the ports are interleaved in blocks. Unwrap each port's 32 bit
+        #timer separately. A port's first record is placed against the first record seen in the session, and can
+        #be before it if an earlier block of that port was flushed later, so that offset is signed.
+        if session['base'] is None:
+            session['base'] = timestamp
+        if port not in session['last']:
+            time = (timestamp - session['base']) & 0xFFFFFFFF
+            if time >= 1 << 31:
+                time -= 1 << 32
+        else:
+            last_raw, last_time = session['last'][port]
+            time = last_time + ((timestamp - last_raw) & 0xFFFFFFFF)
+        session['last'][port] = (timestamp, time)
+        session['records'].append({'time': time, 'port': port, 'command': command, 'address': address,
+                                   'turnaround': turnaround, 'digest': digest, 'reply_crc': reply_crc})
+
+    #Shift each session so it starts at 0, then put the ports back in time order
+    for session in sessions:
+        start = min((r['time'] for r in session['records']), default=0)
+        for r in session['records']:
+            r['time'] -= start
+        session['records'].sort(key=lambda r: r['time'])
+    return sessions
+
+
+def summary(values):
+    return 'n=%-7u min=%9.2f mean=%9.2f max=%9.2f' % (len(values), min(values), sum(values) / len(values),
+                                                     max(values))
+
+
+def print_session(index, session, port, stats_only):
+    us = 1000000.0 / session['tick_hz']
+    records = [r for r in session['records'] if port is None or r['port'] == port]
+    print('Session %u: %u transactions, timer %u Hz' % (index, len(records), session['tick_hz']))
+
+    if not stats_only:
+        for r in records:
+            name = COMMANDS.get(r['command'], '0x%02x' % r['command'])
+            line = '%14.2f us  P%u  %-10s' % (r['time'] * us, r['port'] + 1, name)
+            if r['command'] in (0x02, 0x03):
+                line += ' addr=%04x (%04x)' % (r['address'] & 0xFFE0, r['address'])
+            else:
+                line += ' ' * 19
+            line += ' digest=%02x' % r['digest']
+            if r['command'] in (0x02, 0x03):
+                line += ' crc=%02x' % r['reply_crc']
+            else:
+                line += ' ' * 7
+            line += '  turnaround=%6.2f us' % (r['turnaround'] * us)
+            print(line)
+
+    print('\nTurnaround per command (us)')
+    turnaround = defaultdict(list)
+    for r in records:
+        turnaround[r['command']].append(r['turnaround'] * us)
+    for command in sorted(turnaround):
+        print('  %-10s %s' % (COMMANDS.get(command, '0x%02x' % command), summary(turnaround[command])))
+
+    print('\nInterval between status polls per port (ms)')
+    last = {}
+    intervals = defaultdict(list)
+    for r in records:
+        if r['command'] != 0x01:
+            continue
+        if r['port'] in last:
+            intervals[r['port']].append((r['time'] - last[r['port']]) * us / 1000.0)
+        last[r['port']] = r['time']
+    for p in sorted(intervals):
+        print('  P%u %s' % (p + 1, summary(intervals[p])))
+
+    if session['dropped']:
+        print('\nDropped records')
+        for p in sorted(session['dropped']):
+            print('  P%u %u' % (p + 1, session['dropped'][p]))
+    print('')
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Decode a usb64 joybus trace file')
+    parser.add_argument('file', help='Trace file from the SD card, i.e N64TRACE.BIN')
+    parser.add_argument('--stats', action='store_true', help='Only print the timing statistics')
+    parser.add_argument('--port', type=int, choices=range(1, 5), help='Only show this controller port (1-4)')
+    args = parser.parse_args()
+
+    sessions = read_sessions(args.file)
+    if not sessions:
+        print('No records found in %s' % args.file)
+        return 1
+
+    for index, session in enumerate(sessions):
+        print_session(index, session, None if args.port is None else args.port - 1, args.stats)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,59 @@
+#!/usr/bin/env python3
+# Copyright 2020, Ryan Wendland, usb64
+# SPDX-License-Identifier: MIT
+
+"""Tests for n64_trace.py against synthetic trace files.
+
+Usage: python3 tools/n64_trace_test.py
+"""
+
+import os
+import sys
+import tempfile
+import unittest
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+import n64_trace
+
+TICK_HZ = 600000000
+
+
+def record(timestamp, port, command=0x01):
+    return n64_trace.RECORD.pack(timestamp & 0xFFFFFFFF, 0, 0, port, command, 0, 0)
+
+
+class ReadSessionsTest(unittest.TestCase):
+    def decode(self, records):
+        with tempfile.NamedTemporaryFile(suffix='.BIN', delete=False) as f:
+            f.write(record(TICK_HZ, n64_trace.PORT_SESSION))
+            f.write(b''.join(records))
+        try:
+            return n64_trace.read_sessions(f.name)
+        finally:
+            os.unlink(f.name)
+
+    def test_ports_in_order(self):
+        sessions = self.decode([record(1000, 0), record(2000, 0), record(1500, 1)])
+        self.assertEqual([(r['port'], r['time']) for r in sessions[0]['records']], [(0, 0), (1, 500), (0, 1000)])
+
+    def test_first_records_out_of_order(self):
+        #The P2 block was flushed after the P1 block but starts earlier. It must not wrap forward by 2^32.
+        sessions = self.decode([record(1000, 0), record(3000, 0), record(500, 1), record(2500, 1)])
+        records = sessions[0]['records']
+        self.assertEqual([(r['port'], r['time']) for r in records], [(1, 0), (0, 500), (1, 2000), (0, 2500)])
+
+        #Poll intervals are computed from the sorted times, so each port keeps its own spacing
+        self.assertEqual(records[-1]['time'] - records[0]['time'], 2500)
+
+    def test_first_records_out_of_order_across_wrap(self):
+        #P1 starts just after the timer wrapped, P2's earlier block starts just before it
+        sessions = self.decode([record(0x10, 0), record(0xFFFFFFF0, 1), record(0x20, 1)])
+        self.assertEqual([(r['port'], r['time']) for r in sessions[0]['records']], [(1, 0), (0, 0x20), (1, 0x30)])
+
+    def test_port_wraps(self):
+        sessions = self.decode([record(0xFFFFFF00, 0), record(0x100, 0)])
+        self.assertEqual([r['time'] for r in sessions[0]['records']], [0, 0x200])
+
+
+if __name__ == '__main__':
+    unittest.main()